@@ -0,0 +1,894 @@
+/* bench.c - Load generator for the index server and peer transfers
+
+   Index mode drives REGISTER / SEARCH_MULTI / ONLINE_PAGE / QUIT over
+   version 2 frames from many simulated peers, with a window of requests
+   in flight per thread. Transfer mode starts a headless peer (peer -n)
+   serving one generated file and downloads it from several streams at
+   once. Both report throughput and p50/p99/p999 latency. DHT mode
+   starts a few hundred peers joined in a DHT (peer -J), has them look
+   each other's files up, and reports the hop count and latency.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#define REGISTER 'R'
+#define DOWNLOAD 'D'
+#define ACKNOWLEDGEMENT 'A'
+#define ERROR 'E'
+#define CONTENT 'C'
+#define QUIT 'Q'
+#define SEARCH_MULTI 'M'
+#define ONLINE_PAGE 'L'
+#define STATS 'Y'
+#define DHT_FIND_NODE 'N'
+
+#define NAME_MAX_LEN 255
+#define MAX_DGRAM 8192
+#define FRAME_MAX (4 << 20)
+#define REPLY_TIMEOUT_MS 1000
+#define HIST_BUCKETS 1024
+#define DHT_LOOKUP_MS 5000
+
+/* Version 2 wire format; see index.c for the field tags. */
+#define WIRE_MAGIC 0xB2
+#define WIRE_VERSION 2
+
+enum {
+    F_PEER = 1, F_CONTENT, F_ADDR, F_COUNT, F_CURSOR, F_OFFSET, F_LENGTH, F_MODE,
+    F_STATUS, F_TEXT, F_PROVIDER, F_LOAD, F_RECORD, F_ROW, F_FLAGS,
+    F_FRAME, F_EPOCH, F_MEMBER, F_DIGEST, F_CODECS, F_KEY, F_NODE, F_ORIGIN
+};
+
+#define PROVIDER_V2 1
+
+struct net_addr {
+    uint8_t family;
+    uint8_t ip[16];
+    uint16_t port;
+};
+
+struct span {
+    const char *p;
+    size_t len;
+};
+
+struct frame {
+    char type;
+    uint64_t id;
+    const char *fields, *end;
+};
+
+struct wbuf {
+    char *p, *end;
+    int overflow;
+};
+
+void put_bytes(struct wbuf *w, const void *p, size_t n) {
+    if (w->overflow || (size_t)(w->end - w->p) < n) { w->overflow = 1; return; }
+    memcpy(w->p, p, n);
+    w->p += n;
+}
+
+void put_varint(struct wbuf *w, uint64_t v) {
+    char b[10];
+    int n = 0;
+    do {
+        b[n] = v & 0x7f;
+        v >>= 7;
+        if (v) b[n] |= 0x80;
+        n++;
+    } while (v);
+    put_bytes(w, b, n);
+}
+
+void put_field(struct wbuf *w, int tag, const void *p, size_t n) {
+    char t = tag;
+    put_bytes(w, &t, 1);
+    put_varint(w, n);
+    put_bytes(w, p, n);
+}
+
+void put_name(struct wbuf *w, int tag, const char *name) {
+    put_field(w, tag, name, strlen(name));
+}
+
+void put_uint(struct wbuf *w, int tag, uint64_t v) {
+    char b[10];
+    struct wbuf tmp = { b, b + sizeof(b), 0 };
+    put_varint(&tmp, v);
+    put_field(w, tag, b, tmp.p - b);
+}
+
+void put_addr(struct wbuf *w, int tag, const struct net_addr *a) {
+    char b[19];
+    int iplen = a->family == 6 ? 16 : 4;
+    b[0] = a->family;
+    memcpy(b + 1, a->ip, iplen);
+    memcpy(b + 1 + iplen, &a->port, 2);
+    put_field(w, tag, b, 3 + iplen);
+}
+
+void frame_begin(struct wbuf *w, char *buf, size_t cap, char type, uint64_t id) {
+    *w = (struct wbuf){ buf, buf + cap, 0 };
+    char hdr[5] = { (char)WIRE_MAGIC, WIRE_VERSION, 0, 0, 0 };
+    put_bytes(w, hdr, sizeof(hdr));
+    put_bytes(w, &type, 1);
+    put_varint(w, id);
+}
+
+size_t frame_end(struct wbuf *w, char *buf) {
+    if (w->overflow) return 0;
+    size_t n = w->p - (buf + 5);
+    buf[2] = (n & 0x7f) | 0x80;
+    buf[3] = ((n >> 7) & 0x7f) | 0x80;
+    buf[4] = n >> 14;
+    return w->p - buf;
+}
+
+int get_varint(const char **p, const char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+    return 0;
+}
+
+int next_field(const char **p, const char *end, int *tag, struct span *val) {
+    const char *q = *p;
+    uint64_t n;
+    if (q >= end) return 0;
+    *tag = (unsigned char)*q++;
+    if (!get_varint(&q, end, &n) || n > (uint64_t)(end - q)) return 0;
+    val->p = q;
+    val->len = n;
+    *p = q + n;
+    return 1;
+}
+
+int span_addr(struct span s, struct net_addr *a) {
+    memset(a, 0, sizeof(*a));
+    if (s.len < 1) return 0;
+    size_t iplen = s.p[0] == 4 ? 4 : s.p[0] == 6 ? 16 : 0;
+    if (!iplen || s.len != 3 + iplen) return 0;
+    a->family = s.p[0];
+    memcpy(a->ip, s.p + 1, iplen);
+    memcpy(&a->port, s.p + 1 + iplen, 2);
+    return 1;
+}
+
+int parse_frame(const char *buf, size_t len, struct frame *f) {
+    const char *p = buf + 2, *end = buf + len;
+    uint64_t n;
+    if (len < 5 || (unsigned char)buf[0] != WIRE_MAGIC || buf[1] != WIRE_VERSION) return -1;
+    if (!get_varint(&p, end, &n) || n < 1 || n > (uint64_t)(end - p)) return -1;
+    end = p + n;
+    f->type = *p++;
+    if (!get_varint(&p, end, &f->id)) return -1;
+    f->fields = p;
+    f->end = end;
+    return 0;
+}
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Log-linear latency histogram in microseconds: values below 32 get a
+   bucket each, above that every power of two is split into 16 buckets,
+   so a percentile is within about 6% of the true value. */
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+};
+
+void hist_add(struct hist *h, double us) {
+    uint64_t v = us < 0 ? 0 : (uint64_t)us;
+    int idx;
+    if (v < 32) idx = v;
+    else {
+        int e = 63 - __builtin_clzll(v) - 4;
+        idx = e * 16 + (int)(v >> e);
+    }
+    h->count[idx]++;
+    h->total++;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) dst->count[i] += src->count[i];
+    dst->total += src->total;
+}
+
+/* Upper edge of the bucket holding quantile q. */
+double hist_quantile(const struct hist *h, double q) {
+    uint64_t want = (uint64_t)(q * h->total + 0.999999), seen = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->count[i];
+        if (seen < want) continue;
+        if (i < 32) return i + 1;
+        int e = i / 16 - 1;
+        return (double)((uint64_t)(i - e * 16 + 1) << e);
+    }
+    return 0;
+}
+
+int resolve(const char *host, int port, struct sockaddr_in *out) {
+    struct hostent *phe;
+    memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_port = htons(port);
+    if ((phe = gethostbyname(host))) memcpy(&out->sin_addr, phe->h_addr, phe->h_length);
+    else if ((out->sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) return -1;
+    return 0;
+}
+
+/* Print the index's STATS text. */
+int run_stats(struct sockaddr_in *index_addr) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("socket"); return 1; }
+    struct timeval tv = { 2, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char req[64], buf[MAX_DGRAM];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), STATS, 1);
+    ssize_t n = -1;
+    if (send(sock, req, frame_end(&w, req), 0) >= 0) n = recv(sock, buf, sizeof(buf), 0);
+    close(sock);
+    struct frame f;
+    if (n <= 0 || parse_frame(buf, n, &f) < 0 || f.type != STATS) { fprintf(stderr, "No stats from index server\n"); return 1; }
+    int tag;
+    struct span val;
+    for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); )
+        if (tag == F_TEXT) fwrite(val.p, 1, val.len, stdout);
+    return 0;
+}
+
+/* ---- Index load ---- */
+
+enum { OP_REGISTER, OP_SEARCH, OP_ONLINE, OP_QUIT, NOPS };
+const char op_letter[NOPS] = { 'R', 'S', 'O', 'Q' };
+const char *op_name[NOPS] = { "REGISTER", "SEARCH", "ONLINE", "QUIT" };
+
+struct index_bench {
+    struct sockaddr_in index_addr;
+    int peers, titles, window;
+    long ops;                   /* per thread */
+    int weight[NOPS], weight_sum;
+};
+
+struct slot {
+    uint64_t id;
+    double sent;
+    int op;
+    int busy;
+};
+
+struct index_worker {
+    struct index_bench *b;
+    int thread, nthreads;
+    struct hist h[NOPS];
+    uint64_t errors[NOPS];
+    uint64_t lost;
+    pthread_t tid;
+};
+
+/* One request from a simulated peer owned by this thread. */
+size_t build_op(struct index_worker *iw, int op, uint64_t id, uint64_t *rng, char *buf) {
+    struct index_bench *b = iw->b;
+    int per = (b->peers + iw->nthreads - 1) / iw->nthreads;
+    int p = iw->thread + iw->nthreads * (int)(xorshift(rng) % per);
+    if (p >= b->peers) p = iw->thread;
+    char peer[32], content[32];
+    snprintf(peer, sizeof(peer), "bench-%d", p);
+    snprintf(content, sizeof(content), "title-%d", (int)(xorshift(rng) % b->titles));
+
+    struct wbuf w;
+    if (op == OP_REGISTER) {
+        struct net_addr a = { 4, { 127, 0, 0, 1 }, htons(10000 + p % 50000) };
+        frame_begin(&w, buf, MAX_DGRAM, REGISTER, id);
+        put_name(&w, F_PEER, peer);
+        put_name(&w, F_CONTENT, content);
+        put_addr(&w, F_ADDR, &a);
+    } else if (op == OP_SEARCH) {
+        frame_begin(&w, buf, MAX_DGRAM, SEARCH_MULTI, id);
+        put_name(&w, F_CONTENT, content);
+        put_uint(&w, F_COUNT, 4);
+    } else if (op == OP_ONLINE) {
+        frame_begin(&w, buf, MAX_DGRAM, ONLINE_PAGE, id);
+        put_uint(&w, F_CURSOR, 0);
+    } else {
+        frame_begin(&w, buf, MAX_DGRAM, QUIT, id);
+        put_name(&w, F_PEER, peer);
+    }
+    return frame_end(&w, buf);
+}
+
+int pick_op(struct index_bench *b, uint64_t *rng) {
+    int r = xorshift(rng) % b->weight_sum;
+    for (int op = 0; op < NOPS; ++op)
+        if ((r -= b->weight[op]) < 0) return op;
+    return OP_SEARCH;
+}
+
+/* Keep up to window requests in flight; slot = id % window. A request
+   unanswered after REPLY_TIMEOUT_MS counts as lost and frees its slot. */
+void *index_worker_main(void *arg) {
+    struct index_worker *iw = arg;
+    struct index_bench *b = iw->b;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) { perror("socket"); return NULL; }
+    if (connect(sock, (struct sockaddr*)&b->index_addr, sizeof(b->index_addr)) < 0) { perror("connect"); close(sock); return NULL; }
+
+    struct slot *slots = calloc(b->window, sizeof(*slots));
+    if (!slots) { close(sock); return NULL; }
+    uint64_t rng = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)iw->thread << 32 | 1);
+    uint64_t next_id = (uint64_t)iw->thread << 40;
+    long issued = 0, finished = 0;
+    int busy = 0;
+    char buf[MAX_DGRAM], reply[65536];
+
+    while (finished < b->ops) {
+        for (int i = 0; i < b->window && issued < b->ops; ++i) {
+            struct slot *s = &slots[(next_id) % b->window];
+            if (s->busy) break;
+            s->id = next_id++;
+            s->op = pick_op(b, &rng);
+            size_t len = build_op(iw, s->op, s->id, &rng, buf);
+            s->sent = now_ms();
+            s->busy = 1;
+            busy++;
+            issued++;
+            if (send(sock, buf, len, 0) < 0 && errno != ECONNREFUSED) perror("send");
+        }
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) > 0) {
+            ssize_t n;
+            while ((n = recv(sock, reply, sizeof(reply), MSG_DONTWAIT)) > 0) {
+                struct frame f;
+                if (parse_frame(reply, n, &f) < 0) continue;
+                struct slot *s = &slots[f.id % b->window];
+                if (!s->busy || s->id != f.id) continue;
+                hist_add(&iw->h[s->op], (now_ms() - s->sent) * 1000);
+                /* Not failures as such: a REGISTER may find the row already
+                   there, a SEARCH an unregistered title, a QUIT no rows. */
+                if (f.type == ERROR) iw->errors[s->op]++;
+                s->busy = 0;
+                busy--;
+                finished++;
+            }
+        }
+
+        double t = now_ms();
+        for (int i = 0; i < b->window && busy; ++i) {
+            struct slot *s = &slots[i];
+            if (!s->busy || t - s->sent < REPLY_TIMEOUT_MS) continue;
+            s->busy = 0;
+            busy--;
+            finished++;
+            iw->lost++;
+        }
+    }
+    free(slots);
+    close(sock);
+    return NULL;
+}
+
+int parse_mix(const char *spec, struct index_bench *b) {
+    memset(b->weight, 0, sizeof(b->weight));
+    b->weight_sum = 0;
+    for (const char *p = spec; *p; ) {
+        int op;
+        for (op = 0; op < NOPS && op_letter[op] != *p; ++op);
+        if (op == NOPS) return -1;
+        char *end;
+        long w = strtol(p + 1, &end, 10);
+        if (end == p + 1 || w < 0) return -1;
+        b->weight[op] = w;
+        b->weight_sum += w;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return b->weight_sum > 0 ? 0 : -1;
+}
+
+void print_row(const char *name, const struct hist *h, uint64_t errors, double secs) {
+    if (!h->total) return;
+    printf("  %-9s %9llu %10.0f %9.0f %9.0f %9.0f %7llu\n", name, (unsigned long long)h->total, h->total / secs,
+           hist_quantile(h, 0.5), hist_quantile(h, 0.99), hist_quantile(h, 0.999), (unsigned long long)errors);
+}
+
+int run_index(struct index_bench *b, int nthreads) {
+    struct index_worker *iw = calloc(nthreads, sizeof(*iw));
+    if (!iw) { perror("calloc"); return 1; }
+    double start = now_ms();
+    for (int i = 0; i < nthreads; ++i) {
+        iw[i].b = b;
+        iw[i].thread = i;
+        iw[i].nthreads = nthreads;
+        if (pthread_create(&iw[i].tid, NULL, index_worker_main, &iw[i]) != 0) { perror("pthread_create"); return 1; }
+    }
+    for (int i = 0; i < nthreads; ++i) pthread_join(iw[i].tid, NULL);
+    double secs = (now_ms() - start) / 1000;
+
+    struct hist all, per[NOPS];
+    memset(&all, 0, sizeof(all));
+    memset(per, 0, sizeof(per));
+    uint64_t errors[NOPS] = {0}, lost = 0, err_all = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        for (int op = 0; op < NOPS; ++op) {
+            hist_merge(&per[op], &iw[i].h[op]);
+            hist_merge(&all, &iw[i].h[op]);
+            errors[op] += iw[i].errors[op];
+            err_all += iw[i].errors[op];
+        }
+        lost += iw[i].lost;
+    }
+    printf("index: %llu replies in %.2f s, %.0f ops/s (%d threads, window %d, %d peers, %d titles)\n",
+           (unsigned long long)all.total, secs, all.total / secs, nthreads, b->window, b->peers, b->titles);
+    printf("  %-9s %9s %10s %9s %9s %9s %7s\n", "op", "count", "ops/s", "p50 us", "p99 us", "p999 us", "E reply");
+    for (int op = 0; op < NOPS; ++op) print_row(op_name[op], &per[op], errors[op], secs);
+    print_row("all", &all, err_all, secs);
+    if (lost) printf("  %llu requests lost (no reply within %d ms)\n", (unsigned long long)lost, REPLY_TIMEOUT_MS);
+    free(iw);
+    return 0;
+}
+
+/* ---- Transfers ---- */
+
+struct transfer_bench {
+    struct net_addr provider;
+    const char *name;
+    uint64_t size;
+    int downloads;
+    int next;                   /* next download to start, atomically */
+};
+
+struct transfer_worker {
+    struct transfer_bench *b;
+    struct hist h;
+    uint64_t bytes;
+    int failed;
+    pthread_t tid;
+};
+
+int connect_to(const struct net_addr *a) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    memset(&ss, 0, sizeof(ss));
+    if (a->family == 6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ss;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, a->ip, 16);
+        sin6->sin6_port = a->port;
+        len = sizeof(*sin6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in*)&ss;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, a->ip, 4);
+        sin->sin_port = a->port;
+        len = sizeof(*sin);
+    }
+    int sock = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&ss, len) < 0) { close(sock); return -1; }
+    return sock;
+}
+
+ssize_t recv_all(int sock, void *buf, size_t len) {
+    size_t total = 0;
+    char *p = buf;
+    while (total < len) {
+        ssize_t r = recv(sock, p + total, len - total, MSG_WAITALL);
+        if (r < 0) { if (errno == EINTR) continue; return -1; }
+        if (r == 0) return 0;
+        total += r;
+    }
+    return total;
+}
+
+/* Fetch the whole file over an open connection and discard it; returns
+   the bytes received, or -1. */
+int64_t fetch_whole(int sock, const char *name, char *buf) {
+    char req[512];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), DOWNLOAD, 0);
+    put_name(&w, F_CONTENT, name);
+    put_uint(&w, F_OFFSET, 0);
+    put_uint(&w, F_LENGTH, 0);
+    put_uint(&w, F_FRAME, FRAME_MAX);
+    size_t len = frame_end(&w, req);
+    if (send(sock, req, len, MSG_NOSIGNAL) != (ssize_t)len) return -1;
+
+    int64_t total = 0;
+    char hdr[5];
+    while (1) {
+        if (recv_all(sock, hdr, sizeof(hdr)) <= 0 || hdr[0] != CONTENT) return -1;
+        uint32_t flen; memcpy(&flen, &hdr[1], 4); flen = ntohl(flen);
+        if (flen == 0) return total;
+        while (flen > 0) {
+            size_t n = flen > FRAME_MAX ? FRAME_MAX : flen;
+            if (recv_all(sock, buf, n) <= 0) return -1;
+            total += n;
+            flen -= n;
+        }
+    }
+}
+
+void *transfer_worker_main(void *arg) {
+    struct transfer_worker *tw = arg;
+    struct transfer_bench *b = tw->b;
+    char *buf = malloc(FRAME_MAX);
+    int sock = connect_to(&b->provider);
+    if (!buf || sock < 0) { tw->failed = 1; free(buf); if (sock >= 0) close(sock); return NULL; }
+    while (__atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED) < b->downloads) {
+        double t = now_ms();
+        int64_t n = fetch_whole(sock, b->name, buf);
+        if (n != (int64_t)b->size) { tw->failed++; break; }
+        hist_add(&tw->h, (now_ms() - t) * 1000);
+        tw->bytes += n;
+    }
+    close(sock);
+    free(buf);
+    return NULL;
+}
+
+/* Ask the index for providers of name until the headless peer shows up. */
+int find_provider(struct sockaddr_in *index_addr, const char *name, struct net_addr *out) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("socket"); return -1; }
+    struct timeval tv = { 0, 200000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        char req[512], buf[MAX_DGRAM];
+        struct wbuf w;
+        frame_begin(&w, req, sizeof(req), SEARCH_MULTI, attempt + 1);
+        put_name(&w, F_CONTENT, name);
+        put_uint(&w, F_COUNT, 1);
+        if (send(sock, req, frame_end(&w, req), 0) < 0) { usleep(200000); continue; }
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        struct frame f;
+        if (n <= 0 || parse_frame(buf, n, &f) < 0 || f.type != SEARCH_MULTI) { usleep(200000); continue; }
+        int tag, ptag;
+        struct span val, pval;
+        for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+            if (tag != F_PROVIDER) continue;
+            for (const char *q = val.p; next_field(&q, val.p + val.len, &ptag, &pval); )
+                if (ptag == F_ADDR && span_addr(pval, out)) { close(sock); return 0; }
+        }
+    }
+    close(sock);
+    return -1;
+}
+
+/* Write size bytes of incompressible data to path. */
+int make_file(const char *path, uint64_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    uint64_t *buf = malloc(1 << 20), rng = 88172645463325252ULL;
+    if (!buf) { close(fd); return -1; }
+    for (uint64_t done = 0; done < size; ) {
+        for (size_t i = 0; i < (1 << 20) / 8; ++i) buf[i] = xorshift(&rng);
+        size_t n = size - done > (1 << 20) ? (1 << 20) : (size_t)(size - done);
+        if (write(fd, buf, n) != (ssize_t)n) { free(buf); close(fd); return -1; }
+        done += n;
+    }
+    free(buf);
+    return close(fd);
+}
+
+int run_transfer(struct sockaddr_in *index_addr, const char *host, int port, const char *peer_bin,
+                 uint64_t size, int streams, int downloads) {
+    char dir[] = "/tmp/bench.XXXXXX", path[64], portstr[16];
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    struct transfer_bench b = { .size = size, .downloads = downloads };
+    char name[32];
+    snprintf(name, sizeof(name), "bench-%llu", (unsigned long long)size);
+    b.name = name;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (make_file(path, size) < 0) { perror("write"); rmdir(dir); return 1; }
+
+    /* The headless peer registers everything in dir and serves it until
+       SIGTERM, when it deregisters and quits. */
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) { dup2(null, 0); dup2(null, 1); }
+        execl(peer_bin, peer_bin, "-n", "bench-src", "-d", dir, host, portstr, (char*)NULL);
+        perror(peer_bin);
+        _exit(127);
+    }
+    int rc = 1;
+    if (pid < 0) perror("fork");
+    else if (find_provider(index_addr, name, &b.provider) < 0) fprintf(stderr, "peer never registered %s\n", name);
+    else {
+        struct transfer_worker *tw = calloc(streams, sizeof(*tw));
+        if (!tw) { perror("calloc"); goto out; }
+        double start = now_ms();
+        for (int i = 0; i < streams; ++i) {
+            tw[i].b = &b;
+            if (pthread_create(&tw[i].tid, NULL, transfer_worker_main, &tw[i]) != 0) { perror("pthread_create"); exit(1); }
+        }
+        struct hist all;
+        memset(&all, 0, sizeof(all));
+        uint64_t bytes = 0;
+        int failed = 0;
+        for (int i = 0; i < streams; ++i) {
+            pthread_join(tw[i].tid, NULL);
+            hist_merge(&all, &tw[i].h);
+            bytes += tw[i].bytes;
+            failed += tw[i].failed;
+        }
+        double secs = (now_ms() - start) / 1000;
+        printf("transfer: %llu downloads of %llu bytes in %.2f s over %d streams, %.1f MB/s\n",
+               (unsigned long long)all.total, (unsigned long long)size, secs, streams, bytes / secs / 1e6);
+        printf("  per download: p50 %.1f ms, p99 %.1f ms, p999 %.1f ms\n",
+               hist_quantile(&all, 0.5) / 1000, hist_quantile(&all, 0.99) / 1000, hist_quantile(&all, 0.999) / 1000);
+        if (failed) printf("  %d downloads failed\n", failed);
+        rc = failed ? 1 : 0;
+        free(tw);
+    }
+out:
+    if (pid > 0) { kill(pid, SIGTERM); waitpid(pid, NULL, 0); }
+    unlink(path);
+    rmdir(dir);
+    return rc;
+}
+
+/* Lines a set of peers print to one shared pipe. */
+struct line_reader {
+    int fd;
+    size_t len;
+    char buf[8192];
+};
+
+/* Copy the next line, without its newline, into line, waiting up to
+   wait_ms for it; 0 on success. A line that overflows buf is split. */
+int read_line(struct line_reader *r, char *line, size_t cap, int wait_ms) {
+    double deadline = now_ms() + wait_ms;
+    while (1) {
+        char *nl = memchr(r->buf, '\n', r->len);
+        if (nl || r->len == sizeof(r->buf)) {
+            size_t n = nl ? (size_t)(nl - r->buf) : r->len;
+            snprintf(line, cap, "%.*s", (int)n, r->buf);
+            n += nl != NULL;
+            memmove(r->buf, r->buf + n, r->len - n);
+            r->len -= n;
+            return 0;
+        }
+        struct pollfd pfd = { r->fd, POLLIN, 0 };
+        int wait = (int)(deadline - now_ms());
+        if (poll(&pfd, 1, wait > 0 ? wait : 0) <= 0) return -1;
+        ssize_t got = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+        if (got <= 0) return -1;
+        r->len += got;
+    }
+}
+
+/* Ask the node on port for nothing in particular; 0 once it answers. */
+int dht_ping(int sock, int port, uint64_t id) {
+    struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    char req[64], buf[MAX_DGRAM];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), DHT_FIND_NODE, id);
+    put_uint(&w, F_KEY, 0);
+    sendto(sock, req, frame_end(&w, req), 0, (struct sockaddr*)&to, sizeof(to));
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    while (poll(&pfd, 1, 20) > 0) {
+        struct frame f;
+        ssize_t len = recv(sock, buf, sizeof(buf), 0);
+        if (len > 0 && parse_frame(buf, len, &f) == 0 && f.id == id) return 0;
+    }
+    return -1;
+}
+
+/* Start nodes peers on loopback, each on DHT port base+i serving one
+   small file dht-<i> and joining through a random earlier node, then
+   have random nodes look up random files with their own lookup (menu
+   option 8, DHT first) and collect the hops and latency each prints.
+   The peers also register with the index; only a lookup the DHT
+   misses falls back to it. */
+int run_dht(const char *host, int port, const char *peer_bin, int nodes, int lookups, int base) {
+    char dir[] = "/tmp/bench.XXXXXX", path[96], name[32], portstr[16], dhtport[16], boot[32], line[512];
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    pid_t *pids = calloc(nodes, sizeof(*pids));
+    int *in = calloc(nodes, sizeof(*in));
+    int sock = socket(AF_INET, SOCK_DGRAM, 0), outp[2] = { -1, -1 };
+    struct line_reader *out = malloc(sizeof(*out));
+    if (!pids || !in || !out || sock < 0) { perror("socket"); return 1; }
+    if (pipe2(outp, O_CLOEXEC) < 0) { perror("pipe"); return 1; }
+    out->fd = outp[0];
+    out->len = 0;
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    uint64_t rng = 88172645463325252ULL, req_id = 1;
+    int started = 0, rc = 1;
+    double start = now_ms();
+    for (int i = 0; i < nodes; ++i) {
+        snprintf(name, sizeof(name), "dht-%d", i);
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        if (mkdir(path, 0755) < 0) { perror("mkdir"); goto out; }
+        snprintf(path, sizeof(path), "%s/%d/%s", dir, i, name);
+        if (make_file(path, 1024) < 0) { perror("write"); goto out; }
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        snprintf(dhtport, sizeof(dhtport), "%d", base + i);
+        snprintf(boot, sizeof(boot), "127.0.0.1:%d", base + (i ? (int)(xorshift(&rng) % i) : 0));
+        int inp[2];
+        if (pipe2(inp, O_CLOEXEC) < 0) { perror("pipe"); goto out; }
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(inp[0], 0);
+            dup2(outp[1], 1);
+            if (i) execl(peer_bin, peer_bin, "-d", path, "-k", "0", "-J", dhtport, "-j", boot, "-D", "first", host, portstr, (char*)NULL);
+            else execl(peer_bin, peer_bin, "-d", path, "-k", "0", "-J", dhtport, "-D", "first", host, portstr, (char*)NULL);
+            perror(peer_bin);
+            _exit(127);
+        }
+        close(inp[0]);
+        if (pid < 0) { close(inp[1]); perror("fork"); goto out; }
+        in[started] = inp[1];
+        pids[started++] = pid;
+        dprintf(inp[1], "%s\n", name);
+        /* Each node joins before the next starts, so it has a contact. */
+        int up = 0;
+        for (int attempt = 0; attempt < 250 && !up; ++attempt) {
+            while (read_line(out, line, sizeof(line), 0) == 0) ;
+            up = dht_ping(sock, base + i, req_id++) == 0;
+        }
+        if (!up) { fprintf(stderr, "DHT node %d never answered on port %d\n", i, base + i); goto out; }
+    }
+    printf("dht: %d nodes up in %.1f s; letting them publish\n", nodes, (now_ms() - start) / 1000);
+    fflush(stdout);
+    for (double until = now_ms() + 3000; now_ms() < until; )
+        read_line(out, line, sizeof(line), (int)(until - now_ms()));
+
+    struct hist h;
+    memset(&h, 0, sizeof(h));
+    int found = 0, max_hops = 0, answered = 0;
+    uint64_t hops_total = 0;
+    for (int i = 0; i < lookups; ++i) {
+        int from = xorshift(&rng) % nodes;
+        snprintf(name, sizeof(name), "dht-%d", (int)(xorshift(&rng) % nodes));
+        dprintf(in[from], "8\n%s\n", name);
+        /* Only the asked node prints a "DHT:" line. */
+        int provs = -1, hops = 0;
+        double ms = 0;
+        char *p = NULL;
+        while (!p && read_line(out, line, sizeof(line), DHT_LOOKUP_MS) == 0) p = strstr(line, "DHT: ");
+        if (!p || sscanf(p, "DHT: %d %*s of %*s in %d %*s %lf ms", &provs, &hops, &ms) != 3) {
+            fprintf(stderr, "No answer from DHT node %d for %s\n", from, name);
+            continue;
+        }
+        answered++;
+        found += provs > 0;
+        hist_add(&h, ms * 1000);
+        hops_total += hops;
+        if (hops > max_hops) max_hops = hops;
+    }
+    printf("dht: %d lookups over %d nodes, %d found (%.1f%%)\n", lookups, nodes, found, lookups ? 100.0 * found / lookups : 0);
+    printf("  hops: mean %.2f, max %d\n", answered ? (double)hops_total / answered : 0, max_hops);
+    printf("  latency: p50 %.2f ms, p99 %.2f ms, p999 %.2f ms\n",
+           hist_quantile(&h, 0.5) / 1000, hist_quantile(&h, 0.99) / 1000, hist_quantile(&h, 0.999) / 1000);
+    rc = found == lookups ? 0 : 1;
+out:
+    for (int i = 0; i < started; ++i) { close(in[i]); kill(pids[i], SIGTERM); }
+    for (int i = 0; i < started; ++i) waitpid(pids[i], NULL, 0);
+    for (int i = 0; i < nodes; ++i) {
+        snprintf(path, sizeof(path), "%s/%d/dht-%d", dir, i, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        rmdir(path);
+    }
+    rmdir(dir);
+    close(outp[0]);
+    close(outp[1]);
+    close(sock);
+    free(out);
+    free(in);
+    free(pids);
+    return rc;
+}
+
+uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': v <<= 10; /* fall through */
+        case 'M': case 'm': v <<= 10; /* fall through */
+        case 'K': case 'k': v <<= 10;
+    }
+    return v;
+}
+
+int main(int argc, char *argv[]) {
+    static struct option opts[] = {
+        {"threads", required_argument, 0, 't'},
+        {"ops", required_argument, 0, 'n'},
+        {"peers", required_argument, 0, 'p'},
+        {"titles", required_argument, 0, 'f'},
+        {"window", required_argument, 0, 'w'},
+        {"mix", required_argument, 0, 'm'},
+        {"transfer", no_argument, 0, 'x'},
+        {"size", required_argument, 0, 's'},
+        {"peer-bin", required_argument, 0, 'P'},
+        {"stats", no_argument, 0, 'y'},
+        {"dht", required_argument, 0, 'H'},
+        {"dht-port", required_argument, 0, 'B'},
+        {0, 0, 0, 0}
+    };
+    struct index_bench b = { .peers = 1000, .titles = 1000, .window = 8 };
+    const char *mix = "R40,S40,O10,Q10", *peer_bin = "./peer", *host = "localhost";
+    int nthreads = 4, transfer = 0, stats = 0, port = 3000, dht_nodes = 0, dht_port = 20000;
+    long ops = -1;
+    uint64_t size = 64 << 20;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:n:p:f:w:m:xs:P:yH:B:", opts, NULL)) != -1) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'n': ops = atol(optarg); break;
+            case 'p': b.peers = atoi(optarg); break;
+            case 'f': b.titles = atoi(optarg); break;
+            case 'w': b.window = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'x': transfer = 1; break;
+            case 's': size = parse_size(optarg); break;
+            case 'P': peer_bin = optarg; break;
+            case 'y': stats = 1; break;
+            case 'H': dht_nodes = atoi(optarg); break;
+            case 'B': dht_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [--threads N] [--ops N] [--peers N] [--titles N] [--window N] [--mix R40,S40,O10,Q10] [host [port]]\n"
+                                "       %s --transfer [--threads STREAMS] [--ops DOWNLOADS] [--size BYTES[KMG]] [--peer-bin PATH] [host [port]]\n"
+                                "       %s --dht NODES [--ops LOOKUPS] [--dht-port BASE] [--peer-bin PATH] [host [port]]\n"
+                                "       %s --stats [host [port]]\n", argv[0], argv[0], argv[0], argv[0]);
+                exit(1);
+        }
+    }
+    if (optind < argc) host = argv[optind];
+    if (optind + 1 < argc) port = atoi(argv[optind + 1]);
+    if (nthreads < 1) nthreads = 1;
+    if (b.peers < 1) b.peers = 1;
+    if (b.titles < 1) b.titles = 1;
+    if (b.window < 1) b.window = 1;
+
+    struct sockaddr_in index_addr;
+    if (resolve(host, port, &index_addr) < 0) { fprintf(stderr, "Can't get host entry\n"); exit(1); }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (stats) return run_stats(&index_addr);
+    if (dht_nodes > 0) return run_dht(host, port, peer_bin, dht_nodes, ops < 0 ? 1000 : (int)ops, dht_port);
+    if (transfer) return run_transfer(&index_addr, host, port, peer_bin, size, nthreads, ops < 0 ? 4 * nthreads : (int)ops);
+
+    if (parse_mix(mix, &b) < 0) { fprintf(stderr, "bad mix %s: letters RSOQ each followed by a weight\n", mix); exit(1); }
+    b.index_addr = index_addr;
+    b.ops = ((ops < 0 ? 200000 : ops) + nthreads - 1) / nthreads;
+    return run_index(&b, nthreads);
+}
@@ -1,12 +1,25 @@
 /* index.c - UDP Index Server */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <math.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 #define REGISTER 'R'
 #define DOWNLOAD 'D'
@@ -16,9 +29,97 @@
 #define ACKNOWLEDGEMENT 'A'
 #define ERROR 'E'
 #define QUIT 'Q'
+#define SEARCH_MULTI 'M'
+#define BATCH_UPDATE 'B'
+#define ONLINE_PAGE 'L'
+#define HEARTBEAT 'K'
+#define NAME_SEARCH 'W'
+#define NAME_PREFIX 'P'
+#define NAME_SUBSTRING 'S'
+#define STATS 'Y'
+#define SHARD_MAP 'G'
 
-#define MAX_ENTRIES 200
 #define NAME_LEN 10
+#define NAME_MAX_LEN 255
+#define INITIAL_BUCKETS 64
+#define NSHARDS 64
+#define BATCH 32
+#define MAX_PROVIDERS 16
+#define MAX_DGRAM 8192
+#define BATCH_HEADER 7
+#define BATCH_RECORD 27
+#define PAGE_MAX 1472
+#define PAGE_HEADER 11
+#define PAGE_RECORD 26
+#define CURSOR_END UINT64_MAX
+#define MATCH_MAX 100
+#define MATCH_RECORD 12
+#define CB_EMPTY INT_MIN
+#define LEASE_BUCKETS 4096
+#define DIGEST_BUCKETS 4096
+#define MAX_SIBLINGS 8
+#define WHEEL_SLOTS 512
+#define LOG_BUF (64 * 1024)
+#define LOG_ROTATE (64 << 20)
+#define SNAP_MAGIC "P2PS"
+#define SNAP_VERSION 2
+#define SNAP_HEADER_V1 (16 + 8 * (NSHARDS + 1))
+#define SNAP_HEADER (SNAP_HEADER_V1 + 4 * NSHARDS)
+#define LOG_MAGIC "P2PL"
+#define LOG_VERSION 2
+#define LOG_HEADER 8
+#define LOG_RECORD_MAX (3 + 2*NAME_MAX_LEN + 28)
+#define STAT_TYPES "RDSTOQMBLKWYG"
+#define NSTAT_TYPES (sizeof(STAT_TYPES) - 1)
+#define HIST_BUCKETS 640
+#define STATS_TOP_PEERS 16
+#define TRACE_SLOTS 4096
+#define TRACE_LINE 320
+#define CLUSTER_MAX 64
+#define VNODES 64
+#define VNODES_MAX 1024
+
+/* Version 2 wire format, for datagrams and TCP requests alike:
+     WIRE_MAGIC, WIRE_VERSION, varint body length, body
+   where the body is the type byte, a varint request id echoed in the
+   reply, then fields of a tag byte, a varint length and that many bytes.
+   Numbers inside fields are varints (LEB128). Names are 0..NAME_MAX_LEN
+   bytes with no NUL. An address is a family byte (4 or 6), the 4 or 16
+   address bytes and a be16 port. Unknown tags are skipped, so fields can
+   be added without a version bump. WIRE_MAGIC is not a PDU type letter,
+   so legacy fixed-size PDUs are still told apart by their first byte. */
+#define WIRE_MAGIC 0xB2
+#define WIRE_VERSION 2
+
+enum {
+    F_PEER = 1,                 /* peer name */
+    F_CONTENT,                  /* content name or search pattern */
+    F_ADDR,                     /* content server address */
+    F_COUNT,                    /* providers or matches wanted / provider count */
+    F_CURSOR,                   /* ONLINE_PAGE position */
+    F_OFFSET,                   /* DOWNLOAD range start */
+    F_LENGTH,                   /* DOWNLOAD range length, 0 to EOF */
+    F_MODE,                     /* NAME_SEARCH mode, or a batch record's op */
+    F_STATUS,                   /* per-record status bytes of a batch */
+    F_TEXT,                     /* human-readable message */
+    F_PROVIDER,                 /* nested F_PEER, F_ADDR, F_FLAGS, F_DIGEST, F_CONTENT */
+    F_LOAD,                     /* varint active uploads, varint egress bytes/s */
+    F_RECORD,                   /* nested F_MODE, F_CONTENT, F_DIGEST of a batch */
+    F_ROW,                      /* nested F_CONTENT, F_PEER, F_ADDR or F_COUNT */
+    F_FLAGS,                    /* provider flags */
+    F_FRAME,                    /* largest CONTENT frame a DOWNLOAD takes */
+    F_EPOCH,                    /* shard map version */
+    F_MEMBER,                   /* nested F_PEER name, F_ADDR, F_COUNT virtual nodes */
+    F_DIGEST,                   /* content digest, varint; 0 or absent if unknown */
+    F_CODECS,                   /* DOWNLOAD to a peer: frame codecs the client decodes */
+    F_KEY,                      /* peer DHT: lookup key or target node id */
+    F_NODE,                     /* peer DHT: nested F_KEY node id, F_ADDR */
+    F_ORIGIN                    /* peer DHT: sender's node id */
+};
+
+/* Provider flags: the peer registered through version 2, so its content
+   server takes version 2 requests and names longer than NAME_LEN-1. */
+#define PROVIDER_V2 1
 
 struct register_pdu {
     char type;
@@ -33,171 +134,2946 @@ struct simple_pdu {
     char data[100];
 };
 
-typedef struct {
+/* SEARCH_MULTI reply: up to MAX_PROVIDERS distinct providers of one title,
+   least used first. The request asks for at most padding[0] of them. */
+struct provider {
     char peerName[NAME_LEN];
-    char contentName[NAME_LEN];
     struct sockaddr_in addr;
+};
+
+struct provider_pdu {
+    char type;
+    char count;
+    char contentName[NAME_LEN];
+    struct provider providers[MAX_PROVIDERS];
+};
+
+/* A content server address; port in network byte order. */
+struct net_addr {
+    uint8_t family;             /* 4 or 6 */
+    uint8_t ip[16];
+    uint16_t port;
+};
+
+/* Every peer holds one lease covering all of its rows. REGISTER and
+   HEARTBEAT push the deadline forward; rows whose lease has lapsed are
+   never handed out and are reaped by the timer wheel. A lease is freed
+   once the wheel has reaped all of its rows, unless a REGISTER revived it
+   first; rows never outlive their lease, since the reap drops them
+   before the free, so they point at it without reference counting. */
+struct lease {
+    char *peerName;
+    int64_t deadline;           /* CLOCK_MONOTONIC ms, accessed atomically */
+    int64_t wheel_at;           /* tick the wheel will next look at this lease */
+    int in_wheel;
+    int reaped;                 /* rows dropped since the last REGISTER */
+    uint32_t active;            /* uploads in progress, from the last heartbeat */
+    uint32_t pending;           /* hand-outs since that heartbeat */
+    uint64_t rate;              /* measured egress in bytes/s, 0 if unknown */
+    struct lease *next;         /* hash chain */
+    struct lease *wprev, *wnext;
+};
+
+/* One row per (peer, content) registration. Rows never move once allocated;
+   freed rows are chained through peer_next and reused by later REGISTERs. */
+typedef struct {
+    struct net_addr addr;
+    uint64_t digest;            /* of the bytes served, 0 if not reported */
+    uint8_t flags;              /* PROVIDER_* */
     int used_count;
     int active;
+    int title;                  /* index into titles */
+    int peer;                   /* index into peers */
+    struct lease *lease;
+    int heap_pos;               /* position in the title's provider heap */
+    int peer_prev, peer_next;   /* links in the owning peer's row list */
 } content_entry;
 
-content_entry table[MAX_ENTRIES];
-int entry_count = 0;
+/* A distinct contentName with its providers in a min-heap on used_count. */
+typedef struct {
+    char *contentName;          /* NULL while the slot is free */
+    int *heap;
+    int heap_len, heap_cap;
+    int next;                   /* hash chain, or free list when unused */
+} title_entry;
+
+/* A distinct peerName with the list of rows it registered. */
+typedef struct {
+    char *peerName;             /* NULL while the slot is free */
+    int head;
+    int rows;
+    int next;                   /* hash chain, or free list when unused */
+} peer_entry;
+
+/* Crit-bit tree node over the contentName bytes, read as if padded with
+   NULs, for prefix search. A child >= 0 is another node; a negative child is the leaf ~title. */
+typedef struct {
+    int child[2];
+    uint16_t byte;
+    uint8_t otherbits;
+} cb_node;
+
+/* Titles containing one three-byte sequence, for substring search. */
+typedef struct {
+    uint32_t gram;
+    int *titles;
+    int len, cap;
+    int next;                   /* hash chain */
+} gram_list;
+
+struct hash_index {
+    int *buckets;
+    int nbuckets;
+    int count;
+};
+
+struct store {
+    content_entry *rows;
+    int row_count, row_cap, row_free;
+    title_entry *titles;
+    int title_count, title_cap, title_free;
+    peer_entry *peers;
+    int peer_count, peer_cap, peer_free;
+    struct hash_index by_content;
+    struct hash_index by_peer;
+    cb_node *nodes;             /* crit-bit tree over titles */
+    int node_count, node_cap, node_free;
+    int cb_root;
+    gram_list *grams;           /* trigram postings over titles */
+    int gram_count, gram_cap;
+    struct hash_index by_gram;
+    int names_ready;            /* 0 while a snapshot load defers the name indexes */
+    int row_live;               /* rows in use */
+};
+
+/* Content is partitioned by contentName hash; each shard is an independent
+   store behind its own lock so workers only contend on the same titles. */
+struct shard {
+    pthread_mutex_t lock;
+    struct store st;
+};
+
+struct shard shards[NSHARDS];
+
+struct lease *lease_table[LEASE_BUCKETS];
+struct lease *wheel[WHEEL_SLOTS];
+pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t lease_ms = 90 * 1000;   /* 0 disables expiry */
 
-void send_simple(int sock, struct sockaddr_in *to, socklen_t tolen, char type, const char *msg) {
-    struct simple_pdu sp;
-    memset(&sp,0,sizeof(sp));
-    sp.type = type;
-    if (msg) strncpy(sp.data, msg, sizeof(sp.data)-1);
-    if (sendto(sock, &sp, sizeof(sp), 0, (struct sockaddr*)to, tolen) < 0)
-        perror("sendto");
+/* Names registered with each content digest, so a SEARCH_MULTI for one
+   name can also hand out providers of the same bytes under other names.
+   One entry per (digest, name) pair, counting the rows behind it; rows
+   are linked and unlinked by add_entry and remove_entry under their
+   shard lock, which is taken before digest_lock. Grouping only spans one
+   server: in a cluster the names of a digest may live on other members. */
+struct digest_name {
+    uint64_t digest;
+    int rows;
+    struct digest_name *next;
+    char contentName[];
+};
+
+struct digest_name *digest_table[DIGEST_BUCKETS];
+pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER;
+long digest_count = 0;
+
+/* Write-ahead log of every change, buffered and written out by each
+   worker before it replies. A log file starts with LOG_MAGIC and a be32
+   version; see encode_record for the records. */
+struct {
+    pthread_mutex_t lock;
+    int fd;
+    size_t len;
+    uint64_t bytes;             /* record bytes in the current log file */
+    char buf[LOG_BUF];
+} wal = { PTHREAD_MUTEX_INITIALIZER, -1, 0, 0, {0} };
+int data_dir = -1;              /* directory fd, -1 when not persisting */
+int snapshot_secs = 300;
+int persist_stats = 0;
+
+/* Service time histogram in nanoseconds: values below 32 get a bucket
+   each, above that every power of two is split into 16 buckets, so a
+   percentile is within about 6% of the true value. */
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+};
+
+/* Per-worker counters, indexed by position in STAT_TYPES with unknown
+   types in the last slot. Only the owning worker writes them, with
+   relaxed stores, so the request path takes no lock and shares no cache
+   line; STATS sums every worker's copy when asked. */
+struct worker_stats {
+    uint64_t requests[NSTAT_TYPES + 1], errors[NSTAT_TYPES + 1];
+    uint64_t hits, misses;      /* SEARCH and SEARCH_MULTI */
+    uint64_t bytes_in, bytes_out;
+    struct hist latency[NSTAT_TYPES + 1];
+    struct worker_stats *next;
+} __attribute__((aligned(64)));
+
+struct worker_stats *stats_list = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct worker_stats *my_stats;
+int64_t started_ms;
+
+/* Optional per-request log (--log FILE), off by default. Each thread
+   formats lines into its own single-producer ring and never blocks on
+   it: a full ring drops the line and counts it. trace_main drains every
+   ring to the file. */
+struct trace_ring {
+    char line[TRACE_SLOTS][TRACE_LINE];
+    uint32_t head, tail;        /* head advanced by the owner, tail by trace_main */
+    struct trace_ring *next;
+};
+
+FILE *trace_file = NULL;
+struct trace_ring *trace_rings = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct trace_ring *my_ring;
+uint64_t trace_dropped = 0;
+
+/* Cluster mode (--cluster FILE --member NAME): several index servers
+   split the content between them by consistent hashing of contentName.
+   Each member puts vnodes points on a 64-bit ring and owns the names
+   hashing at or before each of its points, so adding or removing one
+   member only moves the names next to its own points. The map file has
+   one member per line,
+     name host:port [vnodes]
+   and is re-read when it changes. Peers fetch the map with SHARD_MAP and
+   route each name to its owner; a request for a name owned elsewhere is
+   refused with "Wrong shard" and the epoch of this server's map. */
+struct member {
+    char name[NAME_MAX_LEN+1];
+    struct net_addr addr;
+    int vnodes;
+};
+
+struct ring_point {
+    uint64_t point;
+    int member;
+};
+
+struct cluster_map {
+    uint64_t epoch;             /* hash of the member list, equal on every server */
+    int count;
+    struct member members[CLUSTER_MAX];
+    struct ring_point *ring;    /* sorted by point */
+    int npoints;
+    int self;                   /* this server's member, -1 if it is not listed */
+};
+
+struct cluster_map *cluster = NULL;     /* NULL outside cluster mode */
+pthread_rwlock_t cluster_lock = PTHREAD_RWLOCK_INITIALIZER;
+const char *cluster_file = NULL, *cluster_self = NULL;
+
+/* Legacy BATCH_UPDATE carries many registrations in one datagram:
+     type, be32 batch id, be16 count, then count records of
+     op ('R' or 'T'), peerName[NAME_LEN], contentName[NAME_LEN], be32 ip, be16 port.
+   The reply echoes type, id and count followed by one status byte per record. */
+#define STATUS_OK 'A'
+#define STATUS_DUPLICATE 'D'
+#define STATUS_MISSING 'N'
+#define STATUS_FULL 'F'
+#define STATUS_BAD 'E'
+#define STATUS_MOVED 'M'
+
+/* Legacy ONLINE_PAGE requests carry a be64 cursor in padding[0..7] (0 to start).
+   The reply is type, be64 next cursor (CURSOR_END when done), be16 count,
+   then fixed records of contentName[NAME_LEN], peerName[NAME_LEN],
+   be32 ip, be16 port, filling at most one PAGE_MAX datagram. A cursor is
+   the shard number in the high 32 bits and a row slot in the low 32. */
+struct reply {
+    size_t len;
+    char buf[MAX_DGRAM];
+};
+
+/* Bytes inside a received datagram. */
+struct span {
+    const char *p;
+    size_t len;
+};
+
+/* A request in either format. Names point into the receive buffer; for
+   version 2, fields..end covers every field so repeated ones (batch
+   records) can be walked by the handler. */
+struct request {
+    char type;
+    int v2;                     /* reply in the version 2 format */
+    uint64_t id;
+    struct span peer, content;
+    struct net_addr addr;
+    int has_addr;
+    uint64_t count, cursor;
+    int mode;
+    uint64_t active, rate;
+    uint64_t digest;
+    const char *fields, *end;
+};
+
+/* Reply writer; overflow is set instead of writing past end. */
+struct wbuf {
+    char *p, *end;
+    int overflow;
+};
+
+int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void send_register_pdu(int sock, struct sockaddr_in *to, socklen_t tolen, struct register_pdu *rpdu) {
-    if (sendto(sock, rpdu, sizeof(*rpdu), 0, (struct sockaddr*)to, tolen) < 0)
-        perror("sendto");
+int lease_live(struct lease *l, int64_t now) {
+    return __atomic_load_n(&l->deadline, __ATOMIC_RELAXED) > now;
 }
 
-int find_least_used(const char *content) {
-    int best = -1;
-    int best_count = 0x7fffffff;
-    for (int i = 0; i < entry_count; ++i) {
-        if (!table[i].active) continue;
-        if (strncmp(table[i].contentName, content, NAME_LEN) == 0) {
-            if (table[i].used_count < best_count) {
-                best_count = table[i].used_count;
-                best = i;
-            }
-        }
+int64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Only the owning thread writes a counter; the store keeps readers
+   from seeing a torn value. */
+void stat_add(uint64_t *c, uint64_t n) {
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+void hist_add(struct hist *h, uint64_t v) {
+    int idx;
+    if (v >= (1ULL << 39)) v = (1ULL << 39) - 1;
+    if (v < 32) idx = v;
+    else {
+        int e = 63 - __builtin_clzll(v) - 4;
+        idx = e * 16 + (int)(v >> e);
     }
-    return best;
+    stat_add(&h->count[idx], 1);
+}
+
+/* Upper edge of the bucket holding quantile q, 0 if h is empty. */
+uint64_t hist_quantile(const struct hist *h, double q) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) total += h->count[i];
+    if (!total) return 0;
+    uint64_t want = (uint64_t)(q * total);
+    if (want < q * total || want == 0) want++;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        if ((seen += h->count[i]) < want) continue;
+        if (i < 32) return i + 1;
+        int e = i / 16 - 1;
+        return (uint64_t)(i - e * 16 + 1) << e;
+    }
+    return 0;
+}
+
+/* Copy a request name into a NUL-terminated buffer of NAME_MAX_LEN+1
+   bytes; fails on names that are too long or hold a NUL. */
+int span_name(char *dst, struct span s) {
+    if (s.len > NAME_MAX_LEN || memchr(s.p, '\0', s.len)) return -1;
+    memcpy(dst, s.p, s.len);
+    dst[s.len] = '\0';
+    return 0;
+}
+
+/* A name from a fixed-width legacy field, NUL-padded or cut at NAME_LEN-1. */
+struct span legacy_name(const char *field) {
+    return (struct span){ field, strnlen(field, NAME_LEN-1) };
+}
+
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; ++name) { h ^= (unsigned char)*name; h *= 16777619u; }
+    return h;
+}
+
+void addr_from_sin(struct net_addr *a, const struct sockaddr_in *sin) {
+    memset(a, 0, sizeof(*a));
+    a->family = 4;
+    memcpy(a->ip, &sin->sin_addr, 4);
+    a->port = sin->sin_port;
+}
+
+/* Legacy PDUs carry a sockaddr_in, so they can only name IPv4 providers. */
+int addr_to_sin(const struct net_addr *a, struct sockaddr_in *sin) {
+    memset(sin, 0, sizeof(*sin));
+    if (a->family != 4) return -1;
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, a->ip, 4);
+    sin->sin_port = a->port;
+    return 0;
+}
+
+const char *addr_str(const struct net_addr *a, char *buf, size_t len) {
+    return inet_ntop(a->family == 6 ? AF_INET6 : AF_INET, a->ip, buf, len);
+}
+
+uint64_t get_be64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+void put_be64(char *p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) { p[i] = v & 0xff; v >>= 8; }
+}
+
+/* Buckets use the low hash bits, so pick the shard from the high ones. */
+struct shard *shard_for(const char *contentName) {
+    return &shards[hash_name(contentName) >> 26];
+}
+
+/* FNV-1a with a 64-bit finaliser, so nearby vnode labels land far apart.
+   peer.c computes the same function. */
+uint64_t ring_hash(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) { h ^= (unsigned char)p[i]; h *= 1099511628211ULL; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+int point_cmp(const void *a, const void *b) {
+    const struct ring_point *pa = a, *pb = b;
+    if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+    return pa->member - pb->member;
 }
 
-int find_exact(const char *peerName, const char *contentName) {
-    for (int i = 0; i < entry_count; ++i) {
-        if (!table[i].active) continue;
-        if (strncmp(table[i].peerName, peerName, NAME_LEN) == 0 &&
-            strncmp(table[i].contentName, contentName, NAME_LEN) == 0)
-            return i;
+/* Place vnodes points per member at the hashes of "name#0", "name#1"... */
+int ring_build(struct cluster_map *map) {
+    int n = 0;
+    for (int m = 0; m < map->count; ++m) n += map->members[m].vnodes;
+    map->ring = malloc(sizeof(struct ring_point) * (n ? n : 1));
+    if (!map->ring) return -1;
+    for (int m = 0; m < map->count; ++m)
+        for (int v = 0; v < map->members[m].vnodes; ++v) {
+            char label[NAME_MAX_LEN + 16];
+            int len = snprintf(label, sizeof(label), "%s#%d", map->members[m].name, v);
+            map->ring[map->npoints++] = (struct ring_point){ ring_hash(label, len), m };
+        }
+    qsort(map->ring, map->npoints, sizeof(struct ring_point), point_cmp);
+    return 0;
+}
+
+/* The member owning a name: the first point at or after its hash, wrapping. */
+int ring_owner(const struct cluster_map *map, const char *name) {
+    uint64_t h = ring_hash(name, strlen(name));
+    int lo = 0, hi = map->npoints;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->ring[mid].point < h) lo = mid + 1;
+        else hi = mid;
     }
+    return map->ring[lo == map->npoints ? 0 : lo].member;
+}
+
+/* Whether this server holds a name; always true outside cluster mode. */
+int owns(const char *content) {
+    pthread_rwlock_rdlock(&cluster_lock);
+    int mine = !cluster || ring_owner(cluster, content) == cluster->self;
+    pthread_rwlock_unlock(&cluster_lock);
+    return mine;
+}
+
+uint64_t cluster_epoch(void) {
+    pthread_rwlock_rdlock(&cluster_lock);
+    uint64_t epoch = cluster ? cluster->epoch : 0;
+    pthread_rwlock_unlock(&cluster_lock);
+    return epoch;
+}
+
+int grow(void **items, int *cap, int need, size_t size) {
+    if (need <= *cap) return 0;
+    int ncap = *cap ? *cap * 2 : 4;
+    while (ncap < need) ncap *= 2;
+    void *p = realloc(*items, (size_t)ncap * size);
+    if (!p) return -1;
+    *items = p;
+    *cap = ncap;
+    return 0;
+}
+
+int hash_init(struct hash_index *h, int nbuckets) {
+    h->buckets = malloc(sizeof(int) * nbuckets);
+    if (!h->buckets) return -1;
+    for (int i = 0; i < nbuckets; ++i) h->buckets[i] = -1;
+    h->nbuckets = nbuckets;
+    h->count = 0;
+    return 0;
+}
+
+int store_init(struct store *st) {
+    memset(st, 0, sizeof(*st));
+    st->row_free = st->title_free = st->peer_free = st->node_free = -1;
+    st->cb_root = CB_EMPTY;
+    st->names_ready = 1;
+    if (hash_init(&st->by_content, INITIAL_BUCKETS) < 0) return -1;
+    if (hash_init(&st->by_peer, INITIAL_BUCKETS) < 0) return -1;
+    if (hash_init(&st->by_gram, INITIAL_BUCKETS) < 0) return -1;
+    return 0;
+}
+
+/* Size an empty store for n rows up front, as when loading a snapshot. */
+int store_reserve(struct store *st, int n) {
+    if (grow((void**)&st->rows, &st->row_cap, n, sizeof(content_entry)) < 0) return -1;
+    if (grow((void**)&st->titles, &st->title_cap, n, sizeof(title_entry)) < 0) return -1;
+    int nb = INITIAL_BUCKETS;
+    while (nb < n) nb *= 2;
+    if (nb == st->by_content.nbuckets) return 0;
+    free(st->by_content.buckets);
+    return hash_init(&st->by_content, nb);
+}
+
+int find_title(struct store *st, const char *name) {
+    int i = st->by_content.buckets[hash_name(name) & (st->by_content.nbuckets-1)];
+    for (; i != -1; i = st->titles[i].next)
+        if (strcmp(st->titles[i].contentName, name) == 0) return i;
     return -1;
 }
 
-void handle_register(int sock, struct register_pdu *rpdu, struct sockaddr_in *from, socklen_t fromlen) {
-    if (find_exact(rpdu->peerName, rpdu->contentName) != -1) {
-        send_simple(sock, from, fromlen, ERROR, "Duplicate registration");
-        return;
+int find_peer(struct store *st, const char *name) {
+    int i = st->by_peer.buckets[hash_name(name) & (st->by_peer.nbuckets-1)];
+    for (; i != -1; i = st->peers[i].next)
+        if (strcmp(st->peers[i].peerName, name) == 0) return i;
+    return -1;
+}
+
+/* Double the bucket array once the load factor passes 1 and rechain. */
+void rehash_titles(struct store *st) {
+    struct hash_index *h = &st->by_content;
+    if (h->count <= h->nbuckets) return;
+    struct hash_index n;
+    if (hash_init(&n, h->nbuckets * 2) < 0) return;
+    n.count = h->count;
+    for (int b = 0; b < h->nbuckets; ++b) {
+        int i = h->buckets[b];
+        while (i != -1) {
+            int next = st->titles[i].next;
+            int nb = hash_name(st->titles[i].contentName) & (n.nbuckets-1);
+            st->titles[i].next = n.buckets[nb];
+            n.buckets[nb] = i;
+            i = next;
+        }
+    }
+    free(h->buckets);
+    *h = n;
+}
+
+void rehash_peers(struct store *st) {
+    struct hash_index *h = &st->by_peer;
+    if (h->count <= h->nbuckets) return;
+    struct hash_index n;
+    if (hash_init(&n, h->nbuckets * 2) < 0) return;
+    n.count = h->count;
+    for (int b = 0; b < h->nbuckets; ++b) {
+        int i = h->buckets[b];
+        while (i != -1) {
+            int next = st->peers[i].next;
+            int nb = hash_name(st->peers[i].peerName) & (n.nbuckets-1);
+            st->peers[i].next = n.buckets[nb];
+            n.buckets[nb] = i;
+            i = next;
+        }
+    }
+    free(h->buckets);
+    *h = n;
+}
+
+/* Name indexes. Every title is a leaf of the shard's crit-bit tree and
+   is posted under each distinct trigram of its name; both are updated
+   as titles come and go, under the shard lock like the rest of the store. */
+int cb_direction(const cb_node *q, const char *key, size_t len) {
+    unsigned char c = q->byte < len ? (unsigned char)key[q->byte] : 0;
+    return (1 + (q->otherbits | c)) >> 8;
+}
+
+int cb_alloc(struct store *st) {
+    if (st->node_free != -1) {
+        int n = st->node_free;
+        st->node_free = st->nodes[n].child[0];
+        return n;
     }
-    if (entry_count >= MAX_ENTRIES) {
-        send_simple(sock, from, fromlen, ERROR, "Server storage full");
+    if (grow((void**)&st->nodes, &st->node_cap, st->node_count+1, sizeof(cb_node)) < 0) return -1;
+    return st->node_count++;
+}
+
+/* Insert title t using the spare node n; the tree must not hold its name. */
+void cb_insert(struct store *st, int t, int n) {
+    const char *key = st->titles[t].contentName;
+    size_t len = strlen(key);
+    if (st->cb_root == CB_EMPTY) {
+        st->cb_root = ~t;
+        st->nodes[n].child[0] = st->node_free;
+        st->node_free = n;
         return;
     }
+    int p = st->cb_root;
+    while (p >= 0) p = st->nodes[p].child[cb_direction(&st->nodes[p], key, len)];
+    const char *best = st->titles[~p].contentName;
 
-    strncpy(table[entry_count].peerName, rpdu->peerName, NAME_LEN-1);
-    strncpy(table[entry_count].contentName, rpdu->contentName, NAME_LEN-1);
-    table[entry_count].addr = rpdu->addr;
-    table[entry_count].used_count = 0;
-    table[entry_count].active = 1;
-    entry_count++;
+    /* Both names end in a NUL and differ, so this stops inside both. */
+    int byte = 0;
+    while (best[byte] == key[byte]) byte++;
+    unsigned x = (unsigned char)best[byte] ^ (unsigned char)key[byte];
+    while (x & (x - 1)) x &= x - 1;
+    uint8_t otherbits = x ^ 255;
+    int dir = (1 + (otherbits | (unsigned char)best[byte])) >> 8;
 
-    send_simple(sock, from, fromlen, ACKNOWLEDGEMENT, "Registered");
-    printf("REGISTER: %s -> %s (port %d)\n", rpdu->peerName, rpdu->contentName, ntohs(rpdu->addr.sin_port));
+    cb_node *nn = &st->nodes[n];
+    nn->byte = byte;
+    nn->otherbits = otherbits;
+    nn->child[1 - dir] = ~t;
+    int *where = &st->cb_root;
+    while (*where >= 0) {
+        cb_node *q = &st->nodes[*where];
+        if (q->byte > byte || (q->byte == byte && q->otherbits > otherbits)) break;
+        where = &q->child[cb_direction(q, key, len)];
+    }
+    nn->child[dir] = *where;
+    *where = n;
 }
 
-void handle_online(int sock, struct sockaddr_in *from, socklen_t fromlen) {
-    char buf[1024] = {0};
-    for (int i = 0; i < entry_count; ++i) {
-        if (!table[i].active) continue;
-        strncat(buf, table[i].contentName, sizeof(buf)-strlen(buf)-2);
-        strncat(buf, " (by ", sizeof(buf)-strlen(buf)-2);
-        strncat(buf, table[i].peerName, sizeof(buf)-strlen(buf)-2);
-        strncat(buf, ")\n", sizeof(buf)-strlen(buf)-2);
+void cb_remove(struct store *st, int t) {
+    const char *key = st->titles[t].contentName;
+    size_t len = strlen(key);
+    int *where = &st->cb_root, *parent = NULL, q = -1, dir = 0;
+    if (*where == CB_EMPTY) return;
+    while (*where >= 0) {
+        q = *where;
+        parent = where;
+        dir = cb_direction(&st->nodes[q], key, len);
+        where = &st->nodes[q].child[dir];
     }
-    send_simple(sock, from, fromlen, ONLINE, strlen(buf) ? buf : "No content registered");
+    if (*where != ~t) return;
+    if (!parent) { st->cb_root = CB_EMPTY; return; }
+    *parent = st->nodes[q].child[1 - dir];
+    st->nodes[q].child[0] = st->node_free;
+    st->node_free = q;
 }
 
-void handle_search(int sock, struct register_pdu *rpdu, struct sockaddr_in *from, socklen_t fromlen) {
-    int idx = find_least_used(rpdu->contentName);
-    struct register_pdu resp;
-    memset(&resp,0,sizeof(resp));
+uint32_t gram_hash(uint32_t g) {
+    uint32_t h = g * 2654435761u;
+    return h ^ (h >> 15);
+}
 
-    if (idx == -1) {
-        send_simple(sock, from, fromlen, ERROR, "Content not found");
-        printf("SEARCH: not found %s\n", rpdu->contentName);
+int gram_find(struct store *st, uint32_t g) {
+    int i = st->by_gram.buckets[gram_hash(g) & (st->by_gram.nbuckets-1)];
+    while (i != -1 && st->grams[i].gram != g) i = st->grams[i].next;
+    return i;
+}
+
+void rehash_grams(struct store *st) {
+    struct hash_index *h = &st->by_gram;
+    if (h->count <= h->nbuckets) return;
+    struct hash_index n;
+    if (hash_init(&n, h->nbuckets * 2) < 0) return;
+    n.count = h->count;
+    for (int i = 0; i < st->gram_count; ++i) {
+        int nb = gram_hash(st->grams[i].gram) & (n.nbuckets-1);
+        st->grams[i].next = n.buckets[nb];
+        n.buckets[nb] = i;
+    }
+    free(h->buckets);
+    *h = n;
+}
+
+/* Posting lists are never dropped; a trigram that empties keeps its slot. */
+int gram_get(struct store *st, uint32_t g) {
+    int i = gram_find(st, g);
+    if (i != -1) return i;
+    if (grow((void**)&st->grams, &st->gram_cap, st->gram_count+1, sizeof(gram_list)) < 0) return -1;
+    i = st->gram_count++;
+    gram_list *gl = &st->grams[i];
+    memset(gl, 0, sizeof(*gl));
+    gl->gram = g;
+    int b = gram_hash(g) & (st->by_gram.nbuckets-1);
+    gl->next = st->by_gram.buckets[b];
+    st->by_gram.buckets[b] = i;
+    st->by_gram.count++;
+    rehash_grams(st);
+    return i;
+}
+
+/* Distinct trigrams of a name, packed as 24-bit integers. */
+int name_grams(const char *name, uint32_t *out) {
+    int n = 0, len = strlen(name);
+    for (int i = 0; i + 3 <= len; ++i) {
+        uint32_t g = (unsigned char)name[i] << 16 | (unsigned char)name[i+1] << 8 | (unsigned char)name[i+2];
+        int seen = 0;
+        for (int j = 0; j < n && !seen; ++j) seen = out[j] == g;
+        if (!seen) out[n++] = g;
+    }
+    return n;
+}
+
+void gram_unpost(struct store *st, uint32_t g, int t) {
+    int i = gram_find(st, g);
+    if (i == -1) return;
+    gram_list *gl = &st->grams[i];
+    for (int k = 0; k < gl->len; ++k)
+        if (gl->titles[k] == t) { gl->titles[k] = gl->titles[--gl->len]; return; }
+}
+
+/* Index a new title; on failure nothing is left half-indexed. */
+int names_insert(struct store *st, int t) {
+    int n = cb_alloc(st);
+    if (n == -1) return -1;
+    uint32_t g[NAME_MAX_LEN];
+    int ng = name_grams(st->titles[t].contentName, g);
+    for (int k = 0; k < ng; ++k) {
+        int i = gram_get(st, g[k]);
+        if (i == -1 || grow((void**)&st->grams[i].titles, &st->grams[i].cap, st->grams[i].len+1, sizeof(int)) < 0) {
+            while (k-- > 0) gram_unpost(st, g[k], t);
+            st->nodes[n].child[0] = st->node_free;
+            st->node_free = n;
+            return -1;
+        }
+        st->grams[i].titles[st->grams[i].len++] = t;
+    }
+    cb_insert(st, t, n);
+    return 0;
+}
+
+void names_remove(struct store *st, int t) {
+    uint32_t g[NAME_MAX_LEN];
+    int ng = name_grams(st->titles[t].contentName, g);
+    for (int k = 0; k < ng; ++k) gram_unpost(st, g[k], t);
+    cb_remove(st, t);
+}
+
+/* Index every live title of a store whose name indexes were deferred.
+   Caller holds the shard lock. */
+int names_build(struct store *st) {
+    if (st->names_ready) return 0;
+    for (int t = 0; t < st->title_count; ++t) {
+        if (st->titles[t].heap_len == 0 || names_insert(st, t) == 0) continue;
+        st->node_count = 0;
+        st->node_free = -1;
+        st->cb_root = CB_EMPTY;
+        for (int i = 0; i < st->gram_count; ++i) st->grams[i].len = 0;
+        return -1;
+    }
+    st->names_ready = 1;
+    return 0;
+}
+
+int get_title(struct store *st, const char *name) {
+    int t = find_title(st, name);
+    if (t != -1) return t;
+    if (st->title_free != -1) {
+        t = st->title_free;
+        st->title_free = st->titles[t].next;
     } else {
-        resp.type = SEARCH;
-        strncpy(resp.peerName, table[idx].peerName, NAME_LEN-1);
-        strncpy(resp.contentName, table[idx].contentName, NAME_LEN-1);
-        resp.addr = table[idx].addr;
+        if (grow((void**)&st->titles, &st->title_cap, st->title_count+1, sizeof(title_entry)) < 0) return -1;
+        t = st->title_count++;
+        memset(&st->titles[t], 0, sizeof(title_entry));
+    }
+    title_entry *te = &st->titles[t];
+    te->contentName = strdup(name);
+    te->heap_len = 0;
+    if (!te->contentName || (st->names_ready && names_insert(st, t) < 0)) {
+        free(te->contentName);
+        te->contentName = NULL;
+        te->next = st->title_free;
+        st->title_free = t;
+        return -1;
+    }
+    int b = hash_name(te->contentName) & (st->by_content.nbuckets-1);
+    te->next = st->by_content.buckets[b];
+    st->by_content.buckets[b] = t;
+    st->by_content.count++;
+    rehash_titles(st);
+    return t;
+}
+
+int get_peer(struct store *st, const char *name) {
+    int p = find_peer(st, name);
+    if (p != -1) return p;
+    if (st->peer_free != -1) {
+        p = st->peer_free;
+        st->peer_free = st->peers[p].next;
+    } else {
+        if (grow((void**)&st->peers, &st->peer_cap, st->peer_count+1, sizeof(peer_entry)) < 0) return -1;
+        p = st->peer_count++;
+    }
+    peer_entry *pe = &st->peers[p];
+    pe->peerName = strdup(name);
+    if (!pe->peerName) {
+        pe->next = st->peer_free;
+        st->peer_free = p;
+        return -1;
+    }
+    pe->head = -1;
+    pe->rows = 0;
+    int b = hash_name(pe->peerName) & (st->by_peer.nbuckets-1);
+    pe->next = st->by_peer.buckets[b];
+    st->by_peer.buckets[b] = p;
+    st->by_peer.count++;
+    rehash_peers(st);
+    return p;
+}
 
-        send_register_pdu(sock, from, fromlen, &resp);
+/* Unlink an empty title from its hash chain and put it on the free list.
+   The heap allocation is kept for whichever name reuses the slot. */
+void drop_title(struct store *st, int t) {
+    if (st->names_ready) names_remove(st, t);
+    int *link = &st->by_content.buckets[hash_name(st->titles[t].contentName) & (st->by_content.nbuckets-1)];
+    while (*link != t) link = &st->titles[*link].next;
+    *link = st->titles[t].next;
+    st->by_content.count--;
+    free(st->titles[t].contentName);
+    st->titles[t].contentName = NULL;
+    st->titles[t].next = st->title_free;
+    st->title_free = t;
+}
+
+void drop_peer(struct store *st, int p) {
+    int *link = &st->by_peer.buckets[hash_name(st->peers[p].peerName) & (st->by_peer.nbuckets-1)];
+    while (*link != p) link = &st->peers[*link].next;
+    *link = st->peers[p].next;
+    st->by_peer.count--;
+    free(st->peers[p].peerName);
+    st->peers[p].peerName = NULL;
+    st->peers[p].next = st->peer_free;
+    st->peer_free = p;
+}
+
+void heap_swap(struct store *st, title_entry *te, int a, int b) {
+    int ra = te->heap[a], rb = te->heap[b];
+    te->heap[a] = rb; st->rows[rb].heap_pos = a;
+    te->heap[b] = ra; st->rows[ra].heap_pos = b;
+}
 
-        table[idx].used_count++;
-        printf("SEARCH: %s -> %s:%d (%s), used=%d\n",
-               rpdu->contentName,
-               inet_ntoa(resp.addr.sin_addr),
-               ntohs(resp.addr.sin_port),
-               resp.peerName,
-               table[idx].used_count);
+void heap_up(struct store *st, title_entry *te, int i) {
+    while (i > 0) {
+        int parent = (i-1) / 2;
+        if (st->rows[te->heap[parent]].used_count <= st->rows[te->heap[i]].used_count) break;
+        heap_swap(st, te, i, parent);
+        i = parent;
     }
 }
 
-void handle_deregister(int sock, struct register_pdu *rpdu, struct sockaddr_in *from, socklen_t fromlen) {
-    int idx = find_exact(rpdu->peerName, rpdu->contentName);
-    if (idx == -1) {
-        send_simple(sock, from, fromlen, ERROR, "No such registration");
-        return;
+void heap_down(struct store *st, title_entry *te, int i) {
+    while (1) {
+        int l = 2*i+1, r = l+1, m = i;
+        if (l < te->heap_len && st->rows[te->heap[l]].used_count < st->rows[te->heap[m]].used_count) m = l;
+        if (r < te->heap_len && st->rows[te->heap[r]].used_count < st->rows[te->heap[m]].used_count) m = r;
+        if (m == i) break;
+        heap_swap(st, te, i, m);
+        i = m;
     }
-    table[idx].active = 0;
-    send_simple(sock, from, fromlen, ACKNOWLEDGEMENT, "Deregistered");
-    printf("DEREGISTER: %s -> %s\n", rpdu->peerName, rpdu->contentName);
 }
 
-void handle_quit(int sock, struct register_pdu *rpdu, struct sockaddr_in *from, socklen_t fromlen) {
-    int removed = 0;
-    for (int i = 0; i < entry_count; ++i) {
-        if (table[i].active && strncmp(table[i].peerName, rpdu->peerName, NAME_LEN) == 0) {
-            table[i].active = 0;
-            removed++;
+int find_exact(struct store *st, const char *peerName, const char *contentName) {
+    int t = find_title(st, contentName);
+    int p = find_peer(st, peerName);
+    if (t == -1 || p == -1) return -1;
+
+    /* Walk whichever side is shorter: the title's providers or the peer's rows. */
+    if (st->titles[t].heap_len <= st->peers[p].rows) {
+        title_entry *te = &st->titles[t];
+        for (int i = 0; i < te->heap_len; ++i)
+            if (st->rows[te->heap[i]].peer == p) return te->heap[i];
+    } else {
+        for (int r = st->peers[p].head; r != -1; r = st->rows[r].peer_next)
+            if (st->rows[r].title == t) return r;
+    }
+    return -1;
+}
+
+/* Whether a row may be handed out: its lease is current and, for a legacy
+   requester, its address fits a sockaddr_in and its peer name a
+   NAME_LEN field. */
+int row_usable(content_entry *e, int64_t now, int legacy) {
+    return lease_live(e->lease, now) && (!legacy || (e->addr.family == 4 && strlen(e->lease->peerName) < NAME_LEN));
+}
+
+/* Collect up to k rows with the smallest used_count by walking the heap
+   frontier from the root; costs O(k^2) comparisons, independent of n.
+   Rows whose lease lapsed are passed over until the wheel reaps them.
+   Each row passed over widens the frontier by one, so it moves to the
+   heap when it outgrows the stack rather than dropping live rows below. */
+int find_least_used_k(struct store *st, const char *content, int *out, int k, int64_t now, int legacy) {
+    int t = find_title(st, content);
+    if (t == -1) return 0;
+    title_entry *te = &st->titles[t];
+    int local[4*MAX_PROVIDERS], *frontier = local;
+    int nf = 0, found = 0, cap = sizeof(local) / sizeof(local[0]);
+    if (te->heap_len > 0) frontier[nf++] = 0;
+    while (found < k && nf > 0) {
+        int best = 0;
+        for (int i = 1; i < nf; ++i)
+            if (st->rows[te->heap[frontier[i]]].used_count < st->rows[te->heap[frontier[best]]].used_count) best = i;
+        int pos = frontier[best];
+        frontier[best] = frontier[--nf];
+        if (row_usable(&st->rows[te->heap[pos]], now, legacy)) out[found++] = te->heap[pos];
+        if (nf + 2 > cap) {
+            int *wider = malloc(2 * cap * sizeof(int));
+            if (wider) {
+                memcpy(wider, frontier, nf * sizeof(int));
+                if (frontier != local) free(frontier);
+                frontier = wider;
+                cap *= 2;
+            }
         }
+        if (2*pos+1 < te->heap_len && nf < cap) frontier[nf++] = 2*pos+1;
+        if (2*pos+2 < te->heap_len && nf < cap) frontier[nf++] = 2*pos+2;
     }
-    send_simple(sock, from, fromlen, ACKNOWLEDGEMENT, "Quit");
-    printf("QUIT: %s removed %d entries\n", rpdu->peerName, removed);
+    if (frontier != local) free(frontier);
+    return found;
 }
 
-int main(int argc, char *argv[]) {
-    int port = (argc == 2) ? atoi(argv[1]) : 3000;
+int find_least_used(struct store *st, const char *content, int64_t now, int legacy) {
+    int row;
+    return find_least_used_k(st, content, &row, 1, now, legacy) ? row : -1;
+}
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) { perror("socket"); exit(1); }
+uint64_t rng_next(void) {
+    static __thread uint64_t x;
+    if (!x) x = (uint64_t)now_ms() ^ (uint64_t)(uintptr_t)&x;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
 
-    struct sockaddr_in sin, from;
-    socklen_t fromlen = sizeof(from);
+/* Expected seconds for a provider to finish one more transfer, relative
+   to its peers: queued work over reported egress. -1 if it never reported. */
+double expected_cost(struct lease *l) {
+    uint64_t rate = __atomic_load_n(&l->rate, __ATOMIC_RELAXED);
+    if (!rate) return -1;
+    uint32_t queued = __atomic_load_n(&l->active, __ATOMIC_RELAXED) + __atomic_load_n(&l->pending, __ATOMIC_RELAXED);
+    return (queued + 1.0) / rate;
+}
 
-    memset(&sin,0,sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = htonl(INADDR_ANY);
-    sin.sin_port = htons(port);
+/* Power of two choices: sample two providers and keep the one expected to
+   finish first. Until both have reported load, fall back to the least
+   handed-out provider, which is how new seeders get their first work. */
+int pick_provider(struct store *st, const char *content, int64_t now, int legacy) {
+    int t = find_title(st, content);
+    if (t == -1) return -1;
+    title_entry *te = &st->titles[t];
+    if (te->heap_len >= 2) {
+        int i = rng_next() % te->heap_len, j = rng_next() % (te->heap_len - 1);
+        if (j >= i) j++;
+        content_entry *a = &st->rows[te->heap[i]], *b = &st->rows[te->heap[j]];
+        double ca = expected_cost(a->lease), cb = expected_cost(b->lease);
+        if (ca >= 0 && cb >= 0 && row_usable(a, now, legacy) && row_usable(b, now, legacy))
+            return ca <= cb ? te->heap[i] : te->heap[j];
+    }
+    return find_least_used(st, content, now, legacy);
+}
+
+/* Multi-provider variant: take twice as many candidates as asked for from
+   the heap and keep the k with the lowest expected cost; providers with no
+   report yet go last, in heap order. Returns the number kept. */
+int pick_providers(struct store *st, const char *content, int *out, int k, int64_t now, int legacy) {
+    int cand[2*MAX_PROVIDERS];
+    double cost[2*MAX_PROVIDERS];
+    int n = find_least_used_k(st, content, cand, 2*k, now, legacy);
+    for (int i = 0; i < n; ++i) {
+        cost[i] = expected_cost(st->rows[cand[i]].lease);
+        if (cost[i] < 0) cost[i] = HUGE_VAL;
+    }
+    for (int i = 1; i < n; ++i)
+        for (int j = i; j > 0 && cost[j] < cost[j-1]; --j) {
+            double c = cost[j]; cost[j] = cost[j-1]; cost[j-1] = c;
+            int r = cand[j]; cand[j] = cand[j-1]; cand[j-1] = r;
+        }
+    if (n > k) n = k;
+    memcpy(out, cand, n * sizeof(int));
+    return n;
+}
 
-    if (bind(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) { perror("bind"); exit(1); }
+/* Count one more hand-out of a row and restore the heap order. */
+void mark_used(struct store *st, int row) {
+    st->rows[row].used_count++;
+    heap_down(st, &st->titles[st->rows[row].title], st->rows[row].heap_pos);
+}
 
-    printf("Index server listening on port %d\n", port);
+/* Count one more row of a name under its digest. Caller holds the row's
+   shard lock. A failed allocation only leaves the row ungrouped. */
+void digest_link(uint64_t digest, const char *name) {
+    if (!digest) return;
+    pthread_mutex_lock(&digest_lock);
+    struct digest_name **link = &digest_table[digest % DIGEST_BUCKETS];
+    while (*link && ((*link)->digest != digest || strcmp((*link)->contentName, name) != 0)) link = &(*link)->next;
+    if (*link) (*link)->rows++;
+    else if ((*link = malloc(sizeof(struct digest_name) + strlen(name) + 1))) {
+        (*link)->digest = digest;
+        (*link)->rows = 1;
+        (*link)->next = NULL;
+        strcpy((*link)->contentName, name);
+        digest_count++;
+    }
+    pthread_mutex_unlock(&digest_lock);
+}
 
-    while (1) {
-        struct register_pdu rpdu;
-        ssize_t n = recvfrom(sock, &rpdu, sizeof(rpdu), 0, (struct sockaddr*)&from, &fromlen);
-        if (n < 1) continue;
+void digest_unlink(uint64_t digest, const char *name) {
+    if (!digest) return;
+    pthread_mutex_lock(&digest_lock);
+    struct digest_name **link = &digest_table[digest % DIGEST_BUCKETS];
+    while (*link && ((*link)->digest != digest || strcmp((*link)->contentName, name) != 0)) link = &(*link)->next;
+    if (*link && --(*link)->rows == 0) {
+        struct digest_name *d = *link;
+        *link = d->next;
+        free(d);
+        digest_count--;
+    }
+    pthread_mutex_unlock(&digest_lock);
+}
+
+/* Copy out up to max names, other than except, registered under any of
+   the digests. */
+int digest_siblings(const uint64_t *digests, int nd, const char *except, char (*names)[NAME_MAX_LEN+1], int max) {
+    int n = 0;
+    pthread_mutex_lock(&digest_lock);
+    for (int i = 0; i < nd; ++i)
+        for (struct digest_name *d = digest_table[digests[i] % DIGEST_BUCKETS]; d && n < max; d = d->next)
+            if (d->digest == digests[i] && strcmp(d->contentName, except) != 0) strcpy(names[n++], d->contentName);
+    pthread_mutex_unlock(&digest_lock);
+    return n;
+}
+
+int add_entry(struct store *st, const char *peerName, const char *contentName, const struct net_addr *addr, uint8_t flags, uint64_t digest, struct lease *lease) {
+    int t = get_title(st, contentName);
+    if (t == -1) return -1;
+    int p = get_peer(st, peerName);
+    if (p == -1) goto fail;
+
+    title_entry *te = &st->titles[t];
+    if (grow((void**)&te->heap, &te->heap_cap, te->heap_len+1, sizeof(int)) < 0) goto fail;
+
+    int r;
+    if (st->row_free != -1) {
+        r = st->row_free;
+        st->row_free = st->rows[r].peer_next;
+    } else {
+        if (grow((void**)&st->rows, &st->row_cap, st->row_count+1, sizeof(content_entry)) < 0) goto fail;
+        r = st->row_count++;
+    }
+
+    content_entry *e = &st->rows[r];
+    e->addr = *addr;
+    e->digest = digest;
+    e->flags = flags;
+    e->used_count = 0;
+    e->active = 1;
+    e->title = t;
+    e->peer = p;
+    e->lease = lease;
+
+    peer_entry *pe = &st->peers[p];
+    e->peer_prev = -1;
+    e->peer_next = pe->head;
+    if (pe->head != -1) st->rows[pe->head].peer_prev = r;
+    pe->head = r;
+    pe->rows++;
+
+    e->heap_pos = te->heap_len;
+    te->heap[te->heap_len++] = r;
+    heap_up(st, te, e->heap_pos);
+    st->row_live++;
+    digest_link(digest, contentName);
+    return r;
+
+fail:
+    if (st->titles[t].heap_len == 0) drop_title(st, t);
+    if (p != -1 && st->peers[p].rows == 0) drop_peer(st, p);
+    return -1;
+}
+
+void remove_entry(struct store *st, int r) {
+    content_entry *e = &st->rows[r];
+    title_entry *te = &st->titles[e->title];
+    peer_entry *pe = &st->peers[e->peer];
+    digest_unlink(e->digest, te->contentName);
+
+    int pos = e->heap_pos;
+    te->heap_len--;
+    if (pos != te->heap_len) {
+        int moved = te->heap[te->heap_len];
+        te->heap[pos] = moved;
+        st->rows[moved].heap_pos = pos;
+        heap_up(st, te, pos);
+        heap_down(st, te, st->rows[moved].heap_pos);
+    }
+    if (te->heap_len == 0) drop_title(st, e->title);
+
+    if (e->peer_prev != -1) st->rows[e->peer_prev].peer_next = e->peer_next;
+    else pe->head = e->peer_next;
+    if (e->peer_next != -1) st->rows[e->peer_next].peer_prev = e->peer_prev;
+    if (--pe->rows == 0) drop_peer(st, e->peer);
+
+    e->active = 0;
+    e->peer_next = st->row_free;
+    st->row_free = r;
+    st->row_live--;
+}
+
+int remove_peer(struct store *st, const char *peerName) {
+    int p = find_peer(st, peerName);
+    if (p == -1) return 0;
+    int removed = 0;
+    while (st->peers[p].rows > 0) {
+        remove_entry(st, st->peers[p].head);
+        removed++;
+    }
+    return removed;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Caller holds wal.lock. */
+void log_flush_locked(void) {
+    if (wal.len && write_all(wal.fd, wal.buf, wal.len) < 0) perror("write log");
+    wal.len = 0;
+}
+
+/* Group commit: workers hand a batch's changes to the kernel before
+   sending its replies, so an acknowledged change survives a crash of the
+   server process; the persist thread fdatasyncs once a second. */
+void log_commit(void) {
+    if (wal.fd < 0 || __atomic_load_n(&wal.len, __ATOMIC_RELAXED) == 0) return;
+    pthread_mutex_lock(&wal.lock);
+    log_flush_locked();
+    pthread_mutex_unlock(&wal.lock);
+}
+
+/* Log and snapshot record:
+     op, name length, peer name, name length, content name, then
+       REGISTER: provider flags, address family, 4 or 16 address bytes,
+                 be16 port, and a be64 digest if the flags hold RECORD_DIGEST
+       QUIT: be16 shard the peer was dropped from
+   Version 1 files hold fixed BATCH_RECORD records instead, with a QUIT's
+   shard in the port field; they are still read at startup. */
+struct log_record {
+    char op;
+    struct span peer, content;
+    struct net_addr addr;
+    uint8_t flags;
+    uint64_t digest;
+    uint16_t shard;
+};
+
+/* Record-only flag bit; never a PROVIDER_* flag. */
+#define RECORD_DIGEST 0x80
 
-        switch (rpdu.type) {
-            case REGISTER: handle_register(sock, &rpdu, &from, fromlen); break;
-            case ONLINE: handle_online(sock, &from, fromlen); break;
-            case SEARCH: handle_search(sock, &rpdu, &from, fromlen); break;
-            case DEREGISTER: handle_deregister(sock, &rpdu, &from, fromlen); break;
-            case QUIT: handle_quit(sock, &rpdu, &from, fromlen); break;
-            default: send_simple(sock, &from, fromlen, ERROR, "Unknown request");
+size_t encode_record(char *r, char op, const char *peer, const char *content,
+                     const struct net_addr *addr, uint8_t flags, uint64_t digest, uint16_t shard) {
+    size_t plen = strlen(peer), clen = content ? strlen(content) : 0, n = 0;
+    r[n++] = op;
+    r[n++] = plen;
+    memcpy(r + n, peer, plen);
+    n += plen;
+    r[n++] = clen;
+    if (clen) memcpy(r + n, content, clen);
+    n += clen;
+    if (op == REGISTER) {
+        int iplen = addr->family == 6 ? 16 : 4;
+        r[n++] = flags | (digest ? RECORD_DIGEST : 0);
+        r[n++] = addr->family;
+        memcpy(r + n, addr->ip, iplen);
+        memcpy(r + n + iplen, &addr->port, 2);
+        n += iplen + 2;
+        if (digest) {
+            put_be64(r + n, digest);
+            n += 8;
         }
+    } else if (op == QUIT) {
+        r[n++] = shard >> 8;
+        r[n++] = shard;
     }
+    return n;
+}
+
+size_t record_size(const char *peer, const char *content, const struct net_addr *addr, uint64_t digest) {
+    return 3 + strlen(peer) + strlen(content) + 4 + (addr->family == 6 ? 16 : 4) + (digest ? 8 : 0);
+}
+
+/* Decode the record at p; returns its length, or 0 if it runs past end
+   or is malformed. */
+size_t decode_record(const char *p, const char *end, int version, struct log_record *rec) {
+    memset(rec, 0, sizeof(*rec));
+    if (version == 1) {
+        if (end - p < BATCH_RECORD) return 0;
+        rec->op = p[0];
+        rec->peer = legacy_name(p + 1);
+        rec->content = legacy_name(p + 1 + NAME_LEN);
+        rec->addr.family = 4;
+        memcpy(rec->addr.ip, p + 1 + 2*NAME_LEN, 4);
+        memcpy(&rec->addr.port, p + 5 + 2*NAME_LEN, 2);
+        rec->shard = ntohs(rec->addr.port);
+        return BATCH_RECORD;
+    }
+    const unsigned char *q = (const unsigned char*)p, *e = (const unsigned char*)end;
+    if (e - q < 2 || e - q < 3 + q[1]) return 0;
+    rec->op = q[0];
+    rec->peer = (struct span){ (const char*)q + 2, q[1] };
+    q += 2 + q[1];
+    if (e - q < 1 + q[0]) return 0;
+    rec->content = (struct span){ (const char*)q + 1, q[0] };
+    q += 1 + q[0];
+    if (rec->op == REGISTER) {
+        if (e - q < 2 || (q[1] != 4 && q[1] != 6)) return 0;
+        int iplen = q[1] == 6 ? 16 : 4;
+        if (e - q < 4 + iplen) return 0;
+        rec->flags = q[0] & ~RECORD_DIGEST;
+        rec->addr.family = q[1];
+        memcpy(rec->addr.ip, q + 2, iplen);
+        memcpy(&rec->addr.port, q + 2 + iplen, 2);
+        q += 4 + iplen;
+        if (q[-4 - iplen] & RECORD_DIGEST) {
+            if (e - q < 8) return 0;
+            rec->digest = get_be64((const char*)q);
+            q += 8;
+        }
+    } else if (rec->op == QUIT) {
+        if (e - q < 2) return 0;
+        rec->shard = q[0] << 8 | q[1];
+        q += 2;
+    }
+    return (const char*)q - p;
+}
+
+/* Callers hold the shard lock the change was made under, so each shard's
+   records reach the log in the order they were applied. */
+void log_append(char op, const char *peer, const char *content, const struct net_addr *addr, uint8_t flags, uint64_t digest, uint16_t shard) {
+    if (wal.fd < 0) return;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.len + LOG_RECORD_MAX > LOG_BUF) log_flush_locked();
+    size_t n = encode_record(wal.buf + wal.len, op, peer, content, addr, flags, digest, shard);
+    __atomic_store_n(&wal.len, wal.len + n, __ATOMIC_RELAXED);
+    wal.bytes += n;
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void trace(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void trace(const char *fmt, ...) {
+    if (!trace_file) return;
+    struct trace_ring *r = my_ring;
+    if (!r) {
+        if (!(r = calloc(1, sizeof(*r)))) return;
+        pthread_mutex_lock(&trace_lock);
+        r->next = trace_rings;
+        trace_rings = r;
+        pthread_mutex_unlock(&trace_lock);
+        my_ring = r;
+    }
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_SLOTS) {
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    char *line = r->line[head % TRACE_SLOTS];
+    va_list ap;
+    va_start(ap, fmt);
+    if (vsnprintf(line, TRACE_LINE, fmt, ap) >= TRACE_LINE) strcpy(line + TRACE_LINE - 5, "...\n");
+    va_end(ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *trace_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int wrote = 0;
+        pthread_mutex_lock(&trace_lock);
+        struct trace_ring *rings = trace_rings;
+        pthread_mutex_unlock(&trace_lock);
+        for (struct trace_ring *r = rings; r; r = r->next) {
+            uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            for (uint32_t t = r->tail; t != head; ++t, ++wrote) fputs(r->line[t % TRACE_SLOTS], trace_file);
+            __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+        }
+        if (wrote) fflush(trace_file);
+        else {
+            struct timespec ts = { 0, 10 * 1000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Callers hold lease_lock. */
+void wheel_insert(struct lease *l, int64_t tick) {
+    struct lease **slot = &wheel[tick % WHEEL_SLOTS];
+    l->wheel_at = tick;
+    l->wprev = NULL;
+    l->wnext = *slot;
+    if (*slot) (*slot)->wprev = l;
+    *slot = l;
+    l->in_wheel = 1;
+}
+
+void wheel_remove(struct lease *l) {
+    if (l->wprev) l->wprev->wnext = l->wnext;
+    else wheel[l->wheel_at % WHEEL_SLOTS] = l->wnext;
+    if (l->wnext) l->wnext->wprev = l->wprev;
+    l->in_wheel = 0;
+}
+
+/* Find or create the lease for a peer and extend it. A REGISTER revives
+   an expired lease; a heartbeat only extends one whose rows still exist. */
+struct lease *lease_renew(const char *peerName, int is_register) {
+    int64_t now = now_ms();
+    int64_t deadline = lease_ms ? now + lease_ms : INT64_MAX;
+    pthread_mutex_lock(&lease_lock);
+    struct lease **link = &lease_table[hash_name(peerName) % LEASE_BUCKETS];
+    while (*link && strcmp((*link)->peerName, peerName) != 0) link = &(*link)->next;
+    struct lease *l = *link;
+    if (!l && is_register) {
+        l = calloc(1, sizeof(*l));
+        if (l && !(l->peerName = strdup(peerName))) { free(l); l = NULL; }
+        if (l) *link = l;
+    }
+    if (l && (is_register || !l->reaped)) {
+        if (is_register) l->reaped = 0;
+        __atomic_store_n(&l->deadline, deadline, __ATOMIC_RELAXED);
+        if (lease_ms && !l->in_wheel) wheel_insert(l, deadline / 1000 + 1);
+    } else l = NULL;
+    pthread_mutex_unlock(&lease_lock);
+    return l;
+}
+
+/* Drop every row of a lapsed lease. Each shard re-checks the deadline under
+   its lock so a REGISTER racing with the reaper keeps its rows. */
+int reap_lease(struct lease *l) {
+    int removed = 0;
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_lock(&shards[s].lock);
+        int n = lease_live(l, now_ms()) ? 0 : remove_peer(&shards[s].st, l->peerName);
+        if (n) log_append(QUIT, l->peerName, NULL, NULL, 0, 0, s);
+        removed += n;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    return removed;
+}
+
+/* Free a reaped lease, now without rows, unless a REGISTER revived it
+   meanwhile: that clears reaped and files it in the wheel again. A later
+   heartbeat finds no lease and is told it expired, as before. */
+void lease_free(struct lease *l) {
+    pthread_mutex_lock(&lease_lock);
+    int dead = l->reaped && !l->in_wheel;
+    if (dead) {
+        struct lease **link = &lease_table[hash_name(l->peerName) % LEASE_BUCKETS];
+        while (*link != l) link = &(*link)->next;
+        *link = l->next;
+    }
+    pthread_mutex_unlock(&lease_lock);
+    if (!dead) return;
+    free(l->peerName);
+    free(l);
+}
+
+/* Timer wheel of one-second ticks. A lease sits in the slot of the tick at
+   which it should next be checked; renewals only move its deadline, and
+   the wheel re-files it when that tick comes round. Each tick costs the
+   leases in one slot rather than a scan of the table. */
+void *wheel_main(void *arg) {
+    (void)arg;
+    int64_t tick = now_ms() / 1000;
+    while (1) {
+        struct timespec ts = { 1, 0 };
+        nanosleep(&ts, NULL);
+        int64_t now = now_ms();
+        for (; tick <= now / 1000; ++tick) {
+            struct lease *expired = NULL;
+            pthread_mutex_lock(&lease_lock);
+            struct lease *l = wheel[tick % WHEEL_SLOTS];
+            while (l) {
+                struct lease *next = l->wnext;
+                if (l->wheel_at <= tick) {
+                    wheel_remove(l);
+                    int64_t deadline = __atomic_load_n(&l->deadline, __ATOMIC_RELAXED);
+                    if (deadline > now) wheel_insert(l, deadline / 1000 + 1);
+                    else { l->reaped = 1; l->wnext = expired; expired = l; }
+                }
+                l = next;
+            }
+            pthread_mutex_unlock(&lease_lock);
+
+            while (expired) {
+                struct lease *next = expired->wnext;
+                int removed = reap_lease(expired);
+                if (removed) trace("EXPIRE: %s removed %d entries\n", expired->peerName, removed);
+                lease_free(expired);
+                expired = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+void reply_simple(struct reply *out, char type, const char *msg) {
+    struct simple_pdu *sp = (struct simple_pdu*)out->buf;
+    memset(sp,0,sizeof(*sp));
+    sp->type = type;
+    size_t n = msg ? strlen(msg) : 0;
+    if (n >= sizeof(sp->data)) n = sizeof(sp->data) - 1;
+    if (msg) memcpy(sp->data, msg, n);
+    out->len = sizeof(*sp);
+}
+
+/* Copy a name into a NAME_LEN field of a legacy PDU. Callers only pass
+   names that fit: a legacy request's own name, or the peer of a row
+   that row_usable accepted for a legacy requester. */
+void put_legacy_name(char *dst, const char *src) {
+    size_t n = strlen(src);
+    if (n >= NAME_LEN) n = NAME_LEN - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+void reply_register_pdu(struct reply *out, struct register_pdu *rpdu) {
+    memcpy(out->buf, rpdu, sizeof(*rpdu));
+    out->len = sizeof(*rpdu);
+}
+
+/* Version 2 encoding. A length written before its contents is a varint
+   padded to a fixed width (LEB128 allows redundant continuation bytes),
+   so nothing moves once the contents are in place. */
+void put_bytes(struct wbuf *w, const void *p, size_t n) {
+    if (w->overflow || (size_t)(w->end - w->p) < n) { w->overflow = 1; return; }
+    memcpy(w->p, p, n);
+    w->p += n;
+}
+
+void put_varint(struct wbuf *w, uint64_t v) {
+    char b[10];
+    int n = 0;
+    do {
+        b[n] = v & 0x7f;
+        v >>= 7;
+        if (v) b[n] |= 0x80;
+        n++;
+    } while (v);
+    put_bytes(w, b, n);
+}
+
+void put_field(struct wbuf *w, int tag, const void *p, size_t n) {
+    char t = tag;
+    put_bytes(w, &t, 1);
+    put_varint(w, n);
+    put_bytes(w, p, n);
+}
+
+void put_name(struct wbuf *w, int tag, const char *name) {
+    put_field(w, tag, name, strlen(name));
+}
+
+void put_uint(struct wbuf *w, int tag, uint64_t v) {
+    char b[10];
+    struct wbuf tmp = { b, b + sizeof(b), 0 };
+    put_varint(&tmp, v);
+    put_field(w, tag, b, tmp.p - b);
+}
+
+void put_addr(struct wbuf *w, int tag, const struct net_addr *a) {
+    char b[19];
+    int iplen = a->family == 6 ? 16 : 4;
+    b[0] = a->family;
+    memcpy(b + 1, a->ip, iplen);
+    memcpy(b + 1 + iplen, &a->port, 2);
+    put_field(w, tag, b, 3 + iplen);
+}
+
+/* Nested fields get a two-byte length, enough for any datagram. */
+char *put_open(struct wbuf *w, int tag) {
+    char hdr[3] = { tag, 0, 0 };
+    put_bytes(w, hdr, 3);
+    return w->p;
+}
+
+void put_close(struct wbuf *w, char *start) {
+    if (w->overflow) return;
+    size_t n = w->p - start;
+    start[-2] = (n & 0x7f) | 0x80;
+    start[-1] = n >> 7;
+}
+
+/* The frame's body length is a three-byte varint filled in by frame_end. */
+void frame_begin(struct wbuf *w, struct reply *out, char type, uint64_t id) {
+    *w = (struct wbuf){ out->buf, out->buf + MAX_DGRAM, 0 };
+    char hdr[5] = { (char)WIRE_MAGIC, WIRE_VERSION, 0, 0, 0 };
+    put_bytes(w, hdr, sizeof(hdr));
+    put_bytes(w, &type, 1);
+    put_varint(w, id);
+}
+
+void frame_end(struct wbuf *w, struct reply *out) {
+    if (w->overflow) { out->len = 0; return; }
+    size_t n = w->p - (out->buf + 5);
+    out->buf[2] = (n & 0x7f) | 0x80;
+    out->buf[3] = ((n >> 7) & 0x7f) | 0x80;
+    out->buf[4] = n >> 14;
+    out->len = w->p - out->buf;
+}
+
+/* Read a varint; fails if it runs past end or over 64 bits. */
+int get_varint(const char **p, const char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/* Step to the next field of p..end. Returns 0 at the end, and also on a
+   field that runs past it; callers tell them apart by *p == end. */
+int next_field(const char **p, const char *end, int *tag, struct span *val) {
+    const char *q = *p;
+    uint64_t n;
+    if (q >= end) return 0;
+    *tag = (unsigned char)*q++;
+    if (!get_varint(&q, end, &n) || n > (uint64_t)(end - q)) return 0;
+    val->p = q;
+    val->len = n;
+    *p = q + n;
+    return 1;
+}
+
+int span_uint(struct span s, uint64_t *v) {
+    const char *p = s.p;
+    return get_varint(&p, s.p + s.len, v);
+}
+
+int span_addr(struct span s, struct net_addr *a) {
+    memset(a, 0, sizeof(*a));
+    if (s.len < 1) return 0;
+    size_t iplen = s.p[0] == 4 ? 4 : s.p[0] == 6 ? 16 : 0;
+    if (!iplen || s.len != 3 + iplen) return 0;
+    a->family = s.p[0];
+    memcpy(a->ip, s.p + 1, iplen);
+    memcpy(&a->port, s.p + 1 + iplen, 2);
+    return 1;
+}
+
+/* Parse a version 2 frame in place; the spans point into buf. */
+int parse_v2(const char *buf, size_t len, struct request *rq) {
+    const char *p = buf + 2, *end = buf + len;
+    uint64_t n, v;
+    rq->v2 = 1;
+    if (!get_varint(&p, end, &n) || n < 1 || n > (uint64_t)(end - p)) return -1;
+    end = p + n;
+    rq->type = *p++;
+    if (!get_varint(&p, end, &rq->id)) return -1;
+    rq->fields = p;
+    rq->end = end;
+
+    int tag;
+    struct span val;
+    while (next_field(&p, end, &tag, &val)) {
+        const char *q = val.p;
+        switch (tag) {
+            case F_PEER: rq->peer = val; break;
+            case F_CONTENT: rq->content = val; break;
+            case F_ADDR:
+                if (!span_addr(val, &rq->addr)) return -1;
+                rq->has_addr = 1;
+                break;
+            case F_COUNT: if (!span_uint(val, &rq->count)) return -1; break;
+            case F_CURSOR: if (!span_uint(val, &rq->cursor)) return -1; break;
+            case F_MODE:
+                if (!span_uint(val, &v)) return -1;
+                rq->mode = v;
+                break;
+            case F_DIGEST: if (!span_uint(val, &rq->digest)) return -1; break;
+            case F_LOAD:
+                if (!get_varint(&q, val.p + val.len, &rq->active) || !get_varint(&q, val.p + val.len, &rq->rate)) return -1;
+                break;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+/* Map a fixed-size PDU onto a request; buf is zero-padded to a full
+   register_pdu by the caller. */
+void parse_legacy(const char *buf, size_t len, struct request *rq) {
+    const struct register_pdu *rpdu = (const struct register_pdu*)buf;
+    uint32_t active;
+    rq->type = rpdu->type;
+    rq->peer = legacy_name(rpdu->peerName);
+    rq->content = legacy_name(rpdu->contentName);
+    addr_from_sin(&rq->addr, &rpdu->addr);
+    rq->has_addr = 1;
+    rq->fields = buf;
+    rq->end = buf + len;
+    switch (rq->type) {
+        case ONLINE_PAGE: rq->cursor = get_be64(rpdu->padding); break;
+        case SEARCH_MULTI: rq->count = (unsigned char)rpdu->padding[0]; break;
+        case NAME_SEARCH:
+            rq->mode = rpdu->padding[0];
+            rq->count = (unsigned char)rpdu->padding[1];
+            break;
+        case HEARTBEAT:
+            memcpy(&active, rpdu->padding, 4);
+            rq->active = ntohl(active);
+            rq->rate = get_be64(&rpdu->padding[4]);
+            break;
+    }
+}
+
+/* Acknowledgement or error in the requester's format. */
+void reply_status(struct reply *out, struct request *rq, char type, const char *msg) {
+    if (!rq->v2) { reply_simple(out, type, msg); return; }
+    struct wbuf w;
+    frame_begin(&w, out, type, rq->id);
+    put_name(&w, F_TEXT, msg);
+    frame_end(&w, out);
+}
+
+/* Refuse a name another member owns, with the epoch of the map that
+   says so; a peer holding an older map fetches the new one. */
+void reply_moved(struct reply *out, struct request *rq) {
+    if (!rq->v2) { reply_simple(out, ERROR, "Wrong shard"); return; }
+    struct wbuf w;
+    frame_begin(&w, out, ERROR, rq->id);
+    put_name(&w, F_TEXT, "Wrong shard");
+    put_uint(&w, F_EPOCH, cluster_epoch());
+    frame_end(&w, out);
+}
+
+/* Register a row. Registering an existing row again with a different
+   digest (the file changed) updates the digest. */
+char apply_register(const char *peer, const char *content, const struct net_addr *addr, uint8_t flags, uint64_t digest) {
+    struct lease *lease = lease_renew(peer, 1);
+    if (!lease) return STATUS_FULL;
+    struct shard *sh = shard_for(content);
+    pthread_mutex_lock(&sh->lock);
+    char status = STATUS_OK;
+    /* Checked under the shard lock, so a map change either refuses this
+       row or finds it when it drops the rows it no longer owns. */
+    if (!owns(content)) status = STATUS_MOVED;
+    else {
+        int r = find_exact(&sh->st, peer, content);
+        if (r == -1) {
+            if (add_entry(&sh->st, peer, content, addr, flags, digest, lease) == -1) status = STATUS_FULL;
+            else log_append(REGISTER, peer, content, addr, flags, digest, 0);
+        } else if (digest && sh->st.rows[r].digest != digest) {
+            content_entry *e = &sh->st.rows[r];
+            digest_unlink(e->digest, content);
+            e->digest = digest;
+            digest_link(digest, content);
+            log_append(REGISTER, peer, content, &e->addr, e->flags, digest, 0);
+        } else status = STATUS_DUPLICATE;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return status;
+}
+
+char apply_deregister(const char *peer, const char *content) {
+    struct shard *sh = shard_for(content);
+    pthread_mutex_lock(&sh->lock);
+    int idx = find_exact(&sh->st, peer, content);
+    if (idx != -1) {
+        remove_entry(&sh->st, idx);
+        log_append(DEREGISTER, peer, content, NULL, 0, 0, 0);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return idx == -1 ? STATUS_MISSING : STATUS_OK;
+}
+
+void handle_register(struct request *rq, struct reply *out) {
+    char peer[NAME_MAX_LEN+1], content[NAME_MAX_LEN+1];
+    if (span_name(peer, rq->peer) < 0 || span_name(content, rq->content) < 0 || !rq->has_addr) {
+        reply_status(out, rq, ERROR, "Malformed request");
+        return;
+    }
+
+    char status = apply_register(peer, content, &rq->addr, rq->v2 ? PROVIDER_V2 : 0, rq->digest);
+    if (status == STATUS_MOVED) {
+        reply_moved(out, rq);
+        return;
+    }
+    if (status == STATUS_DUPLICATE) {
+        reply_status(out, rq, ERROR, "Duplicate registration");
+        return;
+    }
+    if (status == STATUS_FULL) {
+        reply_status(out, rq, ERROR, "Server storage full");
+        return;
+    }
+
+    reply_status(out, rq, ACKNOWLEDGEMENT, "Registered");
+    trace("REGISTER: %s -> %s (port %d)\n", peer, content, ntohs(rq->addr.port));
+}
+
+void handle_batch(const char *buf, size_t len, struct reply *out) {
+    if (len < BATCH_HEADER) { reply_simple(out, ERROR, "Malformed batch"); return; }
+    uint16_t count;
+    memcpy(&count, buf + 5, 2);
+    count = ntohs(count);
+    if (len < BATCH_HEADER + (size_t)count * BATCH_RECORD) { reply_simple(out, ERROR, "Malformed batch"); return; }
+
+    memcpy(out->buf, buf, BATCH_HEADER);
+    int ok = 0;
+    for (int i = 0; i < count; ++i) {
+        struct log_record rec;
+        decode_record(buf + BATCH_HEADER + i * BATCH_RECORD, buf + len, 1, &rec);
+        char peer[NAME_MAX_LEN+1], content[NAME_MAX_LEN+1];
+        span_name(peer, rec.peer);
+        span_name(content, rec.content);
+
+        char status = STATUS_BAD;
+        if (rec.op == REGISTER) status = apply_register(peer, content, &rec.addr, 0, 0);
+        else if (rec.op == DEREGISTER) status = apply_deregister(peer, content);
+        out->buf[BATCH_HEADER + i] = status;
+        ok += status == STATUS_OK;
+    }
+    out->len = BATCH_HEADER + count;
+    trace("BATCH: %d of %d records applied\n", ok, count);
+}
+
+/* Version 2 BATCH_UPDATE: F_PEER and F_ADDR once, then an F_RECORD
+   (nested F_MODE op, F_CONTENT, optional F_DIGEST) per change. The reply holds one status
+   byte per record, in order, in a single F_STATUS field. */
+void handle_batch_v2(struct request *rq, struct reply *out) {
+    char peer[NAME_MAX_LEN+1], content[NAME_MAX_LEN+1], status[MAX_DGRAM];
+    if (span_name(peer, rq->peer) < 0) { reply_status(out, rq, ERROR, "Malformed batch"); return; }
+
+    int count = 0, ok = 0, tag, rtag;
+    struct span val, rval;
+    for (const char *p = rq->fields; next_field(&p, rq->end, &tag, &val); ) {
+        if (tag != F_RECORD) continue;
+        uint64_t op = 0, digest = 0;
+        struct span name = { NULL, NAME_MAX_LEN + 1 };
+        for (const char *q = val.p; next_field(&q, val.p + val.len, &rtag, &rval); ) {
+            if (rtag == F_MODE) span_uint(rval, &op);
+            else if (rtag == F_CONTENT) name = rval;
+            else if (rtag == F_DIGEST) span_uint(rval, &digest);
+        }
+        char st = STATUS_BAD;
+        if (span_name(content, name) == 0) {
+            if (op == REGISTER && rq->has_addr) st = apply_register(peer, content, &rq->addr, PROVIDER_V2, digest);
+            else if (op == DEREGISTER) st = apply_deregister(peer, content);
+        }
+        status[count++] = st;
+        ok += st == STATUS_OK;
+    }
+
+    struct wbuf w;
+    frame_begin(&w, out, BATCH_UPDATE, rq->id);
+    put_field(&w, F_STATUS, status, count);
+    frame_end(&w, out);
+    trace("BATCH: %d of %d records applied\n", ok, count);
+}
+
+/* Walk active rows from a cursor, calling emit for each, until emit
+   returns nonzero or the table ends. Returns the cursor to resume from. */
+uint64_t walk_rows(uint64_t cursor, int (*emit)(struct store *st, content_entry *e, void *arg), void *arg) {
+    int64_t now = now_ms();
+    for (uint64_t s = cursor >> 32; s < NSHARDS; ++s) {
+        struct store *st = &shards[s].st;
+        uint32_t i = s == cursor >> 32 ? (uint32_t)cursor : 0;
+        pthread_mutex_lock(&shards[s].lock);
+        for (; i < (uint32_t)st->row_count; ++i) {
+            if (!st->rows[i].active || !lease_live(st->rows[i].lease, now)) continue;
+            if (emit(st, &st->rows[i], arg)) {
+                pthread_mutex_unlock(&shards[s].lock);
+                return s << 32 | i;
+            }
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    return CURSOR_END;
+}
+
+struct text_page {
+    char *buf;
+    size_t pos, cap;
+};
+
+int emit_text(struct store *st, content_entry *e, void *arg) {
+    struct text_page *tp = arg;
+    int w = snprintf(tp->buf + tp->pos, tp->cap - tp->pos, "%s (by %s)\n",
+                     st->titles[e->title].contentName, st->peers[e->peer].peerName);
+    if (w < 0 || (size_t)w >= tp->cap - tp->pos) { tp->buf[tp->pos] = '\0'; return 1; }
+    tp->pos += w;
+    return 0;
+}
+
+/* Legacy ONLINE: as many entries as fit in one simple_pdu. */
+void handle_online(struct request *rq, struct reply *out) {
+    if (rq->v2) { reply_status(out, rq, ERROR, "Unknown request"); return; }
+    char buf[sizeof(((struct simple_pdu*)0)->data)] = {0};
+    struct text_page tp = { buf, 0, sizeof(buf) };
+    walk_rows(0, emit_text, &tp);
+    reply_simple(out, ONLINE, tp.pos ? buf : "No content registered");
+}
+
+struct bin_page {
+    char *buf;
+    int count, max;
+};
+
+/* Legacy records have no room for IPv6 or long names; such rows are
+   left out of the page. */
+int emit_record(struct store *st, content_entry *e, void *arg) {
+    struct bin_page *bp = arg;
+    const char *content = st->titles[e->title].contentName, *peer = st->peers[e->peer].peerName;
+    size_t clen = strlen(content), plen = strlen(peer);
+    if (e->addr.family != 4 || clen >= NAME_LEN || plen >= NAME_LEN) return 0;
+    if (bp->count == bp->max) return 1;
+    char *r = bp->buf + PAGE_HEADER + bp->count * PAGE_RECORD;
+    memset(r, 0, PAGE_RECORD);
+    memcpy(r, content, clen);
+    memcpy(r + NAME_LEN, peer, plen);
+    memcpy(r + 2*NAME_LEN, e->addr.ip, 4);
+    memcpy(r + 2*NAME_LEN + 4, &e->addr.port, 2);
+    bp->count++;
+    return 0;
+}
+
+/* A row that does not fit is taken back and starts the next page. */
+int emit_row(struct store *st, content_entry *e, void *arg) {
+    struct wbuf *w = arg;
+    char *mark = w->p;
+    char *row = put_open(w, F_ROW);
+    put_name(w, F_CONTENT, st->titles[e->title].contentName);
+    put_name(w, F_PEER, st->peers[e->peer].peerName);
+    put_addr(w, F_ADDR, &e->addr);
+    put_close(w, row);
+    if (!w->overflow) return 0;
+    w->p = mark;
+    w->overflow = 0;
+    return 1;
+}
+
+/* Version 2 pages are F_ROW fields (F_CONTENT, F_PEER, F_ADDR) filling
+   up to PAGE_MAX bytes, then the F_CURSOR to resume from. */
+void handle_online_page(struct request *rq, struct reply *out) {
+    if (rq->v2) {
+        struct wbuf w;
+        frame_begin(&w, out, ONLINE_PAGE, rq->id);
+        w.end = out->buf + PAGE_MAX - 12;
+        uint64_t next = walk_rows(rq->cursor, emit_row, &w);
+        w.end = out->buf + MAX_DGRAM;
+        put_uint(&w, F_CURSOR, next);
+        frame_end(&w, out);
+        return;
+    }
+    struct bin_page bp = { out->buf, 0, (PAGE_MAX - PAGE_HEADER) / PAGE_RECORD };
+    uint64_t next = walk_rows(rq->cursor, emit_record, &bp);
+    uint16_t count = htons(bp.count);
+    out->buf[0] = ONLINE_PAGE;
+    put_be64(out->buf + 1, next);
+    memcpy(out->buf + 9, &count, 2);
+    out->len = PAGE_HEADER + bp.count * PAGE_RECORD;
+}
+
+/* A provider registered under a name other than the one searched for
+   (the same bytes, by digest) carries that name in F_CONTENT; it is
+   the name to ask the provider for. Returns -1, leaving the frame as it
+   was, if the provider does not fit. */
+int put_provider(struct wbuf *w, struct store *st, content_entry *e, const char *content) {
+    char *start = w->p;
+    char *f = put_open(w, F_PROVIDER);
+    put_name(w, F_PEER, st->peers[e->peer].peerName);
+    put_addr(w, F_ADDR, &e->addr);
+    put_uint(w, F_FLAGS, e->flags);
+    if (e->digest) put_uint(w, F_DIGEST, e->digest);
+    if (strcmp(st->titles[e->title].contentName, content) != 0) put_name(w, F_CONTENT, st->titles[e->title].contentName);
+    put_close(w, f);
+    if (!w->overflow) return 0;
+    w->p = start;
+    w->overflow = 0;
+    return -1;
+}
+
+void handle_search(struct request *rq, struct reply *out) {
+    char content[NAME_MAX_LEN+1], peer[NAME_MAX_LEN+1], host[INET6_ADDRSTRLEN];
+    if (span_name(content, rq->content) < 0) { reply_status(out, rq, ERROR, "Content not found"); return; }
+    if (!owns(content)) { reply_moved(out, rq); return; }
+
+    struct register_pdu resp;
+    struct net_addr addr;
+    struct wbuf w;
+    int used = 0;
+
+    struct shard *sh = shard_for(content);
+    pthread_mutex_lock(&sh->lock);
+    struct store *st = &sh->st;
+    int idx = pick_provider(st, content, now_ms(), !rq->v2);
+    if (idx != -1) {
+        content_entry *e = &st->rows[idx];
+        __atomic_add_fetch(&e->lease->pending, 1, __ATOMIC_RELAXED);
+        if (rq->v2) {
+            frame_begin(&w, out, SEARCH, rq->id);
+            put_name(&w, F_CONTENT, content);
+            put_provider(&w, st, e, content);
+            frame_end(&w, out);
+        } else {
+            memset(&resp,0,sizeof(resp));
+            resp.type = SEARCH;
+            put_legacy_name(resp.peerName, st->peers[e->peer].peerName);
+            put_legacy_name(resp.contentName, content);
+            addr_to_sin(&e->addr, &resp.addr);
+            reply_register_pdu(out, &resp);
+        }
+        strcpy(peer, st->peers[e->peer].peerName);
+        addr = e->addr;
+        mark_used(st, idx);
+        used = e->used_count;
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    stat_add(idx == -1 ? &my_stats->misses : &my_stats->hits, 1);
+    if (idx == -1) {
+        reply_status(out, rq, ERROR, "Content not found");
+        trace("SEARCH: not found %s\n", content);
+    } else {
+        trace("SEARCH: %s -> %s:%d (%s), used=%d\n",
+               content,
+               addr_str(&addr, host, sizeof(host)),
+               ntohs(addr.port),
+               peer,
+               used);
+    }
+}
+
+void handle_search_multi(struct request *rq, struct reply *out) {
+    char content[NAME_MAX_LEN+1];
+    if (span_name(content, rq->content) < 0) { reply_status(out, rq, ERROR, "Content not found"); return; }
+    if (!owns(content)) { reply_moved(out, rq); return; }
+    int k = rq->count < 1 || rq->count > MAX_PROVIDERS ? MAX_PROVIDERS : (int)rq->count;
+
+    struct provider_pdu *resp = (struct provider_pdu*)out->buf;
+    struct wbuf w;
+    int rows[MAX_PROVIDERS];
+    if (rq->v2) {
+        frame_begin(&w, out, SEARCH_MULTI, rq->id);
+        put_name(&w, F_CONTENT, content);
+    } else memset(resp,0,sizeof(*resp));
+
+    struct shard *sh = shard_for(content);
+    pthread_mutex_lock(&sh->lock);
+    struct store *st = &sh->st;
+    int n = pick_providers(st, content, rows, k, now_ms(), !rq->v2);
+    for (int i = 0; i < n; ++i) {
+        content_entry *e = &st->rows[rows[i]];
+        if (rq->v2 && put_provider(&w, st, e, content) < 0) { n = i; break; }
+        __atomic_add_fetch(&e->lease->pending, 1, __ATOMIC_RELAXED);
+        if (!rq->v2) {
+            put_legacy_name(resp->providers[i].peerName, st->peers[e->peer].peerName);
+            addr_to_sin(&e->addr, &resp->providers[i].addr);
+        }
+    }
+    /* Note what was handed out so the sibling pass below neither repeats
+       a peer nor strays from the digests found. */
+    struct lease *emitted[MAX_PROVIDERS];
+    uint64_t digests[MAX_PROVIDERS];
+    int nd = 0;
+    for (int i = 0; i < n; ++i) {
+        content_entry *e = &st->rows[rows[i]];
+        emitted[i] = e->lease;
+        int j = 0;
+        while (j < nd && digests[j] != e->digest) ++j;
+        if (j == nd && e->digest) digests[nd++] = e->digest;
+        mark_used(st, rows[i]);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    /* Fill up from other names with the same bytes. Legacy replies have
+       no room for the name to ask a provider for, so only v2 gets them. */
+    char siblings[MAX_SIBLINGS][NAME_MAX_LEN+1];
+    int ns = rq->v2 && n < k && nd ? digest_siblings(digests, nd, content, siblings, MAX_SIBLINGS) : 0;
+    int full = 0;
+    for (int s = 0; s < ns && n < k && !full; ++s) {
+        struct shard *ssh = shard_for(siblings[s]);
+        pthread_mutex_lock(&ssh->lock);
+        struct store *sst = &ssh->st;
+        int cand[MAX_PROVIDERS];
+        int nc = pick_providers(sst, siblings[s], cand, k, now_ms(), 0);
+        for (int i = 0; i < nc && n < k; ++i) {
+            content_entry *e = &sst->rows[cand[i]];
+            int j = 0;
+            while (j < n && emitted[j] != e->lease) ++j;
+            if (j < n) continue;
+            for (j = 0; j < nd && digests[j] != e->digest; ++j) ;
+            if (j == nd) continue;
+            /* Siblings carry their own name, so the frame fills first. */
+            if (put_provider(&w, sst, e, content) < 0) { full = 1; break; }
+            __atomic_add_fetch(&e->lease->pending, 1, __ATOMIC_RELAXED);
+            emitted[n++] = e->lease;
+            mark_used(sst, cand[i]);
+        }
+        pthread_mutex_unlock(&ssh->lock);
+    }
+
+    stat_add(n == 0 ? &my_stats->misses : &my_stats->hits, 1);
+    if (n == 0) {
+        reply_status(out, rq, ERROR, "Content not found");
+        trace("SEARCH: not found %s\n", content);
+        return;
+    }
+    if (rq->v2) frame_end(&w, out);
+    else {
+        resp->type = SEARCH_MULTI;
+        resp->count = n;
+        put_legacy_name(resp->contentName, content);
+        out->len = sizeof(*resp);
+    }
+    trace("SEARCH: %s -> %d provider%s\n", content, n, n == 1 ? "" : "s");
+}
+
+void handle_deregister(struct request *rq, struct reply *out) {
+    char peer[NAME_MAX_LEN+1], content[NAME_MAX_LEN+1];
+    int named = span_name(peer, rq->peer) == 0 && span_name(content, rq->content) == 0;
+    if (named && !owns(content)) { reply_moved(out, rq); return; }
+    if (!named || apply_deregister(peer, content) == STATUS_MISSING) {
+        reply_status(out, rq, ERROR, "No such registration");
+        return;
+    }
+    reply_status(out, rq, ACKNOWLEDGEMENT, "Deregistered");
+    trace("DEREGISTER: %s -> %s\n", peer, content);
+}
+
+void handle_quit(struct request *rq, struct reply *out) {
+    char peer[NAME_MAX_LEN+1];
+    if (span_name(peer, rq->peer) < 0) { reply_status(out, rq, ERROR, "Malformed request"); return; }
+    int removed = 0;
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_lock(&shards[s].lock);
+        int n = remove_peer(&shards[s].st, peer);
+        if (n) log_append(QUIT, peer, NULL, NULL, 0, 0, s);
+        removed += n;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    reply_status(out, rq, ACKNOWLEDGEMENT, "Quit");
+    trace("QUIT: %s removed %d entries\n", peer, removed);
+}
+
+/* Best matches so far: a min-heap whose root is the weakest entry, so a
+   better candidate replaces it. More providers rank first, then name. */
+struct match {
+    char name[NAME_MAX_LEN+1];
+    int providers;
+};
+
+struct top_n {
+    struct match m[MATCH_MAX];
+    int len, max;
+    size_t max_name;            /* longest name the reply can carry */
+};
+
+int match_worse(const struct match *a, const struct match *b) {
+    if (a->providers != b->providers) return a->providers < b->providers;
+    return strcmp(a->name, b->name) > 0;
+}
+
+void top_sift(struct top_n *tn, int i) {
+    while (1) {
+        int l = 2*i+1, r = l+1, w = i;
+        if (l < tn->len && match_worse(&tn->m[l], &tn->m[w])) w = l;
+        if (r < tn->len && match_worse(&tn->m[r], &tn->m[w])) w = r;
+        if (w == i) return;
+        struct match tmp = tn->m[i]; tn->m[i] = tn->m[w]; tn->m[w] = tmp;
+        i = w;
+    }
+}
+
+void top_offer(struct top_n *tn, title_entry *te) {
+    struct match c;
+    size_t len = strlen(te->contentName);
+    if (len > tn->max_name) return;
+    memcpy(c.name, te->contentName, len + 1);
+    c.providers = te->heap_len;
+    if (tn->len < tn->max) {
+        int i = tn->len++;
+        tn->m[i] = c;
+        while (i > 0 && match_worse(&tn->m[i], &tn->m[(i-1)/2])) {
+            struct match tmp = tn->m[i]; tn->m[i] = tn->m[(i-1)/2]; tn->m[(i-1)/2] = tmp;
+            i = (i-1)/2;
+        }
+    } else if (match_worse(&tn->m[0], &c)) {
+        tn->m[0] = c;
+        top_sift(tn, 0);
+    }
+}
+
+void cb_collect(struct store *st, int p, struct top_n *tn) {
+    if (p < 0) { top_offer(tn, &st->titles[~p]); return; }
+    cb_collect(st, st->nodes[p].child[0], tn);
+    cb_collect(st, st->nodes[p].child[1], tn);
+}
+
+/* Descend on the prefix bytes only; the subtree left is every name that
+   can share the prefix, confirmed against one of its leaves. */
+void prefix_matches(struct store *st, const char *q, int qlen, struct top_n *tn) {
+    if (st->cb_root == CB_EMPTY) return;
+    int p = st->cb_root, top = p;
+    while (p >= 0) {
+        cb_node *n = &st->nodes[p];
+        p = n->child[cb_direction(n, q, qlen)];
+        if (n->byte < qlen) top = p;
+    }
+    if (strncmp(st->titles[~p].contentName, q, qlen) != 0) return;
+    cb_collect(st, top, tn);
+}
+
+/* Intersect through the rarest trigram of the query and confirm each
+   candidate; queries too short for a trigram scan the titles. */
+void substring_matches(struct store *st, const char *q, int qlen, struct top_n *tn) {
+    uint32_t g[NAME_MAX_LEN];
+    int ng = name_grams(q, g), best = -1;
+    for (int k = 0; k < ng; ++k) {
+        int i = gram_find(st, g[k]);
+        if (i == -1 || st->grams[i].len == 0) return;
+        if (best == -1 || st->grams[i].len < st->grams[best].len) best = i;
+    }
+    if (best != -1) {
+        for (int k = 0; k < st->grams[best].len; ++k) {
+            title_entry *te = &st->titles[st->grams[best].titles[k]];
+            if (memmem(te->contentName, strlen(te->contentName), q, qlen)) top_offer(tn, te);
+        }
+        return;
+    }
+    for (int t = 0; t < st->title_count; ++t) {
+        title_entry *te = &st->titles[t];
+        if (te->heap_len > 0 && memmem(te->contentName, strlen(te->contentName), q, qlen)) top_offer(tn, te);
+    }
+}
+
+/* NAME_SEARCH: the content name is the pattern, the mode NAME_PREFIX or
+   NAME_SUBSTRING, the count how many names to return. Legacy replies
+   are up to that many (name, be16 providers) records; version 2 replies
+   are F_ROW fields (F_CONTENT, F_COUNT), best first, as many as fit. */
+void handle_name_search(struct request *rq, struct reply *out) {
+    char q[NAME_MAX_LEN+1];
+    int mode = rq->mode;
+    if (span_name(q, rq->content) < 0 || q[0] == '\0' || (mode != NAME_PREFIX && mode != NAME_SUBSTRING)) {
+        reply_status(out, rq, ERROR, "Bad name search");
+        return;
+    }
+    int qlen = strlen(q);
+
+    struct top_n *tn = malloc(sizeof(*tn));
+    if (!tn) { reply_status(out, rq, ERROR, "Server storage full"); return; }
+    tn->len = 0;
+    tn->max = rq->count < 1 || rq->count > MATCH_MAX ? MATCH_MAX : (int)rq->count;
+    tn->max_name = rq->v2 ? NAME_MAX_LEN : NAME_LEN-1;
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_lock(&shards[s].lock);
+        if (names_build(&shards[s].st) == 0) {
+            if (mode == NAME_PREFIX) prefix_matches(&shards[s].st, q, qlen, tn);
+            else substring_matches(&shards[s].st, q, qlen, tn);
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+
+    int count = tn->len;
+    for (int i = count - 1; i > 0; --i) {
+        struct match tmp = tn->m[0]; tn->m[0] = tn->m[i]; tn->m[i] = tmp;
+        tn->len = i;
+        top_sift(tn, 0);
+    }
+    if (rq->v2) {
+        struct wbuf w;
+        frame_begin(&w, out, NAME_SEARCH, rq->id);
+        for (int i = 0; i < count; ++i) {
+            char *mark = w.p, *row = put_open(&w, F_ROW);
+            put_name(&w, F_CONTENT, tn->m[i].name);
+            put_uint(&w, F_COUNT, tn->m[i].providers);
+            put_close(&w, row);
+            if (w.overflow) { w.p = mark; w.overflow = 0; break; }
+        }
+        frame_end(&w, out);
+        free(tn);
+        return;
+    }
+    out->buf[0] = NAME_SEARCH;
+    out->buf[1] = count;
+    for (int i = 0; i < count; ++i) {
+        char *r = out->buf + 2 + i * MATCH_RECORD;
+        uint16_t providers = htons(tn->m[i].providers > UINT16_MAX ? UINT16_MAX : tn->m[i].providers);
+        memset(r, 0, NAME_LEN);
+        memcpy(r, tn->m[i].name, strlen(tn->m[i].name));
+        memcpy(r + NAME_LEN, &providers, 2);
+    }
+    out->len = 2 + count * MATCH_RECORD;
+    free(tn);
+}
+
+/* One heartbeat renews every registration of the peer. If its rows were
+   already reaped the peer is told so it can register them again. It
+   carries the peer's load, active uploads and egress bytes/s; both zero
+   from peers that do not measure. */
+void handle_heartbeat(struct request *rq, struct reply *out) {
+    char peer[NAME_MAX_LEN+1];
+    struct lease *l = span_name(peer, rq->peer) < 0 ? NULL : lease_renew(peer, 0);
+    if (!l) { reply_status(out, rq, ERROR, "Lease expired"); return; }
+    __atomic_store_n(&l->active, rq->active > UINT32_MAX ? UINT32_MAX : (uint32_t)rq->active, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->rate, rq->rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->pending, 0, __ATOMIC_RELAXED);
+    if (!rq->v2) { reply_status(out, rq, ACKNOWLEDGEMENT, "Alive"); return; }
+    struct wbuf w;
+    frame_begin(&w, out, ACKNOWLEDGEMENT, rq->id);
+    put_name(&w, F_TEXT, "Alive");
+    put_uint(&w, F_EPOCH, cluster_epoch());
+    frame_end(&w, out);
+}
+
+/* Version 2 SHARD_MAP: F_EPOCH, then an F_MEMBER (F_PEER name, F_ADDR,
+   F_COUNT vnodes) per member in map order, which peers need to build the
+   same ring. Outside cluster mode the reply is epoch 0 with no members.
+   out->len is 0 if the map does not fit one datagram. */
+void shard_map_frame(const struct cluster_map *map, uint64_t id, struct reply *out) {
+    struct wbuf w;
+    frame_begin(&w, out, SHARD_MAP, id);
+    put_uint(&w, F_EPOCH, map ? map->epoch : 0);
+    for (int m = 0; map && m < map->count; ++m) {
+        char *f = put_open(&w, F_MEMBER);
+        put_name(&w, F_PEER, map->members[m].name);
+        put_addr(&w, F_ADDR, &map->members[m].addr);
+        put_uint(&w, F_COUNT, map->members[m].vnodes);
+        put_close(&w, f);
+    }
+    frame_end(&w, out);
+}
+
+void handle_shard_map(struct request *rq, struct reply *out) {
+    if (!rq->v2) { reply_status(out, rq, ERROR, "Unknown request"); return; }
+    pthread_rwlock_rdlock(&cluster_lock);
+    shard_map_frame(cluster, rq->id, out);
+    pthread_rwlock_unlock(&cluster_lock);
+}
+
+void stats_printf(struct text_page *tp, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void stats_printf(struct text_page *tp, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int w = vsnprintf(tp->buf + tp->pos, tp->cap - tp->pos, fmt, ap);
+    va_end(ap);
+    if (w > 0) tp->pos += (size_t)w < tp->cap - tp->pos ? (size_t)w : tp->cap - tp->pos - 1;
+}
+
+/* Version 2 STATS: one F_TEXT of "key value" lines with the table size,
+   search hit rate, bytes, per-type request and error counts with service
+   time percentiles summed over the workers, and the busiest peers by the
+   egress rate of their last heartbeat. */
+void handle_stats(struct request *rq, struct reply *out) {
+    if (!rq->v2) { reply_status(out, rq, ERROR, "Unknown request"); return; }
+    struct worker_stats *sum = calloc(1, sizeof(*sum));
+    if (!sum) { reply_status(out, rq, ERROR, "Out of memory"); return; }
+    pthread_mutex_lock(&stats_lock);
+    for (struct worker_stats *ws = stats_list; ws; ws = ws->next) {
+        for (size_t i = 0; i <= NSTAT_TYPES; ++i) {
+            sum->requests[i] += __atomic_load_n(&ws->requests[i], __ATOMIC_RELAXED);
+            sum->errors[i] += __atomic_load_n(&ws->errors[i], __ATOMIC_RELAXED);
+            for (int b = 0; b < HIST_BUCKETS; ++b) sum->latency[i].count[b] += __atomic_load_n(&ws->latency[i].count[b], __ATOMIC_RELAXED);
+        }
+        sum->hits += __atomic_load_n(&ws->hits, __ATOMIC_RELAXED);
+        sum->misses += __atomic_load_n(&ws->misses, __ATOMIC_RELAXED);
+        sum->bytes_in += __atomic_load_n(&ws->bytes_in, __ATOMIC_RELAXED);
+        sum->bytes_out += __atomic_load_n(&ws->bytes_out, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    long rows = 0, titles = 0;
+    for (int i = 0; i < NSHARDS; ++i) {
+        pthread_mutex_lock(&shards[i].lock);
+        rows += shards[i].st.row_live;
+        titles += shards[i].st.by_content.count;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    /* Busiest peers, kept sorted by rate, highest first. */
+    struct { char name[64]; uint32_t active; uint64_t rate; } top[STATS_TOP_PEERS];
+    int ntop = 0;
+    long peers = 0;
+    pthread_mutex_lock(&lease_lock);
+    for (int b = 0; b < LEASE_BUCKETS; ++b) {
+        for (struct lease *l = lease_table[b]; l; l = l->next, ++peers) {
+            uint64_t rate = __atomic_load_n(&l->rate, __ATOMIC_RELAXED);
+            int i = ntop;
+            if (ntop < STATS_TOP_PEERS) ntop++;
+            else if (top[STATS_TOP_PEERS-1].rate >= rate) continue;
+            else i = STATS_TOP_PEERS - 1;
+            for (; i > 0 && top[i-1].rate < rate; --i) top[i] = top[i-1];
+            snprintf(top[i].name, sizeof(top[i].name), "%s", l->peerName);
+            top[i].active = __atomic_load_n(&l->active, __ATOMIC_RELAXED);
+            top[i].rate = rate;
+        }
+    }
+    pthread_mutex_unlock(&lease_lock);
+
+    char text[MAX_DGRAM - 64];
+    struct text_page tp = { text, 0, sizeof(text) };
+    stats_printf(&tp, "uptime_s %.1f\nrows %ld\ntitles %ld\npeers %ld\n", (now_ms() - started_ms) / 1000.0, rows, titles, peers);
+    pthread_rwlock_rdlock(&cluster_lock);
+    if (cluster) stats_printf(&tp, "cluster_epoch %016llx\ncluster_members %d\n", (unsigned long long)cluster->epoch, cluster->count);
+    pthread_rwlock_unlock(&cluster_lock);
+    stats_printf(&tp, "digests %ld\n", __atomic_load_n(&digest_count, __ATOMIC_RELAXED));
+    stats_printf(&tp, "search_hits %llu\nsearch_misses %llu\nbytes_in %llu\nbytes_out %llu\ntrace_dropped %llu\n",
+                 (unsigned long long)sum->hits, (unsigned long long)sum->misses, (unsigned long long)sum->bytes_in,
+                 (unsigned long long)sum->bytes_out, (unsigned long long)__atomic_load_n(&trace_dropped, __ATOMIC_RELAXED));
+    for (size_t i = 0; i <= NSTAT_TYPES; ++i) {
+        if (!sum->requests[i]) continue;
+        stats_printf(&tp, "type %c requests %llu errors %llu p50_ns %llu p99_ns %llu p999_ns %llu\n",
+                     i < NSTAT_TYPES ? STAT_TYPES[i] : '?', (unsigned long long)sum->requests[i], (unsigned long long)sum->errors[i],
+                     (unsigned long long)hist_quantile(&sum->latency[i], 0.5), (unsigned long long)hist_quantile(&sum->latency[i], 0.99),
+                     (unsigned long long)hist_quantile(&sum->latency[i], 0.999));
+    }
+    for (int i = 0; i < ntop && top[i].rate; ++i)
+        stats_printf(&tp, "peer %s active %u rate_Bps %llu\n", top[i].name, top[i].active, (unsigned long long)top[i].rate);
+    free(sum);
+
+    struct wbuf w;
+    frame_begin(&w, out, STATS, rq->id);
+    put_field(&w, F_TEXT, text, tp.pos);
+    frame_end(&w, out);
+}
+
+/* Apply one log record. Replay is idempotent: registering a present row
+   or dropping an absent one changes nothing, so replaying a log that
+   overlaps the snapshot converges on the same state. */
+void replay_record(const struct log_record *rec) {
+    char peer[NAME_MAX_LEN+1], content[NAME_MAX_LEN+1];
+    if (span_name(peer, rec->peer) < 0 || span_name(content, rec->content) < 0) return;
+    if (rec->op == REGISTER) apply_register(peer, content, &rec->addr, rec->flags, rec->digest);
+    else if (rec->op == DEREGISTER) apply_deregister(peer, content);
+    else if (rec->op == QUIT && rec->shard < NSHARDS) remove_peer(&shards[rec->shard].st, peer);
+}
+
+/* Replay a log file and cut off a torn trailing record, so later appends
+   stay record-aligned. Files without a header are version 1 logs; *legacy
+   is set if one held any records. Returns the number of records, -1 on
+   error. */
+long replay_log(const char *name, int *legacy) {
+    int fd = openat(data_dir, name, O_RDWR);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) { close(fd); return -1; }
+    char *map = NULL;
+    if (sb.st_size > 0) {
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { close(fd); return -1; }
+        madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    }
+
+    int version = 1;
+    const char *p = map, *end = map + sb.st_size;
+    if (sb.st_size >= LOG_HEADER && memcmp(map, LOG_MAGIC, 4) == 0) {
+        uint32_t v;
+        memcpy(&v, map + 4, 4);
+        version = ntohl(v);
+        p += LOG_HEADER;
+        if (version != LOG_VERSION) {
+            fprintf(stderr, "%s: unknown log version %d\n", name, version);
+            munmap(map, sb.st_size);
+            close(fd);
+            return -1;
+        }
+    }
+    const char *first = p;
+    long n = 0;
+    struct log_record rec;
+    for (size_t k; (k = decode_record(p, end, version, &rec)) > 0; p += k, ++n) replay_record(&rec);
+    if (version == 1 && n > 0) *legacy = 1;
+    wal.bytes += p - first;
+
+    off_t good = p - map;
+    if (map) munmap(map, sb.st_size);
+    if (sb.st_size != good && ftruncate(fd, good) < 0) perror("ftruncate");
+    close(fd);
+    return n;
+}
+
+struct snap_loader {
+    pthread_t tid;
+    const char *map;
+    int version, first, step;
+    long loaded;
+};
+
+/* Rows of a shard are stored peer by peer, so the lease lookup is only
+   repeated when the peer changes. Runs before the workers start. */
+void *snap_load_main(void *arg) {
+    struct snap_loader *ld = arg;
+    int v1 = ld->version == 1;
+    const char *base = ld->map + (v1 ? SNAP_HEADER_V1 : SNAP_HEADER);
+    for (int s = ld->first; s < NSHARDS; s += ld->step) {
+        uint64_t from = get_be64(ld->map + 16 + 8*s), to = get_be64(ld->map + 16 + 8*(s+1));
+        uint32_t rows;
+        memcpy(&rows, ld->map + SNAP_HEADER_V1 + 4*s, 4);
+        struct store *st = &shards[s].st;
+        if (store_reserve(st, v1 ? (int)(to - from) : (int)ntohl(rows)) < 0) continue;
+        st->names_ready = 0;
+        struct lease *lease = NULL;
+        char peer[NAME_MAX_LEN+1] = {0}, content[NAME_MAX_LEN+1];
+        const char *p = base + from * (v1 ? BATCH_RECORD : 1), *end = base + to * (v1 ? BATCH_RECORD : 1);
+        struct log_record rec;
+        for (size_t k; (k = decode_record(p, end, ld->version, &rec)) > 0; p += k) {
+            if (!lease || strlen(peer) != rec.peer.len || memcmp(peer, rec.peer.p, rec.peer.len) != 0) {
+                if (span_name(peer, rec.peer) < 0) { lease = NULL; continue; }
+                lease = lease_renew(peer, 1);
+                if (!lease) continue;
+            }
+            if (span_name(content, rec.content) == 0 &&
+                add_entry(st, peer, content, &rec.addr, rec.flags, rec.digest, lease) != -1) ld->loaded++;
+        }
+    }
+    return NULL;
+}
+
+/* Load the snapshot with one thread per core, each filling its own
+   shards straight from the mapping. Returns rows loaded, -1 on error.
+   Version 1 snapshots index fixed records by number; version 2 ones
+   index variable records by byte offset and add per-shard row counts. */
+long load_snapshot(void) {
+    int fd = openat(data_dir, "snapshot", O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < SNAP_HEADER_V1) { close(fd); return -1; }
+    char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    uint32_t version, nshards;
+    memcpy(&version, map + 4, 4);
+    memcpy(&nshards, map + 8, 4);
+    version = ntohl(version);
+    uint64_t total = get_be64(map + 16 + 8*NSHARDS);
+    uint64_t need = version == 1 ? SNAP_HEADER_V1 + total * BATCH_RECORD : SNAP_HEADER + total;
+    if (memcmp(map, SNAP_MAGIC, 4) != 0 || (version != 1 && version != SNAP_VERSION) ||
+        ntohl(nshards) != NSHARDS || (uint64_t)sb.st_size < need) {
+        fprintf(stderr, "snapshot: bad header\n");
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nload = ncpu < 1 ? 1 : ncpu > NSHARDS ? NSHARDS : (int)ncpu;
+    struct snap_loader loaders[NSHARDS];
+    for (int i = 0; i < nload; ++i) {
+        loaders[i] = (struct snap_loader){ .map = map, .version = version, .first = i, .step = nload };
+        if (i > 0 && pthread_create(&loaders[i].tid, NULL, snap_load_main, &loaders[i]) != 0) { perror("pthread_create"); exit(1); }
+    }
+    snap_load_main(&loaders[0]);
+    long loaded = loaders[0].loaded;
+    for (int i = 1; i < nload; ++i) {
+        pthread_join(loaders[i].tid, NULL);
+        loaded += loaders[i].loaded;
+    }
+    munmap(map, sb.st_size);
+    return loaded;
+}
+
+/* Copy a shard's live rows out as snapshot records, peer by peer. Caller
+   holds the shard lock; the buffer is written after it is released. */
+char *dump_shard(struct store *st, size_t *count, size_t *bytes) {
+    size_t n = 0, size = 0;
+    for (int p = 0; p < st->peer_count; ++p)
+        for (int i = st->peers[p].rows ? st->peers[p].head : -1; i != -1; i = st->rows[i].peer_next) {
+            content_entry *e = &st->rows[i];
+            size += record_size(st->peers[p].peerName, st->titles[e->title].contentName, &e->addr, e->digest);
+            n++;
+        }
+    char *buf = malloc(size + 1);
+    if (!buf) return NULL;
+    char *r = buf;
+    for (int p = 0; p < st->peer_count; ++p)
+        for (int i = st->peers[p].rows ? st->peers[p].head : -1; i != -1; i = st->rows[i].peer_next) {
+            content_entry *e = &st->rows[i];
+            r += encode_record(r, REGISTER, st->peers[p].peerName, st->titles[e->title].contentName, &e->addr, e->flags, e->digest, 0);
+        }
+    *count = n;
+    *bytes = size;
+    return buf;
+}
+
+/* Open a log file for appending, writing its header if it is new. */
+int log_open(const char *name, int flags) {
+    int fd = openat(data_dir, name, O_WRONLY | O_CREAT | O_APPEND | flags, 0644);
+    if (fd < 0) return -1;
+    char header[LOG_HEADER];
+    uint32_t v = htonl(LOG_VERSION);
+    memcpy(header, LOG_MAGIC, 4);
+    memcpy(header + 4, &v, 4);
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (sb.st_size == 0 && write_all(fd, header, LOG_HEADER) < 0)) { close(fd); return -1; }
+    return fd;
+}
+
+/* Compact the log into a new snapshot. The log is rotated first, so every
+   change the dump might miss is in index.log; index.log.old is dropped
+   once the new snapshot is durably in place. If an earlier snapshot
+   failed, index.log.old is still needed and the log is not rotated.
+   Recovery passes rotate = 0 to fold old logs in before any log is open. */
+int write_snapshot(int rotate) {
+    double t0 = clock_ms();
+    if (rotate) {
+        pthread_mutex_lock(&wal.lock);
+        log_flush_locked();
+        fdatasync(wal.fd);
+        if (faccessat(data_dir, "index.log.old", F_OK, 0) != 0) {
+            int fd = log_open("index.log.tmp", O_TRUNC);
+            if (fd >= 0 && renameat(data_dir, "index.log", data_dir, "index.log.old") == 0 &&
+                renameat(data_dir, "index.log.tmp", data_dir, "index.log") == 0) {
+                close(wal.fd);
+                wal.fd = fd;
+                wal.bytes = 0;
+            } else if (fd >= 0) close(fd);
+        }
+        pthread_mutex_unlock(&wal.lock);
+    }
+
+    int fd = openat(data_dir, "snapshot.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("snapshot"); return -1; }
+    char header[SNAP_HEADER];
+    memset(header, 0, sizeof(header));
+    memcpy(header, SNAP_MAGIC, 4);
+    uint32_t v = htonl(SNAP_VERSION);
+    memcpy(header + 4, &v, 4);
+    v = htonl(NSHARDS);
+    memcpy(header + 8, &v, 4);
+
+    uint64_t total = 0, rows = 0;
+    double dump_ms = 0;
+    int ok = lseek(fd, SNAP_HEADER, SEEK_SET) == SNAP_HEADER;
+    for (int s = 0; ok && s < NSHARDS; ++s) {
+        put_be64(header + 16 + 8*s, total);
+        double t = clock_ms();
+        size_t n, bytes;
+        pthread_mutex_lock(&shards[s].lock);
+        char *buf = dump_shard(&shards[s].st, &n, &bytes);
+        pthread_mutex_unlock(&shards[s].lock);
+        dump_ms += clock_ms() - t;
+        if (!buf) { ok = 0; break; }
+        ok = write_all(fd, buf, bytes) == 0;
+        free(buf);
+        v = htonl(n);
+        memcpy(header + SNAP_HEADER_V1 + 4*s, &v, 4);
+        total += bytes;
+        rows += n;
+    }
+    put_be64(header + 16 + 8*NSHARDS, total);
+    double t1 = clock_ms();
+    ok = ok && pwrite(fd, header, SNAP_HEADER, 0) == SNAP_HEADER && fdatasync(fd) == 0;
+    close(fd);
+    double t2 = clock_ms();
+    if (!ok || renameat(data_dir, "snapshot.tmp", data_dir, "snapshot") < 0) {
+        perror("snapshot");
+        unlinkat(data_dir, "snapshot.tmp", 0);
+        return -1;
+    }
+    fsync(data_dir);
+    unlinkat(data_dir, "index.log.old", 0);
+    if (persist_stats)
+        printf("SNAPSHOT: %llu entries, %llu bytes in %.1f ms (shards locked %.1f ms, fsync %.1f ms)\n",
+               (unsigned long long)rows, (unsigned long long)(SNAP_HEADER + total),
+               clock_ms() - t0, dump_ms, t2 - t1);
+    return 0;
+}
+
+/* Flush the log every second and compact it on a timer or once it grows
+   past LOG_ROTATE. First, index the names a snapshot load deferred, one
+   shard at a time, so serving resumed without waiting for them. */
+void *persist_main(void *arg) {
+    (void)arg;
+    double t0 = clock_ms();
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_lock(&shards[s].lock);
+        names_build(&shards[s].st);
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    if (persist_stats) printf("RECOVER: name indexes built in %.1f ms\n", clock_ms() - t0);
+    double last = clock_ms();
+    while (1) {
+        sleep(1);
+        pthread_mutex_lock(&wal.lock);
+        log_flush_locked();
+        int fd = wal.fd;
+        uint64_t bytes = wal.bytes;
+        pthread_mutex_unlock(&wal.lock);
+        fdatasync(fd);
+        if (bytes >= LOG_ROTATE || (bytes > 0 && clock_ms() - last >= snapshot_secs * 1000.0)) {
+            write_snapshot(1);
+            last = clock_ms();
+        }
+    }
+    return NULL;
+}
+
+/* Rebuild the tables from the snapshot and the logs, then open the log
+   for appending. Restored rows get a fresh lease. Version 1 logs cannot
+   be appended to, so they are folded into a new snapshot first. */
+void recover(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) { perror(dir); exit(1); }
+    data_dir = open(dir, O_RDONLY | O_DIRECTORY);
+    if (data_dir < 0) { perror(dir); exit(1); }
+
+    double t0 = clock_ms();
+    long snap = load_snapshot();
+    double t1 = clock_ms();
+    int legacy = 0;
+    long old = replay_log("index.log.old", &legacy);
+    long cur = replay_log("index.log", &legacy);
+    double t2 = clock_ms();
+    if (snap < 0 || old < 0 || cur < 0) { fprintf(stderr, "%s: cannot recover index\n", dir); exit(1); }
+    if (legacy) {
+        if (write_snapshot(0) < 0) { fprintf(stderr, "%s: cannot convert version 1 log\n", dir); exit(1); }
+        unlinkat(data_dir, "index.log", 0);
+        wal.bytes = 0;
+    }
+
+    wal.fd = log_open("index.log", 0);
+    if (wal.fd < 0) { perror("index.log"); exit(1); }
+    printf("Recovered %ld entries and %ld log records from %s\n", snap, old + cur, dir);
+    if (persist_stats)
+        printf("RECOVER: snapshot %.1f ms, log replay %.1f ms, total %.1f ms\n", t1 - t0, t2 - t1, t2 - t0);
+}
+
+/* Resolve "host:port" ("[v6addr]:port" for IPv6 literals). */
+int parse_host_port(char *s, struct net_addr *a) {
+    char *colon = strrchr(s, ':');
+    if (!colon) return -1;
+    *colon = '\0';
+    int port = atoi(colon + 1);
+    char *host = s;
+    if (host[0] == '[' && colon[-1] == ']') { host++; colon[-1] = '\0'; }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *res;
+    if (port <= 0 || port > 65535 || getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    memset(a, 0, sizeof(*a));
+    if (res->ai_family == AF_INET6) {
+        a->family = 6;
+        memcpy(a->ip, &((struct sockaddr_in6*)res->ai_addr)->sin6_addr, 16);
+    } else {
+        a->family = 4;
+        memcpy(a->ip, &((struct sockaddr_in*)res->ai_addr)->sin_addr, 4);
+    }
+    a->port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* Read a map file; NULL after printing why if it is unusable. The epoch
+   hashes every member in file order, so servers reading the same file
+   agree on it without talking to each other. */
+struct cluster_map *cluster_load(const char *path, const char *self) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return NULL; }
+    struct cluster_map *map = calloc(1, sizeof(*map));
+    if (!map) { perror("calloc"); fclose(f); return NULL; }
+    map->self = -1;
+    char line[1024], hostport[NAME_MAX_LEN+1];
+    int lineno = 0, bad = 0;
+    uint64_t epoch = 14695981039346656037ULL;
+    while (!bad && fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        struct member parsed = { .vnodes = VNODES }, *m = &parsed;
+        int n = sscanf(line, "%255s %255s %d", m->name, hostport, &m->vnodes);
+        if (n <= 0) continue;
+        if (map->count == CLUSTER_MAX) {
+            fprintf(stderr, "%s:%d: more than %d members\n", path, lineno, CLUSTER_MAX);
+            bad = 1;
+            break;
+        }
+        if (n < 2 || m->vnodes < 1 || m->vnodes > VNODES_MAX || parse_host_port(hostport, &m->addr) < 0) {
+            fprintf(stderr, "%s:%d: expected name host:port [vnodes]\n", path, lineno);
+            bad = 1;
+            break;
+        }
+        for (int i = 0; i < map->count && !bad; ++i)
+            if (strcmp(map->members[i].name, m->name) == 0) { fprintf(stderr, "%s:%d: duplicate member %s\n", path, lineno, m->name); bad = 1; }
+        if (self && strcmp(m->name, self) == 0) map->self = map->count;
+        char key[NAME_MAX_LEN + 32];
+        int klen = snprintf(key, sizeof(key), "%s %d ", m->name, m->vnodes);
+        memcpy(key + klen, &m->addr, sizeof(m->addr));
+        epoch = (epoch ^ ring_hash(key, klen + sizeof(m->addr))) * 1099511628211ULL;
+        map->members[map->count++] = parsed;
+    }
+    fclose(f);
+    if (!bad && map->count == 0) { fprintf(stderr, "%s: no members\n", path); bad = 1; }
+    /* Peers fetch the map in one SHARD_MAP datagram. */
+    struct reply *probe = bad ? NULL : malloc(sizeof(*probe));
+    if (probe) {
+        shard_map_frame(map, 0, probe);
+        if (probe->len == 0) { fprintf(stderr, "%s: member names too long for one SHARD_MAP reply\n", path); bad = 1; }
+        free(probe);
+    }
+    if (bad || ring_build(map) < 0) { free(map->ring); free(map); return NULL; }
+    map->epoch = epoch ? epoch : 1;
+    return map;
+}
+
+/* Switch to a new map, then drop every row whose name now belongs to
+   another member; the peers register those names with the new owner when
+   they see the epoch change. Returns the number of rows dropped. */
+int cluster_install(struct cluster_map *map) {
+    pthread_rwlock_wrlock(&cluster_lock);
+    struct cluster_map *old = cluster;
+    cluster = map;
+    pthread_rwlock_unlock(&cluster_lock);
+    if (old) { free(old->ring); free(old); }
+
+    int dropped = 0;
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_lock(&shards[s].lock);
+        struct store *st = &shards[s].st;
+        for (int t = 0; t < st->title_count; ++t) {
+            if (!st->titles[t].contentName || owns(st->titles[t].contentName)) continue;
+            while (st->titles[t].contentName && st->titles[t].heap_len > 0) {
+                int r = st->titles[t].heap[0];
+                log_append(DEREGISTER, st->peers[st->rows[r].peer].peerName, st->titles[t].contentName, NULL, 0, 0, 0);
+                remove_entry(st, r);
+                dropped++;
+            }
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    printf("CLUSTER: epoch %016llx, %d members, %s; dropped %d rows owned elsewhere\n",
+           (unsigned long long)map->epoch, map->count, map->self < 0 ? "not a member" : map->members[map->self].name, dropped);
+    fflush(stdout);
+    return dropped;
+}
+
+/* Re-read the map file whenever its modification time or size changes. */
+void *cluster_main(void *arg) {
+    struct stat last = *(struct stat*)arg, sb;
+    while (1) {
+        sleep(1);
+        if (stat(cluster_file, &sb) < 0) continue;
+        if (sb.st_mtim.tv_sec == last.st_mtim.tv_sec && sb.st_mtim.tv_nsec == last.st_mtim.tv_nsec && sb.st_size == last.st_size) continue;
+        last = sb;
+        struct cluster_map *map = cluster_load(cluster_file, cluster_self);
+        if (!map) continue;
+        if (map->epoch == cluster_epoch()) { free(map->ring); free(map); continue; }
+        cluster_install(map);
+    }
+    return NULL;
+}
+
+/* Returns the request type, 0 if it could not be parsed. */
+char dispatch(char *buf, size_t len, struct reply *out) {
+    struct request rq;
+    memset(&rq, 0, sizeof(rq));
+    if (len < 1) { out->len = 0; return 0; }
+    if ((unsigned char)buf[0] == WIRE_MAGIC) {
+        if (len < 2 || (unsigned char)buf[1] != WIRE_VERSION || parse_v2(buf, len, &rq) < 0) {
+            rq.v2 = 1;
+            reply_status(out, &rq, ERROR, len >= 2 && (unsigned char)buf[1] != WIRE_VERSION ? "Unsupported version" : "Malformed request");
+            return 0;
+        }
+    } else if (buf[0] == BATCH_UPDATE) {
+        handle_batch(buf, len, out);
+        return BATCH_UPDATE;
+    } else {
+        if (len < sizeof(struct register_pdu)) memset(buf + len, 0, sizeof(struct register_pdu) - len);
+        parse_legacy(buf, len, &rq);
+    }
+
+    switch (rq.type) {
+        case REGISTER: handle_register(&rq, out); break;
+        case BATCH_UPDATE: handle_batch_v2(&rq, out); break;
+        case ONLINE: handle_online(&rq, out); break;
+        case ONLINE_PAGE: handle_online_page(&rq, out); break;
+        case SEARCH: handle_search(&rq, out); break;
+        case SEARCH_MULTI: handle_search_multi(&rq, out); break;
+        case DEREGISTER: handle_deregister(&rq, out); break;
+        case QUIT: handle_quit(&rq, out); break;
+        case HEARTBEAT: handle_heartbeat(&rq, out); break;
+        case NAME_SEARCH: handle_name_search(&rq, out); break;
+        case STATS: handle_stats(&rq, out); break;
+        case SHARD_MAP: handle_shard_map(&rq, out); break;
+        default: reply_status(out, &rq, ERROR, "Unknown request");
+    }
+    return rq.type;
+}
+
+/* Count a handled request against its type. */
+void stats_record(char type, size_t in, const struct reply *out, int64_t ns) {
+    const char *t = type ? strchr(STAT_TYPES, type) : NULL;
+    int i = t ? (int)(t - STAT_TYPES) : (int)NSTAT_TYPES;
+    stat_add(&my_stats->requests[i], 1);
+    if (out->len) {
+        char rtype = (unsigned char)out->buf[0] == WIRE_MAGIC ? out->buf[5] : out->buf[0];
+        if (rtype == ERROR) stat_add(&my_stats->errors[i], 1);
+    }
+    stat_add(&my_stats->bytes_in, in);
+    stat_add(&my_stats->bytes_out, out->len);
+    hist_add(&my_stats->latency[i], ns);
+}
+
+/* Each worker owns one SO_REUSEPORT socket, so the kernel spreads peers
+   across workers. Datagrams are drained and answered BATCH at a time. */
+void *worker_main(void *arg) {
+    int sock = *(int*)arg;
+    char (*req)[MAX_DGRAM] = malloc(BATCH * MAX_DGRAM);
+    struct reply *rep = malloc(BATCH * sizeof(struct reply));
+    struct sockaddr_in6 from[BATCH];
+    struct iovec iin[BATCH], iout[BATCH];
+    struct mmsghdr in[BATCH], out[BATCH];
+    if (!req || !rep) { perror("malloc"); return NULL; }
+    if (posix_memalign((void**)&my_stats, 64, sizeof(*my_stats)) != 0) { perror("malloc"); return NULL; }
+    memset(my_stats, 0, sizeof(*my_stats));
+    pthread_mutex_lock(&stats_lock);
+    my_stats->next = stats_list;
+    stats_list = my_stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    memset(in,0,sizeof(in));
+    for (int i = 0; i < BATCH; ++i) {
+        iin[i].iov_base = req[i];
+        iin[i].iov_len = MAX_DGRAM;
+        in[i].msg_hdr.msg_iov = &iin[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name = &from[i];
+    }
+
+    while (1) {
+        for (int i = 0; i < BATCH; ++i) in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        int n = recvmmsg(sock, in, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) { perror("recvmmsg"); continue; }
+
+        int m = 0;
+        memset(out,0,sizeof(out[0]) * n);
+        int64_t t = clock_ns();
+        for (int i = 0; i < n; ++i) {
+            char type = dispatch(req[i], in[i].msg_len, &rep[i]);
+            int64_t done = clock_ns();
+            stats_record(type, in[i].msg_len, &rep[i], done - t);
+            t = done;
+            if (rep[i].len == 0) continue;
+            iout[m].iov_base = rep[i].buf;
+            iout[m].iov_len = rep[i].len;
+            out[m].msg_hdr.msg_iov = &iout[m];
+            out[m].msg_hdr.msg_iovlen = 1;
+            out[m].msg_hdr.msg_name = &from[i];
+            out[m].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            m++;
+        }
+        log_commit();
+
+        for (int sent = 0; sent < m; ) {
+            int k = sendmmsg(sock, out + sent, m - sent, 0);
+            if (k < 0) { perror("sendmmsg"); break; }
+            sent += k;
+        }
+    }
+    return NULL;
+}
+
+/* One dual-stack socket takes IPv4 peers as mapped addresses; hosts
+   without IPv6 fall back to plain IPv4. Only workers sharing the port
+   set SO_REUSEPORT, so a lone server started twice fails to bind. */
+int open_udp_socket(int port, int shared) {
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0), v6 = sock >= 0;
+    if (!v6) sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) { perror("socket"); return -1; }
+
+    int one = 1, zero = 0;
+    if (shared && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) { perror("setsockopt"); close(sock); return -1; }
+    if (v6) setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    /* Room for bursts of pipelined batch datagrams; capped by rmem_max. */
+    int rcvbuf = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in sin;
+    memset(&sin6,0,sizeof(sin6));
+    memset(&sin,0,sizeof(sin));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_any;
+    sin6.sin6_port = htons(port);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+
+    int r = v6 ? bind(sock, (struct sockaddr*)&sin6, sizeof(sin6)) : bind(sock, (struct sockaddr*)&sin, sizeof(sin));
+    if (r < 0) { perror("bind"); close(sock); return -1; }
+    return sock;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 3000;
+    int nthreads = 1;
+
+    static struct option opts[] = {
+        {"threads", required_argument, 0, 't'},
+        {"lease", required_argument, 0, 'l'},
+        {"data-dir", required_argument, 0, 'd'},
+        {"snapshot", required_argument, 0, 's'},
+        {"persist-stats", no_argument, 0, 'p'},
+        {"log", required_argument, 0, 'g'},
+        {"cluster", required_argument, 0, 'c'},
+        {"member", required_argument, 0, 'm'},
+        {0, 0, 0, 0}
+    };
+    const char *dir = NULL;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:l:d:s:pg:c:m:", opts, NULL)) != -1) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'l': lease_ms = (int64_t)atoi(optarg) * 1000; break;
+            case 'd': dir = optarg; break;
+            case 's': snapshot_secs = atoi(optarg); break;
+            case 'p': persist_stats = 1; break;
+            case 'g':
+                trace_file = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "a");
+                if (!trace_file) { perror(optarg); exit(1); }
+                break;
+            case 'c': cluster_file = optarg; break;
+            case 'm': cluster_self = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [--threads N] [--lease SECONDS] [--data-dir DIR [--snapshot SECONDS] [--persist-stats]] [--log FILE|-] [--cluster MAP_FILE --member NAME] [port]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind < argc) port = atoi(argv[optind]);
+    if (nthreads < 1) nthreads = 1;
+    started_ms = now_ms();
+
+    for (int s = 0; s < NSHARDS; ++s) {
+        pthread_mutex_init(&shards[s].lock, NULL);
+        if (store_init(&shards[s].st) < 0) { perror("store_init"); exit(1); }
+    }
+    if (dir) recover(dir);
+
+    struct stat map_stat;
+    if (cluster_file) {
+        struct cluster_map *map = stat(cluster_file, &map_stat) == 0 ? cluster_load(cluster_file, cluster_self) : NULL;
+        if (!map) { fprintf(stderr, "%s: cannot load the shard map\n", cluster_file); exit(1); }
+        if (map->self < 0) fprintf(stderr, "%s: member %s is not listed; this server owns no content\n", cluster_file, cluster_self ? cluster_self : "(none)");
+        cluster_install(map);
+    }
+
+    int *socks = calloc(nthreads, sizeof(int));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    if (!socks || !tids) { perror("calloc"); exit(1); }
+
+    for (int i = 0; i < nthreads; ++i)
+        if ((socks[i] = open_udp_socket(port, nthreads > 1)) < 0) exit(1);
+
+    printf("Index server listening on port %d (%d thread%s)\n", port, nthreads, nthreads == 1 ? "" : "s");
+
+    pthread_t wheel_thread;
+    if (lease_ms > 0 && pthread_create(&wheel_thread, NULL, wheel_main, NULL) != 0) { perror("pthread_create"); exit(1); }
+    pthread_t persist_thread;
+    if (dir && pthread_create(&persist_thread, NULL, persist_main, NULL) != 0) { perror("pthread_create"); exit(1); }
+    pthread_t cluster_thread;
+    if (cluster_file && pthread_create(&cluster_thread, NULL, cluster_main, &map_stat) != 0) { perror("pthread_create"); exit(1); }
+    pthread_t trace_thread;
+    if (trace_file && pthread_create(&trace_thread, NULL, trace_main, NULL) != 0) { perror("pthread_create"); exit(1); }
+
+    for (int i = 1; i < nthreads; ++i)
+        if (pthread_create(&tids[i], NULL, worker_main, &socks[i]) != 0) { perror("pthread_create"); exit(1); }
+    worker_main(&socks[0]);
 
-    close(sock);
+    for (int i = 0; i < nthreads; ++i) close(socks[i]);
     return 0;
 }
@@ -2,6 +2,7 @@
    Peer program for P2P Project
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,7 +15,18 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #define REGISTER 'R'
 #define DOWNLOAD 'D'
@@ -24,11 +36,81 @@
 #define ACKNOWLEDGEMENT 'A'
 #define ERROR 'E'
 #define CONTENT 'C'
+#define CONTENT_LZ4 'Z'
 #define QUIT 'Q'
+#define SEARCH_MULTI 'M'
+#define STAT 'F'
+#define HASHES 'H'
+#define BATCH_UPDATE 'B'
+#define ONLINE_PAGE 'L'
+#define HEARTBEAT 'K'
+#define NAME_SEARCH 'W'
+#define NAME_PREFIX 'P'
+#define NAME_SUBSTRING 'S'
+#define STATS 'Y'
+#define SHARD_MAP 'G'
+#define DHT_FIND_NODE 'N'
+#define DHT_FIND_VALUE 'V'
+#define DHT_STORE 'X'
 
-#define MAX_FILES 100
 #define NAME_LEN 10
-#define CHUNK_SIZE 1024
+#define NAME_MAX_LEN 255
+#define LOCAL_BUCKETS 1024
+#define MAX_EVENTS 64
+#define SEGMENT_SIZE (1 << 20)
+#define FRAME_MIN (64 << 10)
+#define FRAME_MAX (4 << 20)
+#define SOCK_BUF (8 << 20)
+#define SWARM_CHUNK (1 << 20)
+#define MAX_PROVIDERS 16
+#define MAX_DGRAM 8192
+#define BATCH_WINDOW 8
+#define RTO_INITIAL_MS 500
+#define RTO_MIN_MS 50
+#define RTO_MAX_MS 4000
+#define CALL_TRIES 5
+#define CURSOR_END UINT64_MAX
+#define MATCH_MAX 100
+#define MAP_MAGIC "P2PM"
+#define MAP_HEADER 24
+#define CONN_REQ_MAX 1024
+#define HIST_BUCKETS 640
+#define DEMAND_HALF_LIFE_MS (10 * 60 * 1000.0)
+#define CLUSTER_MAX 64
+#define CODEC_LZ4 1
+#define CODEC_FRAME (256 << 10)
+#define LZ4_HASH_LOG 14
+#define DIGEST_FILE ".p2p-digests"
+#define DHT_K 8
+#define DHT_ALPHA 3
+#define DHT_SHORTLIST (4 * DHT_K)
+#define DHT_RTO_MS 300
+#define DHT_STALE_MS (15 * 60 * 1000)
+#define DHT_TTL_MS (30 * 60 * 1000)
+#define DHT_REPUBLISH_MS (10 * 60 * 1000)
+#define DHT_STORE_BUCKETS 4096
+#define DHT_VALUES_MAX 65536
+#define DHT_HANDOFF_MAX 256
+#define DIGEST_MAGIC "P2PD"
+#define DIGEST_RECORD 40
+
+/* Version 2 wire format, spoken to the index and to content servers:
+     WIRE_MAGIC, WIRE_VERSION, varint body length, body
+   where the body is the type byte, a varint request id echoed in the
+   reply, then fields of a tag byte, a varint length and that many bytes.
+   See index.c for the field tags each request uses. Content servers
+   still take the legacy fixed-size request from older peers. */
+#define WIRE_MAGIC 0xB2
+#define WIRE_VERSION 2
+
+enum {
+    F_PEER = 1, F_CONTENT, F_ADDR, F_COUNT, F_CURSOR, F_OFFSET, F_LENGTH, F_MODE,
+    F_STATUS, F_TEXT, F_PROVIDER, F_LOAD, F_RECORD, F_ROW, F_FLAGS,
+    F_FRAME, F_EPOCH, F_MEMBER, F_DIGEST, F_CODECS, F_KEY, F_NODE, F_ORIGIN
+};
+
+/* Provider flag: its content server takes version 2 requests. */
+#define PROVIDER_V2 1
 
 struct register_pdu {
     char type;
@@ -38,22 +120,54 @@ struct register_pdu {
     char padding[16];
 };
 
-struct simple_pdu {
-    char type;
-    char data[100];
+/* A content server address; port in network byte order. */
+struct net_addr {
+    uint8_t family;             /* 4 or 6 */
+    uint8_t ip[16];
+    uint16_t port;
+};
+
+/* contentName is set when the provider serves the bytes searched for
+   under another name, and is the name to ask it for. */
+struct provider {
+    char peerName[NAME_MAX_LEN+1];
+    char contentName[NAME_MAX_LEN+1];
+    struct net_addr addr;
+    uint8_t flags;
+    uint64_t digest;            /* 0 if the provider reported none */
+};
+
+/* One entry of a BATCH_UPDATE datagram; op is REGISTER or DEREGISTER. */
+struct batch_record {
+    char op;
+    char *contentName;          /* owned by the record array */
+    uint64_t digest;            /* sent with REGISTER when nonzero */
+};
+
+/* Bytes inside a received frame. */
+struct span {
+    const char *p;
+    size_t len;
 };
 
-struct content_pdu {
+/* A parsed version 2 frame; fields..end are its fields, in place. */
+struct frame {
     char type;
-    char data[CHUNK_SIZE];
-    ssize_t data_len;
+    uint64_t id;
+    const char *fields, *end;
+};
+
+/* Request writer; overflow is set instead of writing past end. */
+struct wbuf {
+    char *p, *end;
+    int overflow;
 };
 
 ssize_t recv_all(int sock, void *buf, size_t len) {
     size_t total = 0;
     char *p = buf;
     while (total < len) {
-        ssize_t r = recv(sock, p + total, len - total, 0);
+        ssize_t r = recv(sock, p + total, len - total, MSG_WAITALL);
         if (r < 0) { if (errno == EINTR) continue; return -1; }
         if (r == 0) return 0;
         total += r;
@@ -72,10 +186,915 @@ ssize_t write_all(int sock, const void *buf, size_t len) {
     return total;
 }
 
-char local_names[MAX_FILES][NAME_LEN];
-int listen_fds[MAX_FILES];
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Files this peer serves. Every file is reachable through the one shared
+   listening socket; the server thread looks names up here per DOWNLOAD. */
+struct local_file {
+    struct local_file *next;
+    /* Chunk manifest, built on the first HASHES request or installed after a
+       verified download, and rebuilt if the file's size or mtime changes. */
+    uint64_t size;
+    time_t mtime;
+    uint32_t nchunks;
+    uint64_t *hashes;
+    uint64_t digest;            /* content digest, 0 until known */
+    int compressible;           /* 1 or -1 once a first frame has shown it, else 0 */
+    /* Downloaded replicas are cache entries, evicted to stay within
+       cache_quota; files registered by hand or seeded are never evicted.
+       demand counts downloads started from this peer (HASHES requests),
+       halving every DEMAND_HALF_LIFE_MS. */
+    int cached;
+    uint64_t cache_bytes;
+    int replicas;               /* other providers when it was fetched */
+    double last_used, demand, demand_at;
+    char name[];
+};
+
+struct local_file *local_table[LOCAL_BUCKETS];
 int local_count = 0;
-char peerName[NAME_LEN] = {0};
+pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t cache_quota = 0;       /* bytes of cache entries kept, 0 for no limit */
+uint64_t cache_used = 0;
+int cache_by_demand = 0;        /* evict by demand per replica instead of LRU */
+char peerName[NAME_MAX_LEN+2] = {0};
+
+/* Upload load, reported to the index with each heartbeat. active counts
+   content requests in progress, not idle keep-alive connections. Busy
+   time is wall time with at least one request in progress, so the rate is
+   what this peer achieves while serving rather than averaged over idle. */
+struct upload_stats {
+    pthread_mutex_t lock;
+    int active;
+    uint64_t bytes;
+    double busy_ms, busy_since;
+} uploads = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+
+/* Upload scheduler settings and state; the scheduler follows struct conn. */
+struct conn_list {
+    struct conn *head, *tail;
+    int count;
+};
+
+uint64_t egress_cap = 0;        /* bytes/s over all uploads, 0 for none */
+uint64_t peer_cap = 0;          /* bytes/s per downloader address, 0 for none */
+int upload_slots = 0;           /* concurrent DOWNLOADs, 0 for no limit */
+int uploads_running = 0;
+struct conn_list small_queue, large_queue, parked;
+struct conn_list hashing;       /* HASHES requests waiting on the manifest worker */
+
+/* Service time histogram in microseconds, log-linear as in the index. */
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+};
+
+/* Counters for the STATS reply, updated with relaxed atomics from the
+   content server and the download threads. served[] and serve_us[] are
+   per request type: DOWNLOAD, STAT, HASHES. */
+struct peer_stats {
+    uint64_t connections;
+    uint64_t served[3];
+    struct hist serve_us[3];
+    uint64_t bytes_fetched, chunks_ok, chunks_bad;
+    struct hist fetch_us;       /* per swarm chunk */
+    uint64_t lz4_frames, lz4_saved;
+    uint64_t dht_lookups, dht_found, dht_hops;
+    struct hist dht_us;
+} pstats;
+int accept_codecs = CODEC_LZ4;  /* offered in DOWNLOAD requests */
+enum { DHT_OFF, DHT_FALLBACK, DHT_RACE, DHT_FIRST };
+int dht_mode = DHT_FALLBACK;    /* how a download's SEARCH uses the DHT, with -J */
+int dht_sock = -1;              /* DHT socket; -1 without -J */
+double started_ms;
+
+/* DOWNLOAD carries an optional byte range: a 64-bit offset and a 64-bit
+   length, where length 0 means "to EOF". Legacy requests put both
+   big-endian in the padding; legacy clients zero it and get the whole
+   file. */
+void put_be64(char *p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) { p[i] = v & 0xff; v >>= 8; }
+}
+
+uint64_t get_be64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; ++name) { h ^= (unsigned char)*name; h *= 16777619u; }
+    return h;
+}
+
+void addr_from_sin(struct net_addr *a, const struct sockaddr_in *sin) {
+    memset(a, 0, sizeof(*a));
+    a->family = 4;
+    memcpy(a->ip, &sin->sin_addr, 4);
+    a->port = sin->sin_port;
+}
+
+const char *addr_str(const struct net_addr *a, char *buf, size_t len) {
+    return inet_ntop(a->family == 6 ? AF_INET6 : AF_INET, a->ip, buf, len);
+}
+
+int addr_eq(const struct net_addr *a, const struct net_addr *b) {
+    return a->family == b->family && a->port == b->port && memcmp(a->ip, b->ip, a->family == 6 ? 16 : 4) == 0;
+}
+
+/* Fill a sockaddr for addr; returns its length. */
+socklen_t addr_to_sockaddr(const struct net_addr *addr, struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+    if (addr->family == 6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, addr->ip, 16);
+        sin6->sin6_port = addr->port;
+        return sizeof(*sin6);
+    }
+    struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, addr->ip, 4);
+    sin->sin_port = addr->port;
+    return sizeof(*sin);
+}
+
+/* Version 2 encoding. A length written before its contents is a varint
+   padded to a fixed width, so nothing moves once they are in place. */
+void put_bytes(struct wbuf *w, const void *p, size_t n) {
+    if (w->overflow || (size_t)(w->end - w->p) < n) { w->overflow = 1; return; }
+    memcpy(w->p, p, n);
+    w->p += n;
+}
+
+void put_varint(struct wbuf *w, uint64_t v) {
+    char b[10];
+    int n = 0;
+    do {
+        b[n] = v & 0x7f;
+        v >>= 7;
+        if (v) b[n] |= 0x80;
+        n++;
+    } while (v);
+    put_bytes(w, b, n);
+}
+
+void put_field(struct wbuf *w, int tag, const void *p, size_t n) {
+    char t = tag;
+    put_bytes(w, &t, 1);
+    put_varint(w, n);
+    put_bytes(w, p, n);
+}
+
+void put_name(struct wbuf *w, int tag, const char *name) {
+    put_field(w, tag, name, strlen(name));
+}
+
+void put_uint(struct wbuf *w, int tag, uint64_t v) {
+    char b[10];
+    struct wbuf tmp = { b, b + sizeof(b), 0 };
+    put_varint(&tmp, v);
+    put_field(w, tag, b, tmp.p - b);
+}
+
+void put_addr(struct wbuf *w, int tag, const struct net_addr *a) {
+    char b[19];
+    int iplen = a->family == 6 ? 16 : 4;
+    b[0] = a->family;
+    memcpy(b + 1, a->ip, iplen);
+    memcpy(b + 1 + iplen, &a->port, 2);
+    put_field(w, tag, b, 3 + iplen);
+}
+
+/* Nested fields get a two-byte length, enough for any datagram. */
+char *put_open(struct wbuf *w, int tag) {
+    char hdr[3] = { tag, 0, 0 };
+    put_bytes(w, hdr, 3);
+    return w->p;
+}
+
+void put_close(struct wbuf *w, char *start) {
+    if (w->overflow) return;
+    size_t n = w->p - start;
+    start[-2] = (n & 0x7f) | 0x80;
+    start[-1] = n >> 7;
+}
+
+void frame_begin(struct wbuf *w, char *buf, size_t cap, char type, uint64_t id) {
+    *w = (struct wbuf){ buf, buf + cap, 0 };
+    char hdr[5] = { (char)WIRE_MAGIC, WIRE_VERSION, 0, 0, 0 };
+    put_bytes(w, hdr, sizeof(hdr));
+    put_bytes(w, &type, 1);
+    put_varint(w, id);
+}
+
+/* Fill in the three-byte body length; returns the frame length, or 0 if
+   it did not fit. */
+size_t frame_end(struct wbuf *w, char *buf) {
+    if (w->overflow) return 0;
+    size_t n = w->p - (buf + 5);
+    buf[2] = (n & 0x7f) | 0x80;
+    buf[3] = ((n >> 7) & 0x7f) | 0x80;
+    buf[4] = n >> 14;
+    return w->p - buf;
+}
+
+int get_varint(const char **p, const char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+    return 0;
+}
+
+int next_field(const char **p, const char *end, int *tag, struct span *val) {
+    const char *q = *p;
+    uint64_t n;
+    if (q >= end) return 0;
+    *tag = (unsigned char)*q++;
+    if (!get_varint(&q, end, &n) || n > (uint64_t)(end - q)) return 0;
+    val->p = q;
+    val->len = n;
+    *p = q + n;
+    return 1;
+}
+
+uint64_t span_uint(struct span s) {
+    const char *p = s.p;
+    uint64_t v;
+    return get_varint(&p, s.p + s.len, &v) ? v : 0;
+}
+
+int span_addr(struct span s, struct net_addr *a) {
+    memset(a, 0, sizeof(*a));
+    if (s.len < 1) return 0;
+    size_t iplen = s.p[0] == 4 ? 4 : s.p[0] == 6 ? 16 : 0;
+    if (!iplen || s.len != 3 + iplen) return 0;
+    a->family = s.p[0];
+    memcpy(a->ip, s.p + 1, iplen);
+    memcpy(&a->port, s.p + 1 + iplen, 2);
+    return 1;
+}
+
+/* Copy a name field into a NUL-terminated buffer of NAME_MAX_LEN+1. */
+void span_name(char *dst, struct span s) {
+    size_t n = s.len > NAME_MAX_LEN ? NAME_MAX_LEN : s.len;
+    memcpy(dst, s.p, n);
+    dst[n] = '\0';
+}
+
+int parse_frame(const char *buf, size_t len, struct frame *f) {
+    const char *p = buf + 2, *end = buf + len;
+    uint64_t n;
+    if (len < 5 || (unsigned char)buf[0] != WIRE_MAGIC || buf[1] != WIRE_VERSION) return -1;
+    if (!get_varint(&p, end, &n) || n < 1 || n > (uint64_t)(end - p)) return -1;
+    end = p + n;
+    f->type = *p++;
+    if (!get_varint(&p, end, &f->id)) return -1;
+    f->fields = p;
+    f->end = end;
+    return 0;
+}
+
+/* The F_TEXT of a reply, for messages. */
+const char *frame_text(const struct frame *f, char *buf, size_t cap) {
+    int tag;
+    struct span val;
+    snprintf(buf, cap, "(no message)");
+    for (const char *p = f->fields; next_field(&p, f->end, &tag, &val); )
+        if (tag == F_TEXT) snprintf(buf, cap, "%.*s", (int)val.len, val.p);
+    return buf;
+}
+
+/* XXH64, streamed. Chunk hashes are computed while data arrives off the
+   socket, so the hash has to keep up with the transfer; XXH64's four
+   independent lanes run at several GB/s per core. */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memsize;
+};
+
+uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t read_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    acc += in * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+void xxh64_init(struct xxh64 *st) {
+    memset(st, 0, sizeof(*st));
+    st->v[0] = XXH_P1 + XXH_P2;
+    st->v[1] = XXH_P2;
+    st->v[2] = 0;
+    st->v[3] = -XXH_P1;
+}
+
+void xxh64_update(struct xxh64 *st, const void *data, size_t len) {
+    const unsigned char *p = data;
+    st->total += len;
+    if (st->memsize + len < 32) {
+        memcpy(st->mem + st->memsize, p, len);
+        st->memsize += len;
+        return;
+    }
+    if (st->memsize) {
+        size_t fill = 32 - st->memsize;
+        memcpy(st->mem + st->memsize, p, fill);
+        for (int i = 0; i < 4; ++i) st->v[i] = xxh_round(st->v[i], read_le64(st->mem + 8*i));
+        p += fill;
+        len -= fill;
+        st->memsize = 0;
+    }
+    uint64_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+    while (len >= 32) {
+        v0 = xxh_round(v0, read_le64(p));
+        v1 = xxh_round(v1, read_le64(p + 8));
+        v2 = xxh_round(v2, read_le64(p + 16));
+        v3 = xxh_round(v3, read_le64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    st->v[0] = v0; st->v[1] = v1; st->v[2] = v2; st->v[3] = v3;
+    memcpy(st->mem, p, len);
+    st->memsize = len;
+}
+
+uint64_t xxh64_digest(struct xxh64 *st) {
+    uint64_t h;
+    if (st->total >= 32) {
+        h = rotl64(st->v[0], 1) + rotl64(st->v[1], 7) + rotl64(st->v[2], 12) + rotl64(st->v[3], 18);
+        for (int i = 0; i < 4; ++i) { h ^= xxh_round(0, st->v[i]); h = h * XXH_P1 + XXH_P4; }
+    } else h = XXH_P5;
+    h += st->total;
+
+    const unsigned char *p = st->mem;
+    size_t len = st->memsize;
+    for (; len >= 8; p += 8, len -= 8) { h ^= xxh_round(0, read_le64(p)); h = rotl64(h, 27) * XXH_P1 + XXH_P4; }
+    if (len >= 4) {
+        uint32_t k = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        h ^= (uint64_t)k * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len) { h ^= *p * XXH_P5; h = rotl64(h, 11) * XXH_P1; }
+
+    h ^= h >> 33; h *= XXH_P2;
+    h ^= h >> 29; h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Hash every SWARM_CHUNK of fd[0, size) into a newly allocated array. */
+int hash_chunks(int fd, uint64_t size, uint64_t **out) {
+    uint32_t n = (size + SWARM_CHUNK - 1) / SWARM_CHUNK;
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (n ? n : 1));
+    char *buf = malloc(SWARM_CHUNK);
+    if (!hashes || !buf) { free(hashes); free(buf); return -1; }
+    for (uint32_t i = 0; i < n; ++i) {
+        size_t len = size - (uint64_t)i * SWARM_CHUNK > SWARM_CHUNK ? SWARM_CHUNK : size - (uint64_t)i * SWARM_CHUNK;
+        if (pread(fd, buf, len, (off_t)i * SWARM_CHUNK) != (ssize_t)len) { free(hashes); free(buf); return -1; }
+        struct xxh64 st;
+        xxh64_init(&st);
+        xxh64_update(&st, buf, len);
+        hashes[i] = xxh64_digest(&st);
+    }
+    free(buf);
+    *out = hashes;
+    return n;
+}
+
+/* Content digest: XXH64 of the size and the chunk hashes, all big-endian,
+   so it follows from a manifest without reading the file again. Never 0,
+   which means unknown on the wire. */
+uint64_t manifest_digest(uint64_t size, const uint64_t *hashes, uint32_t n) {
+    char be[8];
+    struct xxh64 st;
+    xxh64_init(&st);
+    put_be64(be, size);
+    xxh64_update(&st, be, 8);
+    for (uint32_t i = 0; i < n; ++i) {
+        put_be64(be, hashes[i]);
+        xxh64_update(&st, be, 8);
+    }
+    uint64_t d = xxh64_digest(&st);
+    return d ? d : 1;
+}
+
+/* LZ4 block format, for CONTENT_LZ4 frames. Like XXH64 above it is small
+   enough to carry here rather than link against. The compressor is the
+   greedy single-probe kind; accel > 1 makes it skip faster through
+   input that is not matching, trading ratio for speed. */
+size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+uint32_t read_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+unsigned char *lz4_put_len(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* Compress src[0, n) into dst, which holds lz4_bound(n) bytes; returns
+   the block length. */
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, int accel) {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    const unsigned char *ip = src + 1, *anchor = src, *end = src + n;
+    unsigned char *op = dst;
+    /* The format wants the last match to start 12 bytes before the end
+       and the last 5 bytes to be literals. */
+    if (n >= 13) {
+        const unsigned char *mflimit = end - 12, *matchlimit = end - 5;
+        memset(table, 0, sizeof(table));
+        while (ip < mflimit) {
+            uint32_t seq = read_le32(ip), h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+            const unsigned char *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > 65535 || read_le32(ref) != seq) {
+                ip += accel + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+            const unsigned char *mp = ip + 4, *mr = ref + 4;
+            while (mp < matchlimit && *mp == *mr) { mp++; mr++; }
+            size_t lit = ip - anchor, mlen = mp - ip - 4;
+            unsigned char *token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (lit >= 15) op = lz4_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if (mlen >= 15) op = lz4_put_len(op, mlen - 15);
+            ip = anchor = mp;
+        }
+    }
+    size_t lit = end - anchor;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = lz4_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+/* Decode a block into dst[0, cap); returns the decoded length, or -1 if
+   the block is malformed or would not fit. */
+long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        for (unsigned b = 255; len >= 15 && b == 255; len += b) {
+            if (ip >= iend) return -1;
+            b = *ip++;
+        }
+        if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        len = token & 15;
+        for (unsigned b = 255; len >= 15 && b == 255; len += b) {
+            if (ip >= iend) return -1;
+            b = *ip++;
+        }
+        len += 4;
+        if ((size_t)(oend - op) < len) return -1;
+        const unsigned char *m = op - off;
+        if (off >= len) memcpy(op, m, len);
+        else for (size_t i = 0; i < len; ++i) op[i] = m[i];
+        op += len;
+    }
+    return op - dst;
+}
+
+/* Whether a file starts like a format that is already compressed:
+   images, audio, video and archives. */
+int media_magic(const unsigned char *p, size_t n) {
+    static const struct { int off, len; const char *magic; } known[] = {
+        { 0, 3, "\xff\xd8\xff" },               /* JPEG */
+        { 0, 8, "\x89PNG\r\n\x1a\n" },
+        { 0, 4, "GIF8" },
+        { 8, 4, "WEBP" },
+        { 4, 4, "ftyp" },                       /* MP4, MOV, HEIF */
+        { 0, 4, "\x1a\x45\xdf\xa3" },           /* Matroska, WebM */
+        { 0, 4, "OggS" },
+        { 0, 4, "fLaC" },
+        { 0, 3, "ID3" },                        /* MP3 */
+        { 0, 2, "\xff\xfb" },
+        { 0, 4, "PK\x03\x04" },                 /* ZIP, JAR, DOCX, EPUB */
+        { 0, 2, "\x1f\x8b" },                   /* gzip */
+        { 0, 3, "BZh" },
+        { 0, 6, "\xfd" "7zXZ\x00" },
+        { 0, 4, "\x28\xb5\x2f\xfd" },           /* zstd */
+        { 0, 4, "\x04\x22\x4d\x18" },           /* LZ4 frame */
+        { 0, 6, "7z\xbc\xaf\x27\x1c" },
+        { 0, 4, "Rar!" },
+    };
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); ++i)
+        if (n >= (size_t)(known[i].off + known[i].len) && memcmp(p + known[i].off, known[i].magic, known[i].len) == 0) return 1;
+    return 0;
+}
+
+/* Caller holds local_lock. */
+struct local_file **local_find(const char *name) {
+    struct local_file **link = &local_table[hash_name(name) % LOCAL_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    return link;
+}
+
+int local_add(const char *name) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file **link = local_find(name);
+    if (!*link) {
+        struct local_file *lf = calloc(1, sizeof(*lf) + strlen(name) + 1);
+        if (!lf) { pthread_mutex_unlock(&local_lock); return -1; }
+        strcpy(lf->name, name);
+        *link = lf;
+        local_count++;
+    }
+    pthread_mutex_unlock(&local_lock);
+    return 0;
+}
+
+void local_remove(const char *name) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file **link = local_find(name);
+    struct local_file *lf = *link;
+    if (lf) {
+        *link = lf->next;
+        if (lf->cached) cache_used -= lf->cache_bytes;
+        free(lf->hashes);
+        free(lf);
+        local_count--;
+    }
+    pthread_mutex_unlock(&local_lock);
+}
+
+/* Record a manifest for a served file; takes ownership of hashes. */
+void local_set_manifest(const char *name, struct stat *sb, uint64_t *hashes, uint32_t nchunks) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    if (lf) {
+        free(lf->hashes);
+        lf->hashes = hashes;
+        lf->nchunks = nchunks;
+        lf->size = sb->st_size;
+        lf->mtime = sb->st_mtime;
+        lf->digest = manifest_digest(lf->size, hashes, nchunks);
+    } else free(hashes);
+    pthread_mutex_unlock(&local_lock);
+}
+
+/* Manifests are hashed off the upload server thread, by one worker
+   taking served files from a queue: files whose digest came from the
+   digest cache when seeded, and files the server was asked for whose
+   manifest is missing or stale. */
+struct manifest_job {
+    struct manifest_job *next;
+    char name[];
+};
+
+struct manifest_job *manifest_queue = NULL, **manifest_tail = &manifest_queue;
+char manifest_busy[NAME_MAX_LEN+1];     /* being hashed now, "" when idle */
+int manifest_worker = 0;
+pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t manifest_cond = PTHREAD_COND_INITIALIZER;
+
+/* Whether a manifest for the file as it is now is kept. */
+int local_manifest_current(const char *name, struct stat *sb) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    int ok = lf && lf->hashes && lf->size == (uint64_t)sb->st_size && lf->mtime == sb->st_mtime;
+    pthread_mutex_unlock(&local_lock);
+    return ok;
+}
+
+void *manifest_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&manifest_lock);
+        manifest_busy[0] = '\0';
+        while (!manifest_queue) pthread_cond_wait(&manifest_cond, &manifest_lock);
+        struct manifest_job *job = manifest_queue;
+        if (!(manifest_queue = job->next)) manifest_tail = &manifest_queue;
+        strcpy(manifest_busy, job->name);
+        pthread_mutex_unlock(&manifest_lock);
+
+        struct stat sb;
+        uint64_t *hashes;
+        int fd = open(job->name, O_RDONLY), n;
+        if (fd >= 0 && fstat(fd, &sb) == 0 && !local_manifest_current(job->name, &sb) && (n = hash_chunks(fd, sb.st_size, &hashes)) >= 0)
+            local_set_manifest(job->name, &sb, hashes, n);
+        if (fd >= 0) close(fd);
+        free(job);
+    }
+    return NULL;
+}
+
+/* Whether name is queued or being hashed. */
+int manifest_pending(const char *name) {
+    pthread_mutex_lock(&manifest_lock);
+    int found = strcmp(manifest_busy, name) == 0;
+    for (struct manifest_job *j = manifest_queue; j && !found; j = j->next) found = strcmp(j->name, name) == 0;
+    pthread_mutex_unlock(&manifest_lock);
+    return found;
+}
+
+/* Queue name for hashing unless it already is; starts the worker. */
+void manifest_request(const char *name) {
+    if (manifest_pending(name)) return;
+    struct manifest_job *job = malloc(sizeof(*job) + strlen(name) + 1);
+    if (!job) return;
+    strcpy(job->name, name);
+    job->next = NULL;
+    pthread_mutex_lock(&manifest_lock);
+    *manifest_tail = job;
+    manifest_tail = &job->next;
+    if (!manifest_worker) {
+        pthread_t tid;
+        manifest_worker = pthread_create(&tid, NULL, manifest_main, NULL) == 0;
+        if (manifest_worker) pthread_detach(tid);
+    }
+    pthread_cond_signal(&manifest_cond);
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+/* Build the HASHES reply for a file from its kept manifest: 'H', 64-bit
+   size, 32-bit chunk count, then one 64-bit hash per chunk, all
+   big-endian. Returns NULL if no manifest for the file as it is now is
+   kept, having queued the file for hashing if queue is set. */
+char *local_manifest_reply(const char *name, struct stat *sb, size_t *len, int queue) {
+    char *reply = NULL;
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    int current = lf && lf->hashes && lf->size == (uint64_t)sb->st_size && lf->mtime == sb->st_mtime;
+    if (current) {
+        *len = 13 + 8 * (size_t)lf->nchunks;
+        reply = malloc(*len);
+        if (reply) {
+            reply[0] = HASHES;
+            put_be64(&reply[1], lf->size);
+            uint32_t n_net = htonl(lf->nchunks);
+            memcpy(&reply[9], &n_net, 4);
+            for (uint32_t i = 0; i < lf->nchunks; ++i) put_be64(&reply[13 + 8*i], lf->hashes[i]);
+        }
+    }
+    pthread_mutex_unlock(&local_lock);
+    if (!current && lf && queue) manifest_request(name);
+    return reply;
+}
+
+void local_set_digest(const char *name, uint64_t digest) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    if (lf) lf->digest = digest;
+    pthread_mutex_unlock(&local_lock);
+}
+
+/* Digests of files in the working directory, keyed by device and inode
+   and valid while size and mtime are unchanged, so a peer reads each file
+   once to identify it rather than on every start. Kept in DIGEST_FILE:
+   the magic, then 40-byte records (device, inode, size, mtime in ns,
+   digest, big-endian) appended as digests are computed; on load a later
+   record for an inode replaces an earlier one. */
+struct digest_entry {
+    struct digest_entry *next;
+    uint64_t dev, ino, size, mtime_ns, digest;
+};
+
+struct digest_entry *digest_cache[LOCAL_BUCKETS];
+int digest_loaded = 0;
+pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Caller holds digest_lock. */
+struct digest_entry **digest_find(uint64_t dev, uint64_t ino) {
+    struct digest_entry **link = &digest_cache[(ino ^ dev * 31) % LOCAL_BUCKETS];
+    while (*link && ((*link)->dev != dev || (*link)->ino != ino)) link = &(*link)->next;
+    return link;
+}
+
+/* Caller holds digest_lock. */
+void digest_put(const char *r) {
+    uint64_t dev = get_be64(r), ino = get_be64(r + 8);
+    struct digest_entry **link = digest_find(dev, ino);
+    if (!*link && !(*link = calloc(1, sizeof(**link)))) return;
+    (*link)->dev = dev;
+    (*link)->ino = ino;
+    (*link)->size = get_be64(r + 16);
+    (*link)->mtime_ns = get_be64(r + 24);
+    (*link)->digest = get_be64(r + 32);
+}
+
+/* Caller holds digest_lock. */
+void digest_load(void) {
+    char r[DIGEST_RECORD];
+    digest_loaded = 1;
+    FILE *fp = fopen(DIGEST_FILE, "rb");
+    if (!fp) return;
+    if (fread(r, 4, 1, fp) == 1 && memcmp(r, DIGEST_MAGIC, 4) == 0)
+        while (fread(r, DIGEST_RECORD, 1, fp) == 1) digest_put(r);
+    fclose(fp);
+}
+
+/* The digest of a local file, from the cache or by hashing it; a freshly
+   built manifest is kept if the file is already served. Returns 0 if the
+   file cannot be read. */
+uint64_t file_digest(const char *name) {
+    struct stat sb;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0) { if (fd >= 0) close(fd); return 0; }
+    uint64_t mtime_ns = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec, digest = 0;
+
+    pthread_mutex_lock(&digest_lock);
+    if (!digest_loaded) digest_load();
+    struct digest_entry *de = *digest_find(sb.st_dev, sb.st_ino);
+    if (de && de->size == (uint64_t)sb.st_size && de->mtime_ns == mtime_ns) digest = de->digest;
+    pthread_mutex_unlock(&digest_lock);
+    if (digest) {
+        close(fd);
+        local_set_digest(name, digest);
+        if (!local_manifest_current(name, &sb)) manifest_request(name);
+        return digest;
+    }
+
+    uint64_t *hashes;
+    int n = hash_chunks(fd, sb.st_size, &hashes);
+    close(fd);
+    if (n < 0) return 0;
+    digest = manifest_digest(sb.st_size, hashes, n);
+    local_set_manifest(name, &sb, hashes, n);
+
+    char r[DIGEST_RECORD];
+    put_be64(r, sb.st_dev);
+    put_be64(r + 8, sb.st_ino);
+    put_be64(r + 16, sb.st_size);
+    put_be64(r + 24, mtime_ns);
+    put_be64(r + 32, digest);
+    pthread_mutex_lock(&digest_lock);
+    digest_put(r);
+    FILE *fp = fopen(DIGEST_FILE, "ab");
+    if (fp) {
+        if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) == 0) fwrite(DIGEST_MAGIC, 4, 1, fp);
+        fwrite(r, DIGEST_RECORD, 1, fp);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&digest_lock);
+    return digest;
+}
+
+/* Copy out the name of a served file with the given digest, other than
+   except; returns 0 if there is none. */
+int local_by_digest(uint64_t digest, const char *except, char *out) {
+    int found = 0;
+    pthread_mutex_lock(&local_lock);
+    for (int b = 0; digest && !found && b < LOCAL_BUCKETS; ++b)
+        for (struct local_file *lf = local_table[b]; lf && !found; lf = lf->next)
+            if (lf->digest == digest && strcmp(lf->name, except) != 0) {
+                strcpy(out, lf->name);
+                found = 1;
+            }
+    pthread_mutex_unlock(&local_lock);
+    return found;
+}
+
+int local_compressible(const char *name) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    int v = lf ? lf->compressible : -1;
+    pthread_mutex_unlock(&local_lock);
+    return v;
+}
+
+void local_set_compressible(const char *name, int v) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    if (lf) lf->compressible = v;
+    pthread_mutex_unlock(&local_lock);
+}
+
+int local_has(const char *name) {
+    pthread_mutex_lock(&local_lock);
+    int found = *local_find(name) != NULL;
+    pthread_mutex_unlock(&local_lock);
+    return found;
+}
+
+double local_demand(struct local_file *lf, double now) {
+    int halvings = (now - lf->demand_at) / DEMAND_HALF_LIFE_MS;
+    return halvings >= 64 ? 0 : lf->demand / (double)(1ULL << halvings);
+}
+
+/* Look a served file up for a request, marking it used; demand is 1 for
+   a request that starts a download. */
+int local_use(const char *name, int demand) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    if (lf) {
+        double now = now_ms();
+        lf->last_used = now;
+        if (demand) {
+            lf->demand = local_demand(lf, now) + 1;
+            lf->demand_at = now;
+        }
+    }
+    pthread_mutex_unlock(&local_lock);
+    return lf != NULL;
+}
+
+/* A copy of every served name as batch records with the given op, for
+   re-registering or withdrawing them all. */
+struct batch_record *local_records(char op, int *n) {
+    pthread_mutex_lock(&local_lock);
+    int count = 0;
+    struct batch_record *recs = calloc(local_count + 1, sizeof(*recs));
+    for (int b = 0; recs && b < LOCAL_BUCKETS; ++b)
+        for (struct local_file *lf = local_table[b]; lf; lf = lf->next) {
+            recs[count].op = op;
+            recs[count].digest = lf->digest;
+            if ((recs[count].contentName = strdup(lf->name))) count++;
+        }
+    pthread_mutex_unlock(&local_lock);
+    *n = count;
+    return recs;
+}
+
+void batch_free(struct batch_record *recs, int n) {
+    for (int i = 0; recs && i < n; ++i) free(recs[i].contentName);
+    free(recs);
+}
+
+/* Explicit socket buffers switch off the kernel's autotuning and are
+   silently capped at net.core.rmem_max / wmem_max, so SOCK_BUF is only
+   applied where that cap allows all of it. */
+void tune_sock_buf(int s, int opt) {
+    static int allowed[2] = { -1, -1 };
+    int i = opt == SO_SNDBUF, size = SOCK_BUF;
+    if (allowed[i] < 0) {
+        FILE *f = fopen(i ? "/proc/sys/net/core/wmem_max" : "/proc/sys/net/core/rmem_max", "r");
+        long max = 0;
+        if (f) { if (fscanf(f, "%ld", &max) != 1) max = 0; fclose(f); }
+        allowed[i] = max >= SOCK_BUF;
+    }
+    if (allowed[i]) setsockopt(s, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
+/* Download receive buffers: FRAME_MAX bytes, page aligned, kept on a free
+   list so later sources and downloads reuse them. */
+struct frame_buf {
+    struct frame_buf *next;
+};
+
+struct frame_buf *frame_pool = NULL;
+pthread_mutex_t frame_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *frame_buf_get(void) {
+    pthread_mutex_lock(&frame_pool_lock);
+    struct frame_buf *b = frame_pool;
+    if (b) frame_pool = b->next;
+    pthread_mutex_unlock(&frame_pool_lock);
+    void *p = b;
+    if (!p && posix_memalign(&p, 4096, FRAME_MAX) != 0) return NULL;
+    return p;
+}
+
+void frame_buf_put(void *p) {
+    if (!p) return;
+    struct frame_buf *b = p;
+    pthread_mutex_lock(&frame_pool_lock);
+    b->next = frame_pool;
+    frame_pool = b;
+    pthread_mutex_unlock(&frame_pool_lock);
+}
 
 int create_passive_socket(struct sockaddr_in *out_addr) {
     int s = socket(AF_INET, SOCK_STREAM, 0);
@@ -86,8 +1105,9 @@ int create_passive_socket(struct sockaddr_in *out_addr) {
     sin.sin_addr.s_addr = inet_addr("127.0.0.1");
     sin.sin_port = htons(0);
 
+    tune_sock_buf(s, SO_SNDBUF);
     if (bind(s, (struct sockaddr*)&sin, sizeof(sin)) < 0) { perror("bind"); close(s); return -1; }
-    if (listen(s, 5) < 0) { perror("listen"); close(s); return -1; }
+    if (listen(s, SOMAXCONN) < 0) { perror("listen"); close(s); return -1; }
 
     socklen_t len = sizeof(sin);
     if (getsockname(s, (struct sockaddr*)&sin, &len) < 0) { perror("getsockname"); close(s); return -1; }
@@ -96,279 +1116,2722 @@ int create_passive_socket(struct sockaddr_in *out_addr) {
     return s;
 }
 
-int send_register_udp(int udpsock, struct sockaddr_in *index_addr, const char *peer, const char *content, struct sockaddr_in *content_addr) {
-    struct register_pdu rp = {0};
-    rp.type = REGISTER;
-    strncpy(rp.peerName, peer, NAME_LEN-1);
-    strncpy(rp.contentName, content, NAME_LEN-1);
-    rp.addr = *content_addr;
+/* Reserve n consecutive request ids. */
+uint64_t request_ids(int n) {
+    static uint64_t next_id;
+    uint64_t unset = 0;
+    __atomic_compare_exchange_n(&next_id, &unset, (uint64_t)time(NULL) << 8, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return __atomic_fetch_add(&next_id, n, __ATOMIC_RELAXED);
+}
 
-    if (sendto(udpsock, &rp, sizeof(rp), 0, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("sendto"); return -1; }
+/* One request to the index, from send until its reply lands in buf or
+   it runs out of tries. The request bytes must stay valid until then. */
+struct call {
+    uint64_t id;
+    const char *req;
+    size_t len;
+    char *buf;
+    size_t cap, got;
+    double sent_at, deadline, rto;
+    int tries;
+    int done;                   /* 1 answered, -1 gave up */
+    struct call *next;
+};
 
-    struct simple_pdu resp;
-    ssize_t n = recvfrom(udpsock, &resp, sizeof(resp), 0, NULL, NULL);
-    if (n < 0) { perror("recvfrom"); return -1; }
+/* Client side of the index protocol. Any number of threads may have
+   calls in flight on the one socket; a receiver thread matches replies
+   to calls by request id and retransmits those whose timer expires. The
+   timeout follows the measured round trip (Jacobson/Karels): srtt and
+   rttvar are updated from replies to calls sent once (Karn's rule), the
+   RTO is srtt + 4 rttvar, and each retransmission doubles a call's RTO. */
+struct udp_client {
+    int sock;
+    int wake;                   /* eventfd: a call was added */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct call *inflight;
+    double srtt, rttvar, rto;
+    pthread_t tid;
+};
 
-    if (resp.type == ACKNOWLEDGEMENT) {
-        printf("Server ack: %s\n", resp.data);
-        return 0;
+void client_rtt_sample(struct udp_client *uc, double rtt) {
+    if (uc->srtt == 0) {
+        uc->srtt = rtt;
+        uc->rttvar = rtt / 2;
     } else {
-        printf("Server error: %s\n", resp.data);
-        return -1;
+        double err = uc->srtt > rtt ? uc->srtt - rtt : rtt - uc->srtt;
+        uc->rttvar = 0.75 * uc->rttvar + 0.25 * err;
+        uc->srtt = 0.875 * uc->srtt + 0.125 * rtt;
     }
+    uc->rto = uc->srtt + 4 * uc->rttvar;
+    if (uc->rto < RTO_MIN_MS) uc->rto = RTO_MIN_MS;
+    if (uc->rto > RTO_MAX_MS) uc->rto = RTO_MAX_MS;
 }
 
-int send_online_udp(int udpsock, struct sockaddr_in *index_addr) {
-    struct register_pdu rp = {0};
-    rp.type = ONLINE;
-    if (sendto(udpsock, &rp, sizeof(rp), 0, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("sendto"); return -1; }
-
-    struct simple_pdu resp;
-    ssize_t n = recvfrom(udpsock, &resp, sizeof(resp), 0, NULL, NULL);
-    if (n < 0) { perror("recvfrom"); return -1; }
-
-    if (resp.type == ONLINE) printf("Online list:\n%s\n", resp.data);
-    else printf("Error: %s\n", resp.data);
-    return 0;
+/* Caller holds uc->lock. */
+void client_finish(struct udp_client *uc, struct call *c, int done) {
+    struct call **link = &uc->inflight;
+    while (*link != c) link = &(*link)->next;
+    *link = c->next;
+    c->done = done;
+    pthread_cond_broadcast(&uc->cond);
 }
 
-int send_search_udp(int udpsock, struct sockaddr_in *index_addr, const char *peer, const char *content, struct register_pdu *resp_pdu) {
-    struct register_pdu rp = {0};
-    rp.type = SEARCH;
-    strncpy(rp.peerName, peer, NAME_LEN-1);
-    strncpy(rp.contentName, content, NAME_LEN-1);
+void *client_main(void *arg) {
+    struct udp_client *uc = arg;
+    char buf[MAX_DGRAM];
+    while (1) {
+        pthread_mutex_lock(&uc->lock);
+        double now = now_ms(), next = now + 1000;
+        for (struct call *c = uc->inflight, *nc; c; c = nc) {
+            nc = c->next;
+            if (c->deadline > now) { if (c->deadline < next) next = c->deadline; continue; }
+            if (c->tries >= CALL_TRIES) { client_finish(uc, c, -1); continue; }
+            if (send(uc->sock, c->req, c->len, 0) < 0 && errno != ECONNREFUSED) perror("send");
+            c->tries++;
+            c->rto = c->rto * 2 > RTO_MAX_MS ? RTO_MAX_MS : c->rto * 2;
+            c->deadline = now + c->rto;
+            if (c->deadline < next) next = c->deadline;
+        }
+        pthread_mutex_unlock(&uc->lock);
 
-    if (sendto(udpsock, &rp, sizeof(rp), 0, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("sendto"); return -1; }
+        struct pollfd pfd[2] = { { uc->sock, POLLIN, 0 }, { uc->wake, POLLIN, 0 } };
+        int timeout = (int)(next - now) + 1;
+        if (poll(pfd, 2, timeout) <= 0) continue;
+        if (pfd[1].revents & POLLIN) {
+            uint64_t v;
+            if (read(uc->wake, &v, sizeof(v)) < 0) {}
+        }
+        ssize_t n;
+        while ((n = recv(uc->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0 || (n < 0 && errno == ECONNREFUSED)) {
+            struct frame f;
+            if (n < 0 || parse_frame(buf, n, &f) < 0) continue;
+            pthread_mutex_lock(&uc->lock);
+            struct call *c = uc->inflight;
+            while (c && c->id != f.id) c = c->next;
+            if (c) {
+                if (c->tries == 1) client_rtt_sample(uc, now_ms() - c->sent_at);
+                c->got = (size_t)n < c->cap ? (size_t)n : c->cap;
+                memcpy(c->buf, buf, c->got);
+                client_finish(uc, c, 1);
+            }
+            pthread_mutex_unlock(&uc->lock);
+        }
+    }
+    return NULL;
+}
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(udpsock, &rfds);
-    struct timeval tv = {5,0};
-    if (select(udpsock+1, &rfds, NULL, NULL, &tv) <= 0) { printf("No response from index server\n"); return -1; }
+int client_open(struct udp_client *uc, const struct net_addr *index_addr) {
+    struct sockaddr_storage ss;
+    socklen_t len = addr_to_sockaddr(index_addr, &ss);
+    memset(uc, 0, sizeof(*uc));
+    uc->rto = RTO_INITIAL_MS;
+    uc->sock = socket(ss.ss_family, SOCK_DGRAM, 0);
+    if (uc->sock < 0) { perror("socket"); return -1; }
+    if (connect(uc->sock, (struct sockaddr*)&ss, len) < 0) { perror("connect"); return -1; }
+    uc->wake = eventfd(0, EFD_NONBLOCK);
+    if (uc->wake < 0) { perror("eventfd"); return -1; }
+    pthread_mutex_init(&uc->lock, NULL);
+    pthread_cond_init(&uc->cond, NULL);
+    if (pthread_create(&uc->tid, NULL, client_main, uc) != 0) { perror("pthread_create"); return -1; }
+    return 0;
+}
 
-    ssize_t n = recvfrom(udpsock, resp_pdu, sizeof(*resp_pdu), 0, NULL, NULL);
-    if (n < 0) { perror("recvfrom"); return -1; }
+/* Send req and put it in flight; the reply will be copied into buf. */
+void client_start(struct udp_client *uc, struct call *c, const char *req, size_t len, char *buf, size_t cap) {
+    struct frame f;
+    memset(c, 0, sizeof(*c));
+    parse_frame(req, len, &f);
+    c->id = f.id;
+    c->req = req;
+    c->len = len;
+    c->buf = buf;
+    c->cap = cap;
+    c->tries = 1;
+    pthread_mutex_lock(&uc->lock);
+    c->rto = uc->rto;
+    c->sent_at = now_ms();
+    c->deadline = c->sent_at + c->rto;
+    c->next = uc->inflight;
+    uc->inflight = c;
+    if (send(uc->sock, req, len, 0) < 0 && errno != ECONNREFUSED) perror("send");
+    pthread_mutex_unlock(&uc->lock);
+    uint64_t one = 1;
+    if (write(uc->wake, &one, sizeof(one)) < 0) perror("eventfd");
+}
 
-    if (resp_pdu->type == SEARCH) return 0;
+/* Wait for a started call; parses its reply into *f. */
+int client_wait(struct udp_client *uc, struct call *c, struct frame *f) {
+    pthread_mutex_lock(&uc->lock);
+    while (!c->done) pthread_cond_wait(&uc->cond, &uc->lock);
+    pthread_mutex_unlock(&uc->lock);
+    if (c->done < 0 || parse_frame(c->buf, c->got, f) < 0) return -1;
+    return 0;
+}
 
-    struct simple_pdu *sp = (struct simple_pdu*)resp_pdu;
-    if (sp->type == ERROR) { printf("Index server: %s\n", sp->data); return 1; }
+int client_call(struct udp_client *uc, const char *req, size_t len, char *buf, size_t cap, struct frame *f) {
+    struct call c;
+    client_start(uc, &c, req, len, buf, cap);
+    if (client_wait(uc, &c, f) == 0) return c.tries;
+    printf("No response from index server\n");
     return -1;
 }
 
-int send_deregister_udp(int udpsock, struct sockaddr_in *index_addr, const char *peer, const char *content) {
-    struct register_pdu rp = {0};
-    rp.type = DEREGISTER;
-    strncpy(rp.peerName, peer, NAME_LEN-1);
-    strncpy(rp.contentName, content, NAME_LEN-1);
+/* The index may be a cluster of servers that split the content by
+   consistent hashing of contentName (see index.c). The peer fetches the
+   shard map with SHARD_MAP, builds the same ring and sends REGISTER,
+   SEARCH and DEREGISTER straight to the member owning each name; listings,
+   heartbeats and QUIT go to every member. Without a cluster every request
+   goes to the one index given on the command line. */
+struct member {
+    char name[NAME_MAX_LEN+1];
+    struct net_addr addr;
+    int vnodes;
+    struct udp_client *uc;
+};
 
-    if (sendto(udpsock, &rp, sizeof(rp), 0, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("sendto"); return -1; }
+struct ring_point {
+    uint64_t point;
+    int member;
+};
 
-    struct simple_pdu resp;
-    ssize_t n = recvfrom(udpsock, &resp, sizeof(resp), 0, NULL, NULL);
-    if (n < 0) { perror("recvfrom"); return -1; }
+struct cluster_map {
+    uint64_t epoch;
+    int count;
+    struct member members[CLUSTER_MAX];
+    struct ring_point *ring;
+    int npoints;
+};
 
-    if (resp.type == ACKNOWLEDGEMENT) { printf("Deregistered: %s\n", resp.data); return 0; }
-    else { printf("Deregister error: %s\n", resp.data); return -1; }
-}
+struct cluster_map *cluster = NULL;     /* NULL when the index is one server */
+pthread_mutex_t cluster_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+struct udp_client *index_uc;            /* the index named on the command line */
+struct net_addr serving_addr;           /* this peer's content server */
 
-int send_quit_udp(int udpsock, struct sockaddr_in *index_addr, const char *peer) {
-    struct register_pdu rp = {0};
-    rp.type = QUIT;
-    strncpy(rp.peerName, peer, NAME_LEN-1);
+/* One client per index address, opened on first use and kept for the life
+   of the process, so routing never has to wait for a socket to close. */
+struct {
+    pthread_mutex_t lock;
+    int count;
+    struct net_addr addr[2 * CLUSTER_MAX];
+    struct udp_client *uc[2 * CLUSTER_MAX];
+} clients = { PTHREAD_MUTEX_INITIALIZER, 0, {{0}}, {0} };
 
-    if (sendto(udpsock, &rp, sizeof(rp), 0, (struct sockaddr*)index_addr, sizeof(*index_addr)) < 0) { perror("sendto"); return -1; }
+struct udp_client *client_for(const struct net_addr *a) {
+    struct udp_client *uc = NULL;
+    pthread_mutex_lock(&clients.lock);
+    for (int i = 0; i < clients.count && !uc; ++i)
+        if (addr_eq(&clients.addr[i], a)) uc = clients.uc[i];
+    if (!uc && clients.count < 2 * CLUSTER_MAX && (uc = malloc(sizeof(*uc)))) {
+        if (client_open(uc, a) == 0) {
+            clients.addr[clients.count] = *a;
+            clients.uc[clients.count++] = uc;
+        } else { free(uc); uc = NULL; }
+    }
+    pthread_mutex_unlock(&clients.lock);
+    return uc;
+}
+
+/* Same hash and ring as index.c. */
+uint64_t ring_hash(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) { h ^= (unsigned char)p[i]; h *= 1099511628211ULL; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
 
-    struct simple_pdu resp;
-    ssize_t n = recvfrom(udpsock, &resp, sizeof(resp), 0, NULL, NULL);
-    if (n < 0) { perror("recvfrom"); return -1; }
+int point_cmp(const void *a, const void *b) {
+    const struct ring_point *pa = a, *pb = b;
+    if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+    return pa->member - pb->member;
+}
 
-    if (resp.type == ACKNOWLEDGEMENT) printf("Quit acknowledged\n");
-    else printf("Quit error: %s\n", resp.data);
+int ring_build(struct cluster_map *map) {
+    int n = 0;
+    for (int m = 0; m < map->count; ++m) n += map->members[m].vnodes;
+    map->ring = malloc(sizeof(struct ring_point) * (n ? n : 1));
+    if (!map->ring) return -1;
+    for (int m = 0; m < map->count; ++m)
+        for (int v = 0; v < map->members[m].vnodes; ++v) {
+            char label[NAME_MAX_LEN + 16];
+            int len = snprintf(label, sizeof(label), "%s#%d", map->members[m].name, v);
+            map->ring[map->npoints++] = (struct ring_point){ ring_hash(label, len), m };
+        }
+    qsort(map->ring, map->npoints, sizeof(struct ring_point), point_cmp);
     return 0;
 }
 
-void handle_client_connection(int connfd) {
-    struct register_pdu dp = {0};
-    if (recv_all(connfd, &dp, sizeof(dp)) <= 0) { close(connfd); return; }
-    if (dp.type != DOWNLOAD) { close(connfd); return; }
+int ring_owner(const struct cluster_map *map, const char *name) {
+    uint64_t h = ring_hash(name, strlen(name));
+    int lo = 0, hi = map->npoints;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->ring[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return map->ring[lo == map->npoints ? 0 : lo].member;
+}
 
-    char fname[NAME_LEN];
-    strncpy(fname, dp.contentName, NAME_LEN-1);
-    fname[NAME_LEN-1] = '\0';
-    FILE *f = fopen(fname, "rb");
-    if (!f) { close(connfd); return; }
+void cluster_free(struct cluster_map *map) {
+    if (map) free(map->ring);
+    free(map);
+}
 
-    char buf[CHUNK_SIZE];
-    while (1) {
-        size_t r = fread(buf, 1, sizeof(buf), f);
-        if (r == 0) {
-            uint32_t zero = htonl(0);
-            char endhdr[5] = {CONTENT};
-            memcpy(&endhdr[1], &zero, 4);
-            write_all(connfd, endhdr, sizeof(endhdr));
-            break;
-        }
-        uint32_t len_net = htonl(r);
-        char hdr[5] = {CONTENT};
-        memcpy(&hdr[1], &len_net, 4);
-        if (write_all(connfd, hdr, sizeof(hdr)) < 0) break;
-        if (write_all(connfd, buf, r) < 0) break;
-    }
-    fclose(f);
-    close(connfd);
-}
-
-int download_from_server(struct sockaddr_in *server_addr, const char *contentName) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) { perror("socket"); return -1; }
-    if (connect(sock, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) { perror("connect"); close(sock); return -1; }
+/* The client for the owner of a name under map. */
+struct udp_client *map_route(const struct cluster_map *map, const char *name) {
+    return map ? map->members[ring_owner(map, name)].uc : index_uc;
+}
 
-    struct register_pdu dreq = {0};
-    dreq.type = DOWNLOAD;
-    strncpy(dreq.contentName, contentName, NAME_LEN-1);
-    if (write_all(sock, &dreq, sizeof(dreq)) != sizeof(dreq)) { perror("write_all"); close(sock); return -1; }
+struct udp_client *route(const char *name) {
+    pthread_mutex_lock(&cluster_lock);
+    struct udp_client *uc = map_route(cluster, name);
+    pthread_mutex_unlock(&cluster_lock);
+    return uc;
+}
 
-    FILE *f = fopen(contentName, "wb");
-    if (!f) { perror("fopen"); close(sock); return -1; }
+/* Every index server, for requests that span the catalogue. */
+int cluster_clients(struct udp_client **out) {
+    int n = 0;
+    pthread_mutex_lock(&cluster_lock);
+    for (int m = 0; cluster && m < cluster->count; ++m) {
+        int seen = 0;
+        for (int i = 0; i < n && !seen; ++i) seen = out[i] == cluster->members[m].uc;
+        if (!seen) out[n++] = cluster->members[m].uc;
+    }
+    pthread_mutex_unlock(&cluster_lock);
+    if (n == 0) out[n++] = index_uc;
+    return n;
+}
 
-    char hdr[5], buf[CHUNK_SIZE];
-    while (1) {
-        if (recv_all(sock, hdr, sizeof(hdr)) <= 0) { fclose(f); close(sock); return -1; }
-        if (hdr[0] != CONTENT) { fclose(f); close(sock); return -1; }
-        uint32_t len; memcpy(&len, &hdr[1], 4); len = ntohl(len);
-        if (len == 0) break;
+uint64_t cluster_epoch(void) {
+    pthread_mutex_lock(&cluster_lock);
+    uint64_t epoch = cluster ? cluster->epoch : 0;
+    pthread_mutex_unlock(&cluster_lock);
+    return epoch;
+}
+
+/* Ask one index server for the shard map. Sets *out to NULL for a server
+   outside a cluster, including older ones that do not know SHARD_MAP. */
+int fetch_shard_map(struct udp_client *uc, struct cluster_map **out) {
+    char req[64], buf[MAX_DGRAM];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), SHARD_MAP, request_ids(1));
+    struct frame f;
+    if (client_call(uc, req, frame_end(&w, req), buf, sizeof(buf), &f) < 0) return -1;
+    *out = NULL;
+    if (f.type == ERROR) return 0;
+    if (f.type != SHARD_MAP) return -1;
 
-        size_t remaining = len;
-        while (remaining > 0) {
-            size_t toread = remaining > CHUNK_SIZE ? CHUNK_SIZE : remaining;
-            ssize_t got = recv_all(sock, buf, toread);
-            if (got <= 0) { fclose(f); close(sock); return -1; }
-            fwrite(buf, 1, got, f);
-            remaining -= got;
+    struct cluster_map *map = calloc(1, sizeof(*map));
+    if (!map) return -1;
+    int tag, mtag;
+    struct span val, mval;
+    for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+        if (tag == F_EPOCH) map->epoch = span_uint(val);
+        if (tag != F_MEMBER || map->count == CLUSTER_MAX) continue;
+        struct member *m = &map->members[map->count];
+        int has_addr = 0;
+        for (const char *q = val.p; next_field(&q, val.p + val.len, &mtag, &mval); ) {
+            if (mtag == F_PEER) span_name(m->name, mval);
+            else if (mtag == F_ADDR) has_addr = span_addr(mval, &m->addr);
+            else if (mtag == F_COUNT) m->vnodes = span_uint(mval);
         }
+        if (!has_addr || m->vnodes < 1 || !(m->uc = client_for(&m->addr))) { cluster_free(map); return -1; }
+        map->count++;
     }
-    fclose(f);
-    close(sock);
+    if (map->count == 0) { cluster_free(map); return 0; }
+    if (ring_build(map) < 0) { cluster_free(map); return -1; }
+    *out = map;
     return 0;
 }
 
-void printOptions() {
-    printf("[1] Content Listing\n[2] Content Registration\n[3] Content Download\n[4] Content De-Registration\n[5] Quit\n");
-}
+int cluster_refresh(void);
 
-int main(int argc, char **argv) {
-    char *host = "localhost";
-    int port = 3000;
-    if (argc >= 2) host = argv[1];
-    if (argc >= 3) port = atoi(argv[2]);
+/* Call the member owning content. A "Wrong shard" refusal means the map
+   here is stale: refresh it and try the new owner once. Returns the tries
+   as client_call does. */
+int routed_call(const char *content, const char *req, size_t len, char *buf, size_t cap, struct frame *f) {
+    char text[64];
+    int tries = client_call(route(content), req, len, buf, cap, f);
+    if (tries < 0 || f->type != ERROR || strcmp(frame_text(f, text, sizeof(text)), "Wrong shard") != 0) return tries;
+    if (cluster_refresh() < 0) return tries;
+    return client_call(route(content), req, len, buf, cap, f);
+}
 
-    struct hostent *phe;
-    struct sockaddr_in indexServer = {0};
-    indexServer.sin_family = AF_INET;
-    indexServer.sin_port = htons(port);
-    if ((phe = gethostbyname(host))) memcpy(&indexServer.sin_addr, phe->h_addr, phe->h_length);
-    else if ((indexServer.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) { fprintf(stderr,"Can't get host entry\n"); exit(EXIT_FAILURE); }
+/* A request carrying only a peer and/or content name. */
+size_t build_named(char *buf, size_t cap, char type, const char *peer, const char *content) {
+    struct wbuf w;
+    frame_begin(&w, buf, cap, type, request_ids(1));
+    if (peer) put_name(&w, F_PEER, peer);
+    if (content) put_name(&w, F_CONTENT, content);
+    return frame_end(&w, buf);
+}
 
-    int udpsock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpsock < 0) { perror("socket"); exit(EXIT_FAILURE); }
-    if (connect(udpsock, (struct sockaddr*)&indexServer, sizeof(indexServer)) < 0) { perror("connect"); close(udpsock); exit(EXIT_FAILURE); }
+int send_register_udp(const char *peer, const char *content, struct net_addr *content_addr, uint64_t digest) {
+    char req[1024], buf[MAX_DGRAM], text[128];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), REGISTER, request_ids(1));
+    put_name(&w, F_PEER, peer);
+    put_name(&w, F_CONTENT, content);
+    put_addr(&w, F_ADDR, content_addr);
+    if (digest) put_uint(&w, F_DIGEST, digest);
+    struct frame f;
+    int tries = routed_call(content, req, frame_end(&w, req), buf, sizeof(buf), &f);
+    if (tries < 0) return -1;
 
-    for (int i = 0; i < MAX_FILES; ++i) { listen_fds[i] = -1; local_names[i][0] = '\0'; }
-    local_count = 0;
+    /* A retransmission may find the first copy already applied. */
+    if (f.type == ACKNOWLEDGEMENT || (tries > 1 && strcmp(frame_text(&f, text, sizeof(text)), "Duplicate registration") == 0)) {
+        printf("Server ack: %s\n", frame_text(&f, text, sizeof(text)));
+        return 0;
+    } else {
+        printf("Server error: %s\n", frame_text(&f, text, sizeof(text)));
+        return -1;
+    }
+}
 
-    printf("Enter your peer name: ");
-    if (!fgets(peerName, sizeof(peerName), stdin)) { fprintf(stderr, "No name\n"); exit(1); }
-    peerName[strcspn(peerName, "\n")] = '\0';
+/* Fetch one index server's catalogue page by page, resuming each request
+   from the cursor the previous reply returned. Returns the rows printed,
+   -1 on error. */
+int online_from(struct udp_client *uc) {
+    uint64_t cursor = 0;
+    int total = 0;
+    while (cursor != CURSOR_END) {
+        char req[64], buf[MAX_DGRAM], text[128];
+        struct wbuf w;
+        frame_begin(&w, req, sizeof(req), ONLINE_PAGE, request_ids(1));
+        put_uint(&w, F_CURSOR, cursor);
+        struct frame f;
+        if (client_call(uc, req, frame_end(&w, req), buf, sizeof(buf), &f) < 0) return -1;
+        if (f.type != ONLINE_PAGE) { printf("Error: %s\n", frame_text(&f, text, sizeof(text))); return -1; }
 
-    while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(0, &rfds);
-        int maxfd = 0;
-        for (int i = 0; i < local_count; ++i) if (listen_fds[i] >= 0) { FD_SET(listen_fds[i], &rfds); if (listen_fds[i] > maxfd) maxfd = listen_fds[i]; }
-
-        if (select(maxfd+1, &rfds, NULL, NULL, NULL) < 0) { perror("select"); break; }
-
-        for (int i = 0; i < local_count; ++i) if (listen_fds[i] >= 0 && FD_ISSET(listen_fds[i], &rfds)) {
-            struct sockaddr_in cli; socklen_t l = sizeof(cli);
-            int c = accept(listen_fds[i], (struct sockaddr*)&cli, &l);
-            if (c >= 0) handle_client_connection(c);
-        }
-
-        if (FD_ISSET(0, &rfds)) {
-            printOptions();
-            printf("Enter your option here: ");
-            int choice = 0;
-            if (scanf("%d", &choice) != 1) { while (getchar() != '\n'); continue; }
-            while (getchar() != '\n');
-
-            if (choice == 1) send_online_udp(udpsock, &indexServer);
-            else if (choice == 2) {
-                char fname[NAME_LEN]; printf("Enter file name to register: ");
-                if (!fgets(fname, sizeof(fname), stdin)) continue;
-                fname[strcspn(fname, "\n")] = '\0';
-                if (strlen(fname) == 0 || local_count >= MAX_FILES || access(fname, F_OK) != 0) continue;
-
-                struct sockaddr_in content_addr;
-                int lfd = create_passive_socket(&content_addr);
-                if (lfd < 0) continue;
-
-                if (send_register_udp(udpsock, &indexServer, peerName, fname, &content_addr) == 0) {
-                    strncpy(local_names[local_count], fname, NAME_LEN-1);
-                    listen_fds[local_count++] = lfd;
-                    printf("Registered and listening on %s:%d for %s\n", inet_ntoa(content_addr.sin_addr), ntohs(content_addr.sin_port), fname);
-                } else close(lfd);
+        int tag, rtag;
+        struct span val, rval;
+        cursor = CURSOR_END;
+        for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+            if (tag == F_CURSOR) cursor = span_uint(val);
+            if (tag != F_ROW) continue;
+            struct span content = {0}, peer = {0};
+            for (const char *q = val.p; next_field(&q, val.p + val.len, &rtag, &rval); ) {
+                if (rtag == F_CONTENT) content = rval;
+                else if (rtag == F_PEER) peer = rval;
+            }
+            printf("%.*s (by %.*s)\n", (int)content.len, content.p, (int)peer.len, peer.p);
+            total++;
+        }
+    }
+    return total;
+}
+
+/* The catalogue is the union of every index server's rows. */
+int send_online_udp(void) {
+    struct udp_client *ucs[CLUSTER_MAX];
+    int nuc = cluster_clients(ucs), total = 0;
+    printf("Online list:\n");
+    for (int i = 0; i < nuc; ++i) {
+        int n = online_from(ucs[i]);
+        if (n < 0) return -1;
+        total += n;
+    }
+    if (total == 0) printf("No content registered\n");
+    return 0;
+}
+
+/* Parse an F_PROVIDER; returns 0 if it has no address. */
+int parse_provider(struct span val, struct provider *pr) {
+    int ptag, has_addr = 0;
+    struct span pval;
+    memset(pr, 0, sizeof(*pr));
+    for (const char *q = val.p; next_field(&q, val.p + val.len, &ptag, &pval); ) {
+        if (ptag == F_PEER) span_name(pr->peerName, pval);
+        else if (ptag == F_CONTENT) span_name(pr->contentName, pval);
+        else if (ptag == F_ADDR) has_addr = span_addr(pval, &pr->addr);
+        else if (ptag == F_FLAGS) pr->flags = span_uint(pval);
+        else if (ptag == F_DIGEST) pr->digest = span_uint(pval);
+    }
+    return has_addr;
+}
+
+/* Returns 0 with up to k providers in out[0..*count), 1 if the content
+   is unknown, -1 on error. */
+int send_search_multi_udp(const char *content, int k, struct provider *out, int *count) {
+    char req[512], buf[MAX_DGRAM], text[128];
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), SEARCH_MULTI, request_ids(1));
+    put_name(&w, F_CONTENT, content);
+    put_uint(&w, F_COUNT, k);
+    struct frame f;
+    if (routed_call(content, req, frame_end(&w, req), buf, sizeof(buf), &f) < 0) return -1;
+    if (f.type == ERROR) { printf("Index server: %s\n", frame_text(&f, text, sizeof(text))); return 1; }
+    if (f.type != SEARCH_MULTI) return -1;
+
+    int tag, n = 0;
+    struct span val;
+    for (const char *p = f.fields; n < k && next_field(&p, f.end, &tag, &val); )
+        if (tag == F_PROVIDER) n += parse_provider(val, &out[n]);
+    *count = n;
+    return 0;
+}
+
+struct name_match {
+    char name[NAME_MAX_LEN+1];
+    uint64_t providers;
+};
+
+/* Most providers first, then by name, as the index ranks them. */
+int match_cmp(const void *a, const void *b) {
+    const struct name_match *ma = a, *mb = b;
+    if (ma->providers != mb->providers) return ma->providers > mb->providers ? -1 : 1;
+    return strcmp(ma->name, mb->name);
+}
+
+/* Find content names by prefix ("mov*") or substring ("ovi"); prints the
+   best matches with how many peers provide each. Each index server ranks
+   its own names, so their lists are merged and ranked again. */
+int send_name_search_udp(const char *pattern) {
+    char req[512], buf[MAX_DGRAM], text[128];
+    size_t len = strlen(pattern);
+    int mode = NAME_SUBSTRING, want = 20;
+    if (len > 1 && pattern[len-1] == '*') { mode = NAME_PREFIX; len--; }
+    struct wbuf w;
+    frame_begin(&w, req, sizeof(req), NAME_SEARCH, request_ids(1));
+    put_field(&w, F_CONTENT, pattern, len);
+    put_uint(&w, F_MODE, mode);
+    put_uint(&w, F_COUNT, want);
+    size_t rlen = frame_end(&w, req);
+
+    struct udp_client *ucs[CLUSTER_MAX];
+    int nuc = cluster_clients(ucs), count = 0;
+    struct name_match *m = malloc(sizeof(*m) * want * nuc);
+    if (!m) return -1;
+    for (int i = 0; i < nuc; ++i) {
+        struct frame f;
+        if (client_call(ucs[i], req, rlen, buf, sizeof(buf), &f) < 0) { free(m); return -1; }
+        if (f.type != NAME_SEARCH) { printf("Index server: %s\n", frame_text(&f, text, sizeof(text))); free(m); return -1; }
+
+        int tag, rtag;
+        struct span val, rval;
+        for (const char *p = f.fields; next_field(&p, f.end, &tag, &val) && count < want * nuc; ) {
+            if (tag != F_ROW) continue;
+            m[count].name[0] = '\0';
+            m[count].providers = 0;
+            for (const char *q = val.p; next_field(&q, val.p + val.len, &rtag, &rval); ) {
+                if (rtag == F_CONTENT) span_name(m[count].name, rval);
+                else if (rtag == F_COUNT) m[count].providers = span_uint(rval);
             }
-            else if (choice == 3) {
-                char cname[NAME_LEN]; printf("Enter file to download: ");
-                if (!fgets(cname, sizeof(cname), stdin)) continue;
-                cname[strcspn(cname, "\n")] = '\0';
-                if (strlen(cname) == 0) continue;
-
-                struct register_pdu resp;
-                int found = send_search_udp(udpsock, &indexServer, peerName, cname, &resp);
-                if (found != 0) { if (found == 1) printf("Content not found\n"); continue; }
-
-                printf("Connecting to content server %s:%d (peer: %s)\n", inet_ntoa(resp.addr.sin_addr), ntohs(resp.addr.sin_port), resp.peerName);
-                if (download_from_server(&resp.addr, cname) == 0) {
-                    printf("Downloaded %s successfully\n", cname);
-
-                    struct sockaddr_in content_addr;
-                    int lfd = create_passive_socket(&content_addr);
-                    if (lfd >= 0 && send_register_udp(udpsock, &indexServer, peerName, cname, &content_addr) == 0) {
-                        if (local_count < MAX_FILES) {
-                            strncpy(local_names[local_count], cname, NAME_LEN-1);
-                            listen_fds[local_count++] = lfd;
-                            printf("Auto-registered downloaded content %s\n", cname);
-                        } else close(lfd);
+            count++;
+        }
+    }
+    qsort(m, count, sizeof(*m), match_cmp);
+    for (int i = 0; i < count && i < want; ++i)
+        printf("%s (%llu provider%s)\n", m[i].name, (unsigned long long)m[i].providers, m[i].providers == 1 ? "" : "s");
+    if (count == 0) printf("No matching content\n");
+    free(m);
+    return 0;
+}
+
+/* Encode records [first, first+count) as one BATCH_UPDATE frame: the peer
+   and address once, then an F_RECORD (op, name, digest if known) each.
+   Returns the frame
+   length. */
+size_t build_batch(char *buf, uint64_t id, struct batch_record *recs, int count, const char *peer, struct net_addr *content_addr) {
+    struct wbuf w;
+    frame_begin(&w, buf, MAX_DGRAM, BATCH_UPDATE, id);
+    put_name(&w, F_PEER, peer);
+    put_addr(&w, F_ADDR, content_addr);
+    for (int i = 0; i < count; ++i) {
+        char *r = put_open(&w, F_RECORD);
+        put_uint(&w, F_MODE, recs[i].op);
+        put_name(&w, F_CONTENT, recs[i].contentName);
+        if (recs[i].op == REGISTER && recs[i].digest) put_uint(&w, F_DIGEST, recs[i].digest);
+        put_close(&w, r);
+    }
+    return frame_end(&w, buf);
+}
+
+/* Split n records into datagrams: first[d] is the first record of
+   datagram d, first[ndgrams] = n. Room is left for the frame header,
+   the peer name and the address. */
+int batch_split(struct batch_record *recs, int n, int *first) {
+    size_t room = MAX_DGRAM - (32 + NAME_MAX_LEN + 24), used = 0;
+    int d = 0;
+    for (int i = 0; i < n; ++i) {
+        size_t len = 12 + strlen(recs[i].contentName) + (recs[i].digest ? 12 : 0);
+        if (i == 0 || used + len > room) { first[d++] = i; used = 0; }
+        used += len;
+    }
+    first[d] = n;
+    return d;
+}
+
+/* Apply n register/deregister records in as few datagrams as possible,
+   keeping up to BATCH_WINDOW of them in flight on the client. status[i]
+   receives the index server's per-record status byte, or 0 if its
+   datagram was never acknowledged. Returns the number of records that
+   were applied or already in the requested state. */
+int send_batch_udp(struct udp_client *uc, const char *peer, struct batch_record *recs, int n, struct net_addr *content_addr, char *status) {
+    int *first = malloc(sizeof(int) * (n + 1));
+    struct slot { struct call c; char req[MAX_DGRAM], buf[MAX_DGRAM]; } *win = malloc(sizeof(*win) * BATCH_WINDOW);
+    if (!first || !win) { free(first); free(win); return -1; }
+    int ndgrams = batch_split(recs, n, first);
+    uint64_t base = request_ids(ndgrams);
+    memset(status, 0, n);
+
+    /* Datagram d lives in slot d % BATCH_WINDOW; the oldest is reaped
+       before its slot is reused. */
+    for (int d = 0, next = 0; d < ndgrams; ++d) {
+        for (; next < ndgrams && next < d + BATCH_WINDOW; ++next) {
+            struct slot *s = &win[next % BATCH_WINDOW];
+            size_t len = build_batch(s->req, base + next, recs + first[next], first[next+1] - first[next], peer, content_addr);
+            client_start(uc, &s->c, s->req, len, s->buf, sizeof(s->buf));
+        }
+        struct slot *s = &win[d % BATCH_WINDOW];
+        struct frame f;
+        if (client_wait(uc, &s->c, &f) < 0 || f.type != BATCH_UPDATE) continue;
+        int count = first[d+1] - first[d], tag;
+        struct span val;
+        for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); )
+            if (tag == F_STATUS && val.len >= (size_t)count) memcpy(status + first[d], val.p, count);
+    }
+    free(first);
+    free(win);
+
+    /* A retransmitted datagram may find its records already applied. */
+    int ok = 0;
+    for (int i = 0; i < n; ++i)
+        ok += status[i] == 'A' || (recs[i].op == REGISTER && status[i] == 'D') || (recs[i].op == DEREGISTER && status[i] == 'N');
+    return ok;
+}
+
+/* send_batch_udp across the cluster: records are grouped by the member
+   owning their name under map, and each group goes to that member. */
+int batch_by_owner(const struct cluster_map *map, const char *peer, struct batch_record *recs, int n, struct net_addr *content_addr, char *status) {
+    struct udp_client **owner = malloc(sizeof(*owner) * (n + 1));
+    struct batch_record *group = malloc(sizeof(*group) * (n + 1));
+    int *pos = malloc(sizeof(int) * (n + 1));
+    char *gstatus = malloc(n + 1);
+    int ok = 0;
+    memset(status, 0, n);
+    if (!owner || !group || !pos || !gstatus) ok = -1;
+    for (int i = 0; ok >= 0 && i < n; ++i) owner[i] = map_route(map, recs[i].contentName);
+    for (int i = 0; ok >= 0 && i < n; ++i) {
+        struct udp_client *uc = owner[i];
+        if (!uc) continue;
+        int g = 0;
+        for (int j = i; j < n; ++j)
+            if (owner[j] == uc) { group[g] = recs[j]; pos[g++] = j; owner[j] = NULL; }
+        int r = send_batch_udp(uc, peer, group, g, content_addr, gstatus);
+        if (r > 0) ok += r;
+        for (int k = 0; k < g; ++k) status[pos[k]] = gstatus[k];
+    }
+    free(owner);
+    free(group);
+    free(pos);
+    free(gstatus);
+    return ok;
+}
+
+/* Fetch the shard map from any member (or the index named on the command
+   line) and switch to it. Local files whose owner changed are registered
+   with the new owner; the old owner drops its rows itself once it loads
+   the same map. Returns -1 if no index server answered. */
+int cluster_refresh(void) {
+    pthread_mutex_lock(&refresh_lock);
+    struct udp_client *ucs[CLUSTER_MAX + 1];
+    struct cluster_map *map = NULL;
+    int nuc = cluster_clients(ucs), rc = -1;
+    if (ucs[nuc-1] != index_uc) ucs[nuc++] = index_uc;
+    for (int i = 0; i < nuc && rc < 0; ++i) rc = fetch_shard_map(ucs[i], &map);
+    if (rc < 0 || (map ? map->epoch : 0) == cluster_epoch()) {
+        cluster_free(map);
+        pthread_mutex_unlock(&refresh_lock);
+        return rc;
+    }
+
+    /* The map is only replaced here, under refresh_lock, so the old one
+       can be read without cluster_lock. */
+    struct cluster_map *old = cluster;
+    int n, moved = 0;
+    struct batch_record *recs = local_records(REGISTER, &n);
+    for (int i = 0; recs && i < n; ++i) {
+        if (map_route(old, recs[i].contentName) == map_route(map, recs[i].contentName)) { free(recs[i].contentName); continue; }
+        recs[moved++] = recs[i];
+    }
+    pthread_mutex_lock(&cluster_lock);
+    cluster = map;
+    pthread_mutex_unlock(&cluster_lock);
+    cluster_free(old);
+
+    char *status = malloc(moved + 1);
+    int ok = status && moved ? batch_by_owner(map, peerName, recs, moved, &serving_addr, status) : 0;
+    printf("\nShard map epoch %016llx: %d index server%s, re-registered %d of %d moved files\n",
+           (unsigned long long)(map ? map->epoch : 0), map ? map->count : 1, map && map->count != 1 ? "s" : "",
+           ok < 0 ? 0 : ok, moved);
+    free(status);
+    batch_free(recs, moved);
+    pthread_mutex_unlock(&refresh_lock);
+    return 0;
+}
+
+/* batch_by_owner under the current map. Records refused as owned by
+   another member mean the map is stale; they are retried once under the
+   refreshed map. */
+int send_batch_routed(const char *peer, struct batch_record *recs, int n, struct net_addr *content_addr, char *status) {
+    pthread_mutex_lock(&refresh_lock);
+    int ok = batch_by_owner(cluster, peer, recs, n, content_addr, status);
+    pthread_mutex_unlock(&refresh_lock);
+    int moved = 0;
+    for (int i = 0; i < n; ++i) moved += status[i] == 'M';
+    if (ok < 0 || !moved || cluster_refresh() < 0) return ok;
+
+    struct batch_record *retry = malloc(sizeof(*retry) * moved);
+    int *pos = malloc(sizeof(int) * moved);
+    char *rstatus = malloc(moved);
+    if (retry && pos && rstatus) {
+        int m = 0;
+        for (int i = 0; i < n; ++i)
+            if (status[i] == 'M') { retry[m] = recs[i]; pos[m++] = i; }
+        pthread_mutex_lock(&refresh_lock);
+        int r = batch_by_owner(cluster, peer, retry, m, content_addr, rstatus);
+        pthread_mutex_unlock(&refresh_lock);
+        if (r > 0) ok += r;
+        for (int i = 0; i < m; ++i) status[pos[i]] = rstatus[i];
+    }
+    free(retry);
+    free(pos);
+    free(rstatus);
+    return ok;
+}
+
+int record_digest_cmp(const void *a, const void *b) {
+    uint64_t da = ((const struct batch_record*)a)->digest, db = ((const struct batch_record*)b)->digest;
+    return da < db ? -1 : da > db;
+}
+
+/* Register every regular file in the working directory, with its
+   digest, in pipelined BATCH_UPDATE datagrams. Files holding the same
+   bytes are reported first: each copy costs disk and adds no provider.
+   On the DHT a file the index refused is still served, as it is
+   published there. */
+void seed_directory(struct net_addr *content_addr) {
+    DIR *dir = opendir(".");
+    if (!dir) { perror("opendir"); return; }
+    int n = 0, cap = 0;
+    struct batch_record *recs = NULL;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (de->d_name[0] == '.') continue;
+        if (len > 5 && strcmp(de->d_name + len - 5, ".part") == 0) continue;
+        if (len > 9 && strcmp(de->d_name + len - 9, ".part.map") == 0) continue;
+        struct stat sb;
+        if (stat(de->d_name, &sb) < 0 || !S_ISREG(sb.st_mode)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct batch_record *nr = realloc(recs, cap * sizeof(*recs));
+            if (!nr) break;
+            recs = nr;
+        }
+        recs[n].op = REGISTER;
+        recs[n].digest = 0;
+        if ((recs[n].contentName = strdup(de->d_name))) n++;
+    }
+    closedir(dir);
+
+    char *status = malloc(n + 1);
+    if (!status) { batch_free(recs, n); return; }
+    double start = now_ms();
+    /* Added first so the manifests built while hashing are kept. */
+    for (int i = 0; i < n; ++i) {
+        local_add(recs[i].contentName);
+        recs[i].digest = file_digest(recs[i].contentName);
+    }
+    qsort(recs, n, sizeof(*recs), record_digest_cmp);
+    int dups = 0;
+    for (int i = 1; i < n; ++i)
+        if (recs[i].digest && recs[i].digest == recs[i-1].digest) {
+            printf("%s holds the same bytes as %s\n", recs[i].contentName, recs[i-1].contentName);
+            dups++;
+        }
+    int ok = send_batch_routed(peerName, recs, n, content_addr, status);
+    for (int i = 0; i < n; ++i)
+        if (dht_sock < 0 && (ok < 0 || (status[i] != 'A' && status[i] != 'D'))) local_remove(recs[i].contentName);
+    printf("Seeded %d of %d files (%d duplicate%s) in %.1f ms\n", ok < 0 ? 0 : ok, n, dups, dups == 1 ? "" : "s", now_ms() - start);
+    free(status);
+    batch_free(recs, n);
+}
+
+int send_deregister_udp(const char *peer, const char *content) {
+    char req[1024], buf[MAX_DGRAM], text[128];
+    struct frame f;
+    int tries = routed_call(content, req, build_named(req, sizeof(req), DEREGISTER, peer, content), buf, sizeof(buf), &f);
+    if (tries < 0) return -1;
+
+    if (f.type == ACKNOWLEDGEMENT || (tries > 1 && strcmp(frame_text(&f, text, sizeof(text)), "No such registration") == 0)) { printf("Deregistered: %s\n", frame_text(&f, text, sizeof(text))); return 0; }
+    else { printf("Deregister error: %s\n", frame_text(&f, text, sizeof(text))); return -1; }
+}
+
+/* Every index server holds a lease for this peer, so each is told. */
+int send_quit_udp(const char *peer) {
+    char req[512], buf[MAX_DGRAM], text[128];
+    struct udp_client *ucs[CLUSTER_MAX];
+    int nuc = cluster_clients(ucs), rc = 0;
+    size_t len = build_named(req, sizeof(req), QUIT, peer, NULL);
+    for (int i = 0; i < nuc; ++i) {
+        struct frame f;
+        if (client_call(ucs[i], req, len, buf, sizeof(buf), &f) < 0) { rc = -1; continue; }
+        if (f.type == ACKNOWLEDGEMENT) printf("Quit acknowledged\n");
+        else printf("Quit error: %s\n", frame_text(&f, text, sizeof(text)));
+    }
+    return rc;
+}
+
+void uploads_track(int delta) {
+    pthread_mutex_lock(&uploads.lock);
+    double t = now_ms();
+    if (uploads.active == 0 && delta > 0) uploads.busy_since = t;
+    uploads.active += delta;
+    if (uploads.active == 0) uploads.busy_ms += t - uploads.busy_since;
+    pthread_mutex_unlock(&uploads.lock);
+}
+
+/* Active uploads and egress rate since the previous call, smoothed; a
+   window with too little busy time keeps the previous estimate. */
+void uploads_sample(uint32_t *active, uint64_t *rate) {
+    static uint64_t last_bytes, est;
+    static double last_busy;
+    pthread_mutex_lock(&uploads.lock);
+    double busy = uploads.busy_ms + (uploads.active ? now_ms() - uploads.busy_since : 0);
+    uint64_t bytes = __atomic_load_n(&uploads.bytes, __ATOMIC_RELAXED);
+    *active = uploads.active;
+    pthread_mutex_unlock(&uploads.lock);
+    if (busy - last_busy >= 100) {
+        uint64_t sample = (bytes - last_bytes) * 1000.0 / (busy - last_busy);
+        est = est ? (est * 7 + sample * 3) / 10 : sample;
+        last_bytes = bytes;
+        last_busy = busy;
+    }
+    *rate = est;
+}
+
+void hist_add(struct hist *h, double us) {
+    uint64_t v = us < 0 ? 0 : (uint64_t)us;
+    int idx;
+    if (v >= (1ULL << 39)) v = (1ULL << 39) - 1;
+    if (v < 32) idx = v;
+    else {
+        int e = 63 - __builtin_clzll(v) - 4;
+        idx = e * 16 + (int)(v >> e);
+    }
+    __atomic_add_fetch(&h->count[idx], 1, __ATOMIC_RELAXED);
+}
+
+/* Upper edge of the bucket holding quantile q, 0 if h is empty. */
+uint64_t hist_quantile(const struct hist *h, double q) {
+    uint64_t counts[HIST_BUCKETS], total = 0, seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) total += counts[i] = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+    if (!total) return 0;
+    uint64_t want = (uint64_t)(q * total);
+    if (want < q * total || want == 0) want++;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        if ((seen += counts[i]) < want) continue;
+        if (i < 32) return i + 1;
+        int e = i / 16 - 1;
+        return (uint64_t)(i - e * 16 + 1) << e;
+    }
+    return 0;
+}
+
+/* Kademlia-style DHT among peers (-J), a second way to find providers
+   that keeps working while the index is slow or down and takes lookups
+   off it. Node ids and keys are 64-bit ring_hash values of the peer name
+   and of contentName, and distance is their XOR. A node keeps up to
+   DHT_K contacts per distance bucket and keeps a known contact over a
+   newcomer until it stops answering. Messages are version 2 frames on
+   the DHT socket. Requests carry the sender's node id in F_ORIGIN (a
+   client that is not a node leaves it out); replies are ACKNOWLEDGEMENT
+   frames with the request id and the replier's F_ORIGIN:
+     DHT_FIND_NODE   F_KEY target; reply F_NODE for each of the DHT_K
+                     closest contacts
+     DHT_FIND_VALUE  F_KEY, F_CONTENT; reply F_PROVIDER for each stored
+                     provider of the name, else F_NODE as above
+     DHT_STORE       F_CONTENT, F_PROVIDER; empty reply
+   A lookup is iterative: each round asks the DHT_ALPHA closest contacts
+   not yet asked, in parallel, and merges the contacts they return, until
+   the DHT_K closest have all answered or a FIND_VALUE finds providers.
+   Stored providers expire after DHT_TTL_MS; peers republish their files
+   every DHT_REPUBLISH_MS. */
+struct dht_node {
+    uint64_t id;
+    struct net_addr addr;
+    double seen;
+    int fails;
+};
+
+struct dht_value {
+    struct dht_value *next;
+    uint64_t key;
+    char name[NAME_MAX_LEN+1];
+    struct provider prov;
+    double expires;
+};
+
+/* Replies to one round of a lookup, matched by request id. */
+struct dht_wait {
+    struct dht_wait *next;
+    uint64_t base;
+    int n, got;
+    char (*bufs)[MAX_DGRAM];
+    size_t *lens;
+};
+
+struct {
+    struct dht_node nodes[DHT_K];   /* least recently heard first */
+    int count;
+} dht_table[64];
+struct dht_value *dht_store[DHT_STORE_BUCKETS];
+int dht_values = 0;
+struct dht_wait *dht_waits = NULL;
+pthread_mutex_t dht_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dht_cond = PTHREAD_COND_INITIALIZER;
+uint64_t dht_id;
+
+/* Note a message from a node; returns 1 if it is a new contact. Caller
+   holds dht_lock. */
+int dht_seen(uint64_t id, const struct net_addr *addr) {
+    if (id == dht_id) return 0;
+    int b = 63 - __builtin_clzll(id ^ dht_id), i;
+    struct dht_node *nodes = dht_table[b].nodes;
+    int *count = &dht_table[b].count;
+    for (i = 0; i < *count && nodes[i].id != id; ++i) ;
+    int fresh = i == *count;
+    if (fresh && *count == DHT_K) {
+        if (!nodes[0].fails && now_ms() - nodes[0].seen < DHT_STALE_MS) return 0;
+        i = 0;
+    }
+    if (i == *count) (*count)++;
+    memmove(&nodes[i], &nodes[i+1], (*count - 1 - i) * sizeof(*nodes));
+    nodes[*count - 1] = (struct dht_node){ id, *addr, now_ms(), 0 };
+    return fresh;
+}
+
+/* A request went unanswered; a node that misses two in a row is dropped. */
+void dht_failed(uint64_t id) {
+    pthread_mutex_lock(&dht_lock);
+    if (id != dht_id) {
+        int b = 63 - __builtin_clzll(id ^ dht_id);
+        struct dht_node *nodes = dht_table[b].nodes;
+        for (int i = 0; i < dht_table[b].count; ++i)
+            if (nodes[i].id == id && ++nodes[i].fails >= 2) {
+                memmove(&nodes[i], &nodes[i+1], (--dht_table[b].count - i) * sizeof(*nodes));
+                break;
+            }
+    }
+    pthread_mutex_unlock(&dht_lock);
+}
+
+/* The max contacts closest to target, nearest first, skipping except.
+   Caller holds dht_lock. */
+int dht_closest(uint64_t target, uint64_t except, struct dht_node *out, int max) {
+    int n = 0;
+    for (int b = 0; b < 64; ++b)
+        for (int i = 0; i < dht_table[b].count; ++i) {
+            struct dht_node *d = &dht_table[b].nodes[i];
+            if (d->id == except) continue;
+            int j = n < max ? n++ : max;
+            for (; j > 0 && (out[j-1].id ^ target) > (d->id ^ target); --j)
+                if (j < max) out[j] = out[j-1];
+            if (j < max) out[j] = *d;
+        }
+    return n;
+}
+
+int dht_contacts(void) {
+    int n = 0;
+    pthread_mutex_lock(&dht_lock);
+    for (int b = 0; b < 64; ++b) n += dht_table[b].count;
+    pthread_mutex_unlock(&dht_lock);
+    return n;
+}
+
+void dht_send(const struct net_addr *to, const char *buf, size_t len) {
+    struct sockaddr_storage ss;
+    socklen_t sl = addr_to_sockaddr(to, &ss);
+    if (len) sendto(dht_sock, buf, len, 0, (struct sockaddr*)&ss, sl);
+}
+
+void dht_put_provider(struct wbuf *w, const struct provider *pr) {
+    char *f = put_open(w, F_PROVIDER);
+    put_name(w, F_PEER, pr->peerName);
+    put_addr(w, F_ADDR, &pr->addr);
+    put_uint(w, F_FLAGS, pr->flags);
+    if (pr->digest) put_uint(w, F_DIGEST, pr->digest);
+    put_close(w, f);
+}
+
+/* Free the expired values of one store bucket. Caller holds dht_lock. */
+void dht_reap(struct dht_value **link, double now) {
+    while (*link) {
+        struct dht_value *v = *link;
+        if (v->expires >= now) { link = &v->next; continue; }
+        *link = v->next;
+        free(v);
+        dht_values--;
+    }
+}
+
+/* Free every expired value. */
+void dht_sweep(void) {
+    double now = now_ms();
+    pthread_mutex_lock(&dht_lock);
+    for (int b = 0; b < DHT_STORE_BUCKETS; ++b) dht_reap(&dht_store[b], now);
+    pthread_mutex_unlock(&dht_lock);
+}
+
+/* Store or refresh a provider of name. */
+void dht_put(const char *name, const struct provider *pr) {
+    uint64_t key = ring_hash(name, strlen(name));
+    double now = now_ms();
+    pthread_mutex_lock(&dht_lock);
+    struct dht_value **link = &dht_store[key % DHT_STORE_BUCKETS];
+    dht_reap(link, now);
+    if (dht_values >= DHT_VALUES_MAX)
+        for (int b = 0; b < DHT_STORE_BUCKETS; ++b) dht_reap(&dht_store[b], now);
+    while (*link && ((*link)->key != key || strcmp((*link)->name, name) != 0 || strcmp((*link)->prov.peerName, pr->peerName) != 0))
+        link = &(*link)->next;
+    if (!*link && dht_values < DHT_VALUES_MAX && (*link = calloc(1, sizeof(**link)))) {
+        (*link)->key = key;
+        strcpy((*link)->name, name);
+        dht_values++;
+    }
+    if (*link) {
+        (*link)->prov = *pr;
+        (*link)->expires = now + DHT_TTL_MS;
+    }
+    pthread_mutex_unlock(&dht_lock);
+}
+
+/* Copy out up to max live providers of name, dropping expired ones. */
+int dht_get(const char *name, struct provider *out, int max) {
+    uint64_t key = ring_hash(name, strlen(name));
+    int n = 0;
+    pthread_mutex_lock(&dht_lock);
+    struct dht_value **link = &dht_store[key % DHT_STORE_BUCKETS];
+    dht_reap(link, now_ms());
+    for (struct dht_value *v = *link; v; v = v->next)
+        if (v->key == key && strcmp(v->name, name) == 0 && n < max) out[n++] = v->prov;
+    pthread_mutex_unlock(&dht_lock);
+    return n;
+}
+
+/* A node just joined: hand it up to DHT_HANDOFF_MAX stored providers
+   whose keys it is closer to than this node, as those keys' lookups now
+   end nearer it. The values are copied out under the lock and sent after,
+   so the receive thread does not hold up other DHT traffic for long. */
+void dht_handoff(uint64_t id, const struct net_addr *addr) {
+    struct dht_value *out = malloc(DHT_HANDOFF_MAX * sizeof(*out));
+    int n = 0;
+    if (!out) return;
+    double now = now_ms();
+    pthread_mutex_lock(&dht_lock);
+    for (int b = 0; b < DHT_STORE_BUCKETS && n < DHT_HANDOFF_MAX && dht_values; ++b)
+        for (struct dht_value *v = dht_store[b]; v && n < DHT_HANDOFF_MAX; v = v->next)
+            if (v->expires >= now && (id ^ v->key) < (dht_id ^ v->key)) out[n++] = *v;
+    pthread_mutex_unlock(&dht_lock);
+
+    char req[CONN_REQ_MAX];
+    for (int i = 0; i < n; ++i) {
+        struct wbuf w;
+        frame_begin(&w, req, sizeof(req), DHT_STORE, 0);
+        put_uint(&w, F_ORIGIN, dht_id);
+        put_name(&w, F_CONTENT, out[i].name);
+        dht_put_provider(&w, &out[i].prov);
+        dht_send(addr, req, frame_end(&w, req));
+    }
+    free(out);
+}
+
+/* Send one request to each of nodes[0, n) and gather replies until all
+   have answered or DHT_RTO_MS passes; lens[i] stays 0 for no reply. */
+void dht_round(const struct dht_node *nodes, int n, char type, uint64_t target, const char *name, char (*bufs)[MAX_DGRAM], size_t *lens) {
+    struct dht_wait w = { .base = request_ids(n), .n = n, .bufs = bufs, .lens = lens };
+    memset(lens, 0, n * sizeof(*lens));
+    pthread_mutex_lock(&dht_lock);
+    w.next = dht_waits;
+    dht_waits = &w;
+    pthread_mutex_unlock(&dht_lock);
+
+    for (int i = 0; i < n; ++i) {
+        char req[CONN_REQ_MAX];
+        struct wbuf wb;
+        frame_begin(&wb, req, sizeof(req), type, w.base + i);
+        put_uint(&wb, F_ORIGIN, dht_id);
+        put_uint(&wb, F_KEY, target);
+        if (name) put_name(&wb, F_CONTENT, name);
+        dht_send(&nodes[i].addr, req, frame_end(&wb, req));
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DHT_RTO_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&dht_lock);
+    while (w.got < n && pthread_cond_timedwait(&dht_cond, &dht_lock, &deadline) == 0) ;
+    struct dht_wait **link = &dht_waits;
+    while (*link != &w) link = &(*link)->next;
+    *link = w.next;
+    pthread_mutex_unlock(&dht_lock);
+}
+
+enum { CAND_NEW, CAND_ASKED, CAND_DONE, CAND_FAILED };
+
+struct dht_cand {
+    struct dht_node node;
+    int state;
+};
+
+/* Add a contact to a lookup's shortlist, kept nearest first and capped
+   at DHT_SHORTLIST. */
+void cand_add(struct dht_cand *list, int *n, const struct dht_node *d, uint64_t target) {
+    if (d->id == dht_id) return;
+    for (int i = 0; i < *n; ++i) if (list[i].node.id == d->id) return;
+    int j = *n < DHT_SHORTLIST ? (*n)++ : DHT_SHORTLIST;
+    for (; j > 0 && (list[j-1].node.id ^ target) > (d->id ^ target); --j)
+        if (j < DHT_SHORTLIST) list[j] = list[j-1];
+    if (j < DHT_SHORTLIST) list[j] = (struct dht_cand){ *d, CAND_NEW };
+}
+
+/* Iterative lookup of target. With a name it is a FIND_VALUE that stops
+   at the first node holding providers, copying up to maxp of them into
+   provs, and returns how many. Without, it returns the up to DHT_K
+   closest nodes that answered, in closest. *hops counts the rounds. */
+int dht_lookup(uint64_t target, const char *name, struct provider *provs, int maxp, struct dht_node *closest, int *hops) {
+    struct dht_cand list[DHT_SHORTLIST];
+    struct dht_node seed[DHT_K];
+    int n = 0, found = 0;
+    pthread_mutex_lock(&dht_lock);
+    int ns = dht_closest(target, dht_id, seed, DHT_K);
+    pthread_mutex_unlock(&dht_lock);
+    for (int i = 0; i < ns; ++i) cand_add(list, &n, &seed[i], target);
+
+    char (*bufs)[MAX_DGRAM] = malloc(DHT_ALPHA * sizeof(*bufs));
+    size_t lens[DHT_ALPHA];
+    *hops = 0;
+    while (bufs && !found) {
+        struct dht_node ask[DHT_ALPHA];
+        uint64_t ids[DHT_ALPHA];
+        int na = 0, live = 0;
+        for (int i = 0; i < n && live < DHT_K && na < DHT_ALPHA; ++i) {
+            if (list[i].state == CAND_FAILED) continue;
+            live++;
+            if (list[i].state == CAND_NEW) {
+                list[i].state = CAND_ASKED;
+                ids[na] = list[i].node.id;
+                ask[na++] = list[i].node;
+            }
+        }
+        if (!na) break;
+        ++*hops;
+        dht_round(ask, na, name ? DHT_FIND_VALUE : DHT_FIND_NODE, target, name, bufs, lens);
+
+        for (int j = 0; j < na; ++j) {
+            int i = 0;
+            while (list[i].node.id != ids[j]) ++i;
+            list[i].state = lens[j] ? CAND_DONE : CAND_FAILED;
+            if (!lens[j]) dht_failed(ids[j]);
+        }
+        for (int j = 0; j < na; ++j) {
+            struct frame f;
+            if (!lens[j] || parse_frame(bufs[j], lens[j], &f) < 0) continue;
+            int tag, ntag;
+            struct span val, nval;
+            for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+                if (tag == F_PROVIDER && found < maxp && parse_provider(val, &provs[found])) {
+                    int dup = 0;
+                    for (int i = 0; i < found && !dup; ++i) dup = strcmp(provs[i].peerName, provs[found].peerName) == 0;
+                    found += !dup;
+                }
+                else if (tag == F_NODE) {
+                    struct dht_node d = {0};
+                    int has_addr = 0;
+                    for (const char *q = val.p; next_field(&q, val.p + val.len, &ntag, &nval); ) {
+                        if (ntag == F_KEY) d.id = span_uint(nval);
+                        else if (ntag == F_ADDR) has_addr = span_addr(nval, &d.addr);
                     }
-                } else printf("Download failed\n");
+                    if (has_addr) cand_add(list, &n, &d, target);
+                }
+            }
+        }
+    }
+    free(bufs);
+    int nc = 0;
+    for (int i = 0; closest && i < n && nc < DHT_K; ++i)
+        if (list[i].state == CAND_DONE) closest[nc++] = list[i].node;
+    return name ? found : nc;
+}
+
+/* Store this peer as a provider of name on the DHT_K nodes closest to
+   its key, and here too if this node is among them. Stores are not
+   acknowledged; one that is lost is made good by the next republish. */
+void dht_publish(const char *name, uint64_t digest) {
+    if (dht_sock < 0) return;
+    uint64_t key = ring_hash(name, strlen(name));
+    struct dht_node nodes[DHT_K];
+    int hops, n = dht_lookup(key, NULL, NULL, 0, nodes, &hops);
+    struct provider self = { .addr = serving_addr, .flags = PROVIDER_V2, .digest = digest };
+    snprintf(self.peerName, sizeof(self.peerName), "%.*s", NAME_MAX_LEN, peerName);
+    char req[CONN_REQ_MAX];
+    for (int i = 0; i < n; ++i) {
+        struct wbuf w;
+        frame_begin(&w, req, sizeof(req), DHT_STORE, request_ids(1));
+        put_uint(&w, F_ORIGIN, dht_id);
+        put_name(&w, F_CONTENT, name);
+        dht_put_provider(&w, &self);
+        dht_send(&nodes[i].addr, req, frame_end(&w, req));
+    }
+    if (n < DHT_K || (dht_id ^ key) < (nodes[n-1].id ^ key)) dht_put(name, &self);
+}
+
+/* Providers of name from the DHT; returns like send_search_multi_udp. */
+int dht_search(const char *name, int k, struct provider *out, int *count) {
+    double start = now_ms();
+    int hops = 0;
+    int n = dht_get(name, out, k);
+    if (!n) n = dht_lookup(ring_hash(name, strlen(name)), name, out, k, NULL, &hops);
+    double ms = now_ms() - start;
+    __atomic_add_fetch(&pstats.dht_lookups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pstats.dht_hops, hops, __ATOMIC_RELAXED);
+    if (n) __atomic_add_fetch(&pstats.dht_found, 1, __ATOMIC_RELAXED);
+    hist_add(&pstats.dht_us, ms * 1000);
+    printf("DHT: %d provider%s of %s in %d hop%s, %.2f ms\n", n, n == 1 ? "" : "s", name, hops, hops == 1 ? "" : "s", ms);
+    *count = n;
+    return n ? 0 : 1;
+}
+
+/* Answer DHT requests and hand replies to the lookups waiting for them. */
+void *dht_main(void *arg) {
+    (void)arg;
+    char buf[MAX_DGRAM], out[MAX_DGRAM];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(dht_sock, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+        if (len < 0) { if (errno == EINTR) continue; perror("recvfrom"); break; }
+        struct frame f;
+        if (parse_frame(buf, len, &f) < 0) continue;
+        struct net_addr src;
+        addr_from_sin(&src, &from);
+
+        uint64_t origin = 0, key = 0;
+        int has_origin = 0, tag;
+        struct span val, name = { NULL, 0 }, prov = { NULL, 0 };
+        for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+            if (tag == F_ORIGIN) { origin = span_uint(val); has_origin = 1; }
+            else if (tag == F_KEY) key = span_uint(val);
+            else if (tag == F_CONTENT) name = val;
+            else if (tag == F_PROVIDER) prov = val;
+        }
+
+        pthread_mutex_lock(&dht_lock);
+        int fresh = has_origin && dht_seen(origin, &src);
+        pthread_mutex_unlock(&dht_lock);
+        if (fresh) dht_handoff(origin, &src);
+        pthread_mutex_lock(&dht_lock);
+        if (f.type == ACKNOWLEDGEMENT) {
+            for (struct dht_wait *w = dht_waits; w; w = w->next)
+                if (f.id >= w->base && f.id < w->base + w->n && !w->lens[f.id - w->base]) {
+                    memcpy(w->bufs[f.id - w->base], buf, len);
+                    w->lens[f.id - w->base] = len;
+                    w->got++;
+                    pthread_cond_broadcast(&dht_cond);
+                }
+            pthread_mutex_unlock(&dht_lock);
+            continue;
+        }
+        struct dht_node nodes[DHT_K];
+        int nn = dht_closest(key, origin, nodes, DHT_K);
+        pthread_mutex_unlock(&dht_lock);
+
+        char cname[NAME_MAX_LEN+1];
+        span_name(cname, name);
+        struct wbuf w;
+        frame_begin(&w, out, sizeof(out), ACKNOWLEDGEMENT, f.id);
+        put_uint(&w, F_ORIGIN, dht_id);
+        if (f.type == DHT_STORE) {
+            struct provider pr;
+            if (!name.len || !prov.p || !parse_provider(prov, &pr)) continue;
+            dht_put(cname, &pr);
+        } else if (f.type == DHT_FIND_NODE || f.type == DHT_FIND_VALUE) {
+            struct provider provs[MAX_PROVIDERS];
+            int np = f.type == DHT_FIND_VALUE && name.len ? dht_get(cname, provs, MAX_PROVIDERS) : 0;
+            for (int i = 0; i < np; ++i) dht_put_provider(&w, &provs[i]);
+            for (int i = 0; !np && i < nn; ++i) {
+                char *nf = put_open(&w, F_NODE);
+                put_uint(&w, F_KEY, nodes[i].id);
+                put_addr(&w, F_ADDR, &nodes[i].addr);
+                put_close(&w, nf);
+            }
+        } else continue;
+        dht_send(&src, out, frame_end(&w, out));
+    }
+    return NULL;
+}
+
+/* Join through a known node: ask it for the nodes closest to this one,
+   then look up this node's own id so the nodes near it learn of it. */
+void dht_join(const struct net_addr *boot) {
+    char (*bufs)[MAX_DGRAM] = malloc(sizeof(*bufs));
+    size_t len;
+    struct dht_node contact = { .id = dht_id, .addr = *boot }, nodes[DHT_K];
+    for (int i = 0; bufs && i < 10 && !dht_contacts(); ++i) dht_round(&contact, 1, DHT_FIND_NODE, dht_id, NULL, bufs, &len);
+    free(bufs);
+    int hops, n = dht_lookup(dht_id, NULL, NULL, 0, nodes, &hops);
+    if (!dht_contacts()) fprintf(stderr, "DHT: no answer from the bootstrap contact\n");
+    else printf("DHT: joined, %d node%s near this one found in %d hop%s\n", n, n == 1 ? "" : "s", hops, hops == 1 ? "" : "s");
+}
+
+/* Publish every local file, again every DHT_REPUBLISH_MS, dropping
+   expired values and refreshing the contacts near this node each time. */
+void *dht_maintain_main(void *arg) {
+    (void)arg;
+    while (1) {
+        struct dht_node nodes[DHT_K];
+        int hops, n;
+        struct batch_record *recs = local_records(REGISTER, &n);
+        for (int i = 0; recs && i < n; ++i) dht_publish(recs[i].contentName, recs[i].digest);
+        batch_free(recs, n);
+        usleep(DHT_REPUBLISH_MS * 1000);
+        dht_sweep();
+        dht_lookup(dht_id, NULL, NULL, 0, nodes, &hops);
+    }
+    return NULL;
+}
+
+/* Open the DHT socket and start answering on it. */
+int dht_start(int port) {
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    socklen_t len = sizeof(sin);
+    dht_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (dht_sock < 0 || bind(dht_sock, (struct sockaddr*)&sin, sizeof(sin)) < 0 || getsockname(dht_sock, (struct sockaddr*)&sin, &len) < 0) {
+        perror("DHT socket");
+        return -1;
+    }
+    char label[NAME_MAX_LEN + 32], host[INET6_ADDRSTRLEN];
+    snprintf(label, sizeof(label), "%s@%s:%d", peerName, addr_str(&serving_addr, host, sizeof(host)), ntohs(serving_addr.port));
+    dht_id = ring_hash(label, strlen(label));
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dht_main, NULL) != 0) { perror("pthread_create"); return -1; }
+    printf("DHT node %016llx on UDP port %d\n", (unsigned long long)dht_id, ntohs(sin.sin_port));
+    return 0;
+}
+
+struct search_race {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs, done[2], found[2];
+    char name[NAME_MAX_LEN+1];
+    int k, count[2];
+    struct provider provs[2][MAX_PROVIDERS];
+};
+
+void race_put(struct search_race *r) {
+    pthread_mutex_lock(&r->lock);
+    int last = --r->refs == 0;
+    pthread_mutex_unlock(&r->lock);
+    if (!last) return;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r);
+}
+
+void race_finish(struct search_race *r, int side, int rc) {
+    pthread_mutex_lock(&r->lock);
+    r->done[side] = 1;
+    r->found[side] = rc == 0 && r->count[side] > 0;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    race_put(r);
+}
+
+void *race_index_main(void *arg) {
+    struct search_race *r = arg;
+    race_finish(r, 0, send_search_multi_udp(r->name, r->k, r->provs[0], &r->count[0]));
+    return NULL;
+}
+
+void *race_dht_main(void *arg) {
+    struct search_race *r = arg;
+    race_finish(r, 1, dht_search(r->name, r->k, r->provs[1], &r->count[1]));
+    return NULL;
+}
+
+/* Find providers through the index, the DHT or both, per dht_mode.
+   Returns like send_search_multi_udp. */
+int search_providers(const char *name, int k, struct provider *out, int *count) {
+    if (dht_sock < 0 || dht_mode == DHT_OFF) return send_search_multi_udp(name, k, out, count);
+    if (dht_mode == DHT_FALLBACK) {
+        int rc = send_search_multi_udp(name, k, out, count);
+        return rc == 0 && *count > 0 ? rc : dht_search(name, k, out, count);
+    }
+    if (dht_mode == DHT_FIRST) {
+        int rc = dht_search(name, k, out, count);
+        return rc == 0 ? rc : send_search_multi_udp(name, k, out, count);
+    }
+
+    /* Race: the first side to find providers wins; the other finishes
+       on its own and drops its share of the state. */
+    struct search_race *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->k = k > MAX_PROVIDERS ? MAX_PROVIDERS : k;
+    r->refs = 3;
+    pthread_t tid;
+    for (int side = 0; side < 2; ++side)
+        if (pthread_create(&tid, NULL, side ? race_dht_main : race_index_main, r) == 0) pthread_detach(tid);
+        else race_finish(r, side, -1);
+    pthread_mutex_lock(&r->lock);
+    while (!r->found[0] && !r->found[1] && !(r->done[0] && r->done[1])) pthread_cond_wait(&r->cond, &r->lock);
+    int side = r->found[0] ? 0 : 1, rc = r->found[side] ? 0 : 1;
+    *count = r->found[side] ? r->count[side] : 0;
+    memcpy(out, r->provs[side], *count * sizeof(*out));
+    pthread_mutex_unlock(&r->lock);
+    race_put(r);
+    return rc;
+}
+
+int stat_slot(char type) {
+    return type == DOWNLOAD ? 0 : type == STAT ? 1 : 2;
+}
+
+void textf(char *buf, size_t cap, size_t *n, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+void textf(char *buf, size_t cap, size_t *n, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int w = vsnprintf(buf + *n, cap - *n, fmt, ap);
+    va_end(ap);
+    if (w > 0) *n += (size_t)w < cap - *n ? (size_t)w : cap - *n - 1;
+}
+
+/* "key value" lines, as in the index's STATS reply. */
+size_t stats_text(char *buf, size_t cap) {
+    size_t n = 0;
+    pthread_mutex_lock(&uploads.lock);
+    int active = uploads.active;
+    pthread_mutex_unlock(&uploads.lock);
+    textf(buf, cap, &n, "uptime_s %.1f\nfiles %d\nconnections %llu\nactive_uploads %d\nbytes_served %llu\n",
+          (now_ms() - started_ms) / 1000, local_count,
+          (unsigned long long)__atomic_load_n(&pstats.connections, __ATOMIC_RELAXED), active,
+          (unsigned long long)__atomic_load_n(&uploads.bytes, __ATOMIC_RELAXED));
+    pthread_mutex_lock(&local_lock);
+    textf(buf, cap, &n, "cache_bytes %llu\ncache_quota %llu\n", (unsigned long long)cache_used, (unsigned long long)cache_quota);
+    textf(buf, cap, &n, "egress_cap %llu\npeer_cap %llu\nupload_slots %d\nuploads_running %d\nuploads_queued %d\nuploads_parked %d\n",
+          (unsigned long long)egress_cap, (unsigned long long)peer_cap, upload_slots, __atomic_load_n(&uploads_running, __ATOMIC_RELAXED),
+          __atomic_load_n(&small_queue.count, __ATOMIC_RELAXED) + __atomic_load_n(&large_queue.count, __ATOMIC_RELAXED),
+          __atomic_load_n(&parked.count, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&local_lock);
+    const char types[3] = { DOWNLOAD, STAT, HASHES };
+    for (int i = 0; i < 3; ++i) {
+        uint64_t reqs = __atomic_load_n(&pstats.served[i], __ATOMIC_RELAXED);
+        if (reqs) textf(buf, cap, &n, "type %c requests %llu p50_us %llu p99_us %llu p999_us %llu\n", types[i], (unsigned long long)reqs,
+                        (unsigned long long)hist_quantile(&pstats.serve_us[i], 0.5), (unsigned long long)hist_quantile(&pstats.serve_us[i], 0.99),
+                        (unsigned long long)hist_quantile(&pstats.serve_us[i], 0.999));
+    }
+    textf(buf, cap, &n, "bytes_fetched %llu\nchunks_verified %llu\nchunks_failed %llu\n",
+          (unsigned long long)__atomic_load_n(&pstats.bytes_fetched, __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&pstats.chunks_ok, __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&pstats.chunks_bad, __ATOMIC_RELAXED));
+    if (__atomic_load_n(&pstats.lz4_frames, __ATOMIC_RELAXED))
+        textf(buf, cap, &n, "lz4_frames %llu\nlz4_bytes_saved %llu\n", (unsigned long long)__atomic_load_n(&pstats.lz4_frames, __ATOMIC_RELAXED),
+              (unsigned long long)__atomic_load_n(&pstats.lz4_saved, __ATOMIC_RELAXED));
+    if (dht_sock >= 0) {
+        uint64_t lookups = __atomic_load_n(&pstats.dht_lookups, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&dht_lock);
+        int values = dht_values;
+        pthread_mutex_unlock(&dht_lock);
+        textf(buf, cap, &n, "dht_contacts %d\ndht_values %d\ndht_lookups %llu\ndht_found %llu\n", dht_contacts(), values,
+              (unsigned long long)lookups, (unsigned long long)__atomic_load_n(&pstats.dht_found, __ATOMIC_RELAXED));
+        if (lookups)
+            textf(buf, cap, &n, "dht mean_hops %.2f p50_us %llu p99_us %llu p999_us %llu\n",
+                  (double)__atomic_load_n(&pstats.dht_hops, __ATOMIC_RELAXED) / lookups, (unsigned long long)hist_quantile(&pstats.dht_us, 0.5),
+                  (unsigned long long)hist_quantile(&pstats.dht_us, 0.99), (unsigned long long)hist_quantile(&pstats.dht_us, 0.999));
+    }
+    if (__atomic_load_n(&pstats.chunks_ok, __ATOMIC_RELAXED))
+        textf(buf, cap, &n, "fetch p50_us %llu p99_us %llu p999_us %llu\n", (unsigned long long)hist_quantile(&pstats.fetch_us, 0.5),
+              (unsigned long long)hist_quantile(&pstats.fetch_us, 0.99), (unsigned long long)hist_quantile(&pstats.fetch_us, 0.999));
+    return n;
+}
+
+struct heartbeat_args {
+    struct net_addr content_addr;
+    int interval;
+};
+
+/* Keep this peer's lease alive on every index server, all at once. A
+   server that has already expired the lease gets this peer's files that
+   it owns registered again. A reply carrying a different shard map epoch
+   means members came or went, so the map is fetched again. */
+void *heartbeat_main(void *arg) {
+    struct heartbeat_args *hb = arg;
+    struct slot { struct call c; char buf[MAX_DGRAM]; } *slots = malloc(sizeof(*slots) * CLUSTER_MAX);
+    if (!slots) { perror("malloc"); return NULL; }
+    while (1) {
+        sleep(hb->interval);
+        uint32_t active;
+        uint64_t rate;
+        uploads_sample(&active, &rate);
+        char req[512], load[20];
+        struct wbuf w, lw = { load, load + sizeof(load), 0 };
+        put_varint(&lw, active);
+        put_varint(&lw, rate);
+        frame_begin(&w, req, sizeof(req), HEARTBEAT, request_ids(1));
+        put_name(&w, F_PEER, peerName);
+        put_field(&w, F_LOAD, load, lw.p - load);
+        size_t len = frame_end(&w, req);
+
+        struct udp_client *ucs[CLUSTER_MAX];
+        int nuc = cluster_clients(ucs), stale = 0;
+        uint64_t epoch = cluster_epoch();
+        for (int i = 0; i < nuc; ++i) client_start(ucs[i], &slots[i].c, req, len, slots[i].buf, sizeof(slots[i].buf));
+        for (int i = 0; i < nuc; ++i) {
+            struct frame f;
+            if (client_wait(ucs[i], &slots[i].c, &f) < 0) continue;
+            int tag;
+            struct span val;
+            for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); )
+                if (tag == F_EPOCH && span_uint(val) != epoch) stale = 1;
+            if (f.type != ERROR) continue;
+
+            int count, n = 0;
+            struct batch_record *recs = local_records(REGISTER, &count);
+            for (int j = 0; recs && j < count; ++j) {
+                if (route(recs[j].contentName) == ucs[i]) recs[n++] = recs[j];
+                else free(recs[j].contentName);
+            }
+            char *status = malloc(n + 1);
+            if (recs && status && n) {
+                int ok = send_batch_udp(ucs[i], peerName, recs, n, &hb->content_addr, status);
+                printf("\nLease expired on the index; re-registered %d of %d files\n", ok < 0 ? 0 : ok, n);
             }
-            else if (choice == 4) {
-                char cname[NAME_LEN]; printf("Enter content to deregister: ");
-                if (!fgets(cname, sizeof(cname), stdin)) continue;
-                cname[strcspn(cname, "\n")] = '\0';
-                if (strlen(cname) == 0) continue;
-                if (send_deregister_udp(udpsock, &indexServer, peerName, cname) == 0) {
-                    for (int i = 0; i < local_count; ++i) if (strncmp(local_names[i], cname, NAME_LEN) == 0) {
-                        if (listen_fds[i] >= 0) close(listen_fds[i]);
-                        for (int j = i; j < local_count-1; ++j) { listen_fds[j] = listen_fds[j+1]; strncpy(local_names[j], local_names[j+1], NAME_LEN); }
-                        local_count--; break;
+            free(status);
+            batch_free(recs, n);
+        }
+        if (stale) cluster_refresh();
+    }
+    return NULL;
+}
+
+enum { CONN_REQUEST, CONN_QUEUED, CONN_HASHING, CONN_HEADER, CONN_BODY, CONN_DONE };
+
+/* Per-connection upload state for the event loop. A frame is sent as its
+   5-byte header followed by up to frame bytes straight from the file:
+   SEGMENT_SIZE, or what a version 2 DOWNLOAD asked for in F_FRAME. A
+   DOWNLOAD whose F_CODECS offers CODEC_LZ4 may instead get CONTENT_LZ4
+   frames: 'Z', a 32-bit compressed length and a 32-bit raw length, then
+   an LZ4 block of at most CODEC_FRAME raw bytes, sent from zbuf.
+   Ranged and STAT exchanges keep the connection open for the next request,
+   so swarm downloads reuse one connection for many ranges. Requests come
+   as a legacy register_pdu or a version 2 frame; replies are the same. */
+struct conn {
+    int fd;
+    int state;
+    char req[CONN_REQ_MAX];
+    size_t req_got;
+    char type;
+    char name[NAME_MAX_LEN+1];
+    uint64_t req_off, req_len;
+    size_t frame;
+    int v2;
+    int file;
+    off_t off, end;
+    size_t seg_left;
+    char hdr[16];
+    size_t hdr_len, hdr_sent;
+    char *reply;        /* heap-allocated reply sent instead of hdr (HASHES, STATS) */
+    double started;     /* when the current request was parsed */
+    int codecs;         /* F_CODECS of the request */
+    int squeeze;        /* file's compressible verdict when compressing, else -1 */
+    char *zbuf;         /* CODEC_FRAME raw bytes, then their compressed block */
+    const char *body;   /* frame body sent from zbuf instead of the file */
+    struct conn_list *list;     /* upload queue or parked list it is on */
+    struct conn *prev, *next;
+    struct pace_bucket *peer;   /* per-address bucket, with peer_cap */
+    int slot;                   /* holds one of upload_slots */
+    int busy;                   /* counted in uploads.active: a request is in progress */
+    double queued_at;
+};
+
+/* Upload scheduling. A DOWNLOAD reply sends at most UPLOAD_QUANTUM bytes
+   per wakeup and then yields; epoll reports level-triggered ready sockets
+   round-robin, so every upload gets a turn in each round and a small
+   download finishes within a few rounds however many large ones run.
+   With an egress cap (-u) or a per-address cap (-U) sends also draw on
+   token buckets, and a connection finding one dry is parked, EPOLLOUT
+   off, until it refills. With -s at most upload_slots DOWNLOADs are
+   served at once and the rest wait: requests of up to SMALL_UPLOAD bytes
+   first, unless the oldest larger one has waited QUEUE_AGE_MS. All of
+   this state belongs to the server thread. */
+#define UPLOAD_QUANTUM (256 << 10)
+#define PACE_MIN (16 << 10)
+#define PACE_TICK_MS 5
+#define PACE_BUCKETS 256
+#define SMALL_UPLOAD (512 << 10)
+#define QUEUE_AGE_MS 2000
+
+/* Tokens are bytes; a bucket holds at most a tenth of a second's worth. */
+struct pace_bucket {
+    struct pace_bucket *next;
+    struct net_addr addr;
+    int refs;
+    double tokens, at;
+};
+
+struct pace_bucket egress;
+struct pace_bucket *pace_table[PACE_BUCKETS];
+
+void list_push(struct conn_list *l, struct conn *c) {
+    c->list = l;
+    c->next = NULL;
+    c->prev = l->tail;
+    if (l->tail) l->tail->next = c;
+    else l->head = c;
+    l->tail = c;
+    l->count++;
+}
+
+void list_remove(struct conn *c) {
+    struct conn_list *l = c->list;
+    if (!l) return;
+    if (c->prev) c->prev->next = c->next;
+    else l->head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else l->tail = c->prev;
+    c->list = NULL;
+    l->count--;
+}
+
+struct pace_bucket **pace_find(const struct net_addr *key) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 16; ++i) h = (h ^ key->ip[i]) * 16777619u;
+    struct pace_bucket **link = &pace_table[h % PACE_BUCKETS];
+    while (*link && !addr_eq(&(*link)->addr, key)) link = &(*link)->next;
+    return link;
+}
+
+/* The bucket of a downloader address, shared by its connections. */
+struct pace_bucket *pace_get(const struct net_addr *addr) {
+    struct net_addr key = *addr;
+    key.port = 0;
+    struct pace_bucket **link = pace_find(&key);
+    if (!*link && (*link = calloc(1, sizeof(**link)))) {
+        (*link)->addr = key;
+        (*link)->at = now_ms();
+    }
+    if (*link) (*link)->refs++;
+    return *link;
+}
+
+void pace_put(struct pace_bucket *b) {
+    if (!b || --b->refs > 0) return;
+    *pace_find(&b->addr) = b->next;
+    free(b);
+}
+
+void pace_fill(struct pace_bucket *b, uint64_t rate, double now) {
+    double burst = rate / 10.0 > PACE_MIN ? rate / 10.0 : PACE_MIN;
+    b->tokens += (now - b->at) * rate / 1000;
+    if (b->tokens > burst) b->tokens = burst;
+    b->at = now;
+}
+
+/* Bytes c may send now, up to want; 0 while a bucket holds less than
+   PACE_MIN, or than want if that is smaller. */
+size_t pace_allow(struct conn *c, size_t want, double now) {
+    size_t need = want < PACE_MIN ? want : PACE_MIN;
+    if (egress_cap) {
+        pace_fill(&egress, egress_cap, now);
+        if (egress.tokens < need) return 0;
+        if (want > egress.tokens) want = egress.tokens;
+    }
+    if (peer_cap && c->peer) {
+        pace_fill(c->peer, peer_cap, now);
+        if (c->peer->tokens < need) return 0;
+        if (want > c->peer->tokens) want = c->peer->tokens;
+    }
+    return want;
+}
+
+void pace_charge(struct conn *c, size_t n) {
+    if (egress_cap) egress.tokens -= n;
+    if (peer_cap && c->peer) c->peer->tokens -= n;
+}
+
+int conn_park(int ep, struct conn *c) {
+    list_push(&parked, c);
+    struct epoll_event ev = { .events = 0, .data.ptr = c };
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Re-arm parked connections whose buckets have refilled, oldest first. */
+void pace_wake(int ep) {
+    double now = now_ms();
+    struct conn *c, *next;
+    for (c = parked.head; c; c = next) {
+        next = c->next;
+        if (!pace_allow(c, c->seg_left, now)) continue;
+        list_remove(c);
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+/* LZ4 acceleration for the next frame from the CPU headroom: the share
+   of the last second the server thread spent off CPU, or the machine's
+   idle share by load average if that is lower. 0 means no headroom to
+   compress at all. Only the server thread calls it. */
+int codec_accel(void) {
+    static double window_at, window_cpu;
+    static int accel = 1;
+    double now = now_ms();
+    if (now - window_at < 1000) return accel;
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    double cpu = ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6, load;
+    double headroom = window_at ? 1 - (cpu - window_cpu) / (now - window_at) : 1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (getloadavg(&load, 1) == 1 && ncpu > 0 && 1 - load / ncpu < headroom) headroom = 1 - load / ncpu;
+    accel = headroom > 0.5 ? 1 : headroom > 0.25 ? 4 : headroom > 0.1 ? 16 : 0;
+    window_at = now;
+    window_cpu = cpu;
+    return accel;
+}
+
+/* Read the next frame into zbuf and compress it. It goes out as a
+   CONTENT_LZ4 frame if that saves an eighth, else as a CONTENT frame from
+   zbuf. The first frame tried of a file settles whether it is worth
+   compressing; later frames of an incompressible file go by sendfile. */
+void conn_compress(struct conn *c) {
+    int accel = codec_accel();
+    if (!accel) return;
+    size_t raw = c->seg_left > CODEC_FRAME ? CODEC_FRAME : c->seg_left;
+    if (!c->zbuf && !(c->zbuf = malloc(CODEC_FRAME + lz4_bound(CODEC_FRAME)))) return;
+    if (pread(c->file, c->zbuf, raw, c->off) != (ssize_t)raw) return;
+    unsigned char *in = (unsigned char*)c->zbuf, *out = in + CODEC_FRAME;
+    size_t zlen = lz4_compress(in, raw, out, accel);
+    int worth = zlen <= raw - raw / 8;
+    if (c->squeeze == 0) local_set_compressible(c->name, c->squeeze = worth ? 1 : -1);
+
+    uint32_t len_net = htonl(worth ? zlen : raw), raw_net = htonl(raw);
+    c->hdr[0] = worth ? CONTENT_LZ4 : CONTENT;
+    memcpy(&c->hdr[1], &len_net, 4);
+    memcpy(&c->hdr[5], &raw_net, 4);
+    c->hdr_len = worth ? 9 : 5;
+    c->body = worth ? (char*)out : c->zbuf;
+    c->seg_left = worth ? zlen : raw;
+    c->off += raw;
+    if (worth) {
+        __atomic_add_fetch(&pstats.lz4_frames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pstats.lz4_saved, raw - zlen, __ATOMIC_RELAXED);
+    }
+}
+
+/* Queue the next frame header; a zero-length frame ends the transfer. */
+void conn_next_frame(struct conn *c) {
+    c->seg_left = c->end - c->off > (off_t)c->frame ? c->frame : (size_t)(c->end - c->off);
+    c->hdr_sent = 0;
+    c->state = CONN_HEADER;
+    c->body = NULL;
+    if (c->seg_left && c->squeeze >= 0) conn_compress(c);
+    if (c->body) return;
+    uint32_t len_net = htonl(c->seg_left);
+    c->hdr[0] = CONTENT;
+    memcpy(&c->hdr[1], &len_net, 4);
+    c->hdr_len = 5;
+}
+
+void upload_begin(struct conn *c) {
+    c->slot = 1;
+    uploads_running++;
+    /* Cork the socket so each CONTENT header shares a segment with its data. */
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    conn_next_frame(c);
+}
+
+int upload_wait(int ep, struct conn *c) {
+    c->state = CONN_QUEUED;
+    c->queued_at = now_ms();
+    list_push(c->end - c->off <= SMALL_UPLOAD ? &small_queue : &large_queue, c);
+    struct epoll_event ev = { .events = 0, .data.ptr = c };
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Give up c's slot, if it holds one, to the next queued DOWNLOAD. */
+void upload_release(int ep, struct conn *c) {
+    if (!c->slot) return;
+    c->slot = 0;
+    uploads_running--;
+    while (upload_slots && uploads_running < upload_slots) {
+        struct conn *n = small_queue.head;
+        if (!n || (large_queue.head && now_ms() - large_queue.head->queued_at > QUEUE_AGE_MS)) n = large_queue.head;
+        if (!n) break;
+        list_remove(n);
+        upload_begin(n);
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = n };
+        epoll_ctl(ep, EPOLL_CTL_MOD, n->fd, &ev);
+    }
+}
+
+void conn_close(int ep, struct conn *c) {
+    list_remove(c);
+    upload_release(ep, c);
+    pace_put(c->peer);
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->file >= 0) close(c->file);
+    free(c->reply);
+    free(c->zbuf);
+    if (c->busy) uploads_track(-1);
+    free(c);
+}
+
+/* Send HASHES replies whose manifest the worker has built; a file it
+   could not hash closes its connections. */
+void hashing_wake(int ep) {
+    struct conn *c, *next;
+    for (c = hashing.head; c; c = next) {
+        next = c->next;
+        struct stat sb;
+        if (manifest_pending(c->name)) continue;
+        if (fstat(c->file, &sb) < 0 || !(c->reply = local_manifest_reply(c->name, &sb, &c->hdr_len, 0))) { conn_close(ep, c); continue; }
+        list_remove(c);
+        c->state = CONN_HEADER;
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+/* Bytes the request being read needs, as far as is known yet: at least
+   the five bytes every request starts with, then either a whole
+   register_pdu or a frame whose length follows its two-byte header. */
+size_t conn_need(struct conn *c) {
+    if (c->req_got < 5) return 5;
+    if ((unsigned char)c->req[0] != WIRE_MAGIC) return sizeof(struct register_pdu);
+    const char *p = c->req + 2;
+    uint64_t n;
+    if (!get_varint(&p, c->req + c->req_got, &n)) return c->req_got + 1;
+    return n > CONN_REQ_MAX ? CONN_REQ_MAX + 1 : (size_t)(p - c->req) + n;
+}
+
+int conn_parse(struct conn *c) {
+    c->name[0] = '\0';
+    c->req_off = c->req_len = 0;
+    c->frame = SEGMENT_SIZE;
+    c->codecs = 0;
+    if ((unsigned char)c->req[0] != WIRE_MAGIC) {
+        struct register_pdu *rp = (struct register_pdu*)c->req;
+        c->v2 = 0;
+        c->type = rp->type;
+        memcpy(c->name, rp->contentName, NAME_LEN-1);
+        c->name[NAME_LEN-1] = '\0';
+        c->req_off = get_be64(&rp->padding[0]);
+        c->req_len = get_be64(&rp->padding[8]);
+        return 0;
+    }
+    struct frame f;
+    if (parse_frame(c->req, c->req_got, &f) < 0) return -1;
+    c->v2 = 1;
+    c->type = f.type;
+    int tag;
+    struct span val;
+    for (const char *p = f.fields; next_field(&p, f.end, &tag, &val); ) {
+        if (tag == F_CONTENT) {
+            if (val.len > NAME_MAX_LEN || memchr(val.p, '\0', val.len)) return -1;
+            span_name(c->name, val);
+        } else if (tag == F_OFFSET) c->req_off = span_uint(val);
+        else if (tag == F_LENGTH) c->req_len = span_uint(val);
+        else if (tag == F_FRAME) {
+            uint64_t v = span_uint(val);
+            c->frame = v < FRAME_MIN ? FRAME_MIN : v > FRAME_MAX ? FRAME_MAX : v;
+        } else if (tag == F_CODECS) c->codecs = span_uint(val);
+    }
+    return 0;
+}
+
+/* Returns -1 when the connection should be dropped. */
+int conn_start(int ep, struct conn *c) {
+    if (conn_parse(c) < 0) return -1;
+    c->started = now_ms();
+    if (c->type != STATS) { c->busy = 1; uploads_track(1); }
+    if (c->type == STATS && c->v2) {
+        char text[2048];
+        size_t n = stats_text(text, sizeof(text));
+        if (!(c->reply = malloc(n + 32))) return -1;
+        struct wbuf w;
+        frame_begin(&w, c->reply, n + 32, STATS, 0);
+        put_field(&w, F_TEXT, text, n);
+        c->hdr_len = frame_end(&w, c->reply);
+        c->hdr_sent = 0;
+        c->seg_left = 0;
+        c->state = CONN_HEADER;
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    if (c->type != DOWNLOAD && c->type != STAT && c->type != HASHES) return -1;
+
+    const char *fname = c->name;
+    if (!local_use(fname, c->type == HASHES || (c->type == DOWNLOAD && c->req_len == 0 && c->req_off == 0))) return -1;
+
+    c->file = open(fname, O_RDONLY);
+    if (c->file < 0) return -1;
+    struct stat sb;
+    if (fstat(c->file, &sb) < 0) return -1;
+
+    if (c->type == STAT) {
+        c->hdr[0] = STAT;
+        put_be64(&c->hdr[1], sb.st_size);
+        c->hdr_len = 9;
+        c->hdr_sent = 0;
+        c->seg_left = 0;
+        c->state = CONN_HEADER;
+    } else if (c->type == HASHES) {
+        c->hdr_sent = 0;
+        c->seg_left = 0;
+        c->state = CONN_HEADER;
+        if (!(c->reply = local_manifest_reply(fname, &sb, &c->hdr_len, 1))) {
+            c->state = CONN_HASHING;
+            list_push(&hashing, c);
+            struct epoll_event ev = { .events = 0, .data.ptr = c };
+            return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    } else {
+        uint64_t off = c->req_off, len = c->req_len;
+        if (off > (uint64_t)sb.st_size) return -1;
+        c->off = off;
+        c->end = (len == 0 || len > (uint64_t)sb.st_size - off) ? sb.st_size : (off_t)(off + len);
+
+        /* Media and archives are known incompressible from their magic;
+           anything else is tried on its first frame. */
+        c->squeeze = -1;
+        if (c->codecs & CODEC_LZ4) {
+            c->squeeze = local_compressible(fname);
+            unsigned char head[16];
+            ssize_t n;
+            if (c->squeeze == 0 && (n = pread(c->file, head, sizeof(head), 0)) > 0 && media_magic(head, n))
+                local_set_compressible(fname, c->squeeze = -1);
+        }
+
+        if (upload_slots && uploads_running >= upload_slots) return upload_wait(ep, c);
+        upload_begin(c);
+    }
+
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+int conn_readable(int ep, struct conn *c) {
+    size_t need;
+    while (c->req_got < (need = conn_need(c))) {
+        if (need > sizeof(c->req)) return -1;
+        ssize_t r = recv(c->fd, c->req + c->req_got, need - c->req_got, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return 0;
+        if (r <= 0) return -1;
+        c->req_got += r;
+    }
+    return conn_start(ep, c);
+}
+
+/* Reply finished: flush the corked tail and wait for the next request.
+   A legacy whole-file DOWNLOAD (zero length) still ends with the server
+   closing the connection. */
+int conn_reset(int ep, struct conn *c) {
+    upload_release(ep, c);
+    if (c->busy) { c->busy = 0; uploads_track(-1); }
+    if (c->type != STATS) {
+        __atomic_add_fetch(&pstats.served[stat_slot(c->type)], 1, __ATOMIC_RELAXED);
+        hist_add(&pstats.serve_us[stat_slot(c->type)], (now_ms() - c->started) * 1000);
+    }
+    int zero = 0;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    if (!c->v2 && c->type == DOWNLOAD && c->req_len == 0) return -1;
+    close(c->file);
+    c->file = -1;
+    free(c->reply);
+    c->reply = NULL;
+    c->req_got = 0;
+    c->state = CONN_REQUEST;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+int conn_writable(int ep, struct conn *c) {
+    double now = now_ms();
+    size_t turn = 0;
+    while (c->state != CONN_DONE) {
+        if (c->state == CONN_HEADER) {
+            const char *out = c->reply ? c->reply : c->hdr;
+            ssize_t w = send(c->fd, out + c->hdr_sent, c->hdr_len - c->hdr_sent, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && errno == EAGAIN) return 0;
+            if (w < 0) return -1;
+            c->hdr_sent += w;
+            if (c->hdr_sent < c->hdr_len) continue;
+            c->state = c->seg_left ? CONN_BODY : CONN_DONE;
+        } else {
+            if (turn >= UPLOAD_QUANTUM) return 0;
+            size_t allow = pace_allow(c, c->seg_left < UPLOAD_QUANTUM - turn ? c->seg_left : UPLOAD_QUANTUM - turn, now);
+            if (!allow) return conn_park(ep, c);
+            ssize_t w = c->body ? send(c->fd, c->body, allow, MSG_NOSIGNAL) : sendfile(c->fd, c->file, &c->off, allow);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && errno == EAGAIN) return 0;
+            if (w <= 0) return -1;
+            pace_charge(c, w);
+            turn += w;
+            __atomic_add_fetch(&uploads.bytes, w, __ATOMIC_RELAXED);
+            c->seg_left -= w;
+            if (c->body) c->body += w;
+            if (c->seg_left == 0) conn_next_frame(c);
+        }
+    }
+    return conn_reset(ep, c);
+}
+
+/* Content server: one epoll loop multiplexing every upload over the shared
+   listening socket, so a slow downloader never blocks the others or the menu. */
+void *server_main(void *arg) {
+    int lfd = *(int*)arg;
+    int ep = epoll_create1(0);
+    if (ep < 0) { perror("epoll_create1"); return NULL; }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev) < 0) { perror("epoll_ctl"); return NULL; }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, parked.count || hashing.count ? PACE_TICK_MS : -1);
+        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        if (parked.count) pace_wake(ep);
+        if (hashing.count) hashing_wake(ep);
+
+        for (int i = 0; i < n; ++i) {
+            struct conn *c = events[i].data.ptr;
+            if (!c) {
+                int fd;
+                struct sockaddr_in from;
+                socklen_t fromlen = sizeof(from);
+                while ((fd = accept4(lfd, (struct sockaddr*)&from, &fromlen, SOCK_NONBLOCK)) >= 0) {
+                    fromlen = sizeof(from);
+                    struct conn *nc = calloc(1, sizeof(*nc));
+                    if (!nc) { close(fd); continue; }
+                    if (peer_cap) {
+                        struct net_addr a;
+                        addr_from_sin(&a, &from);
+                        nc->peer = pace_get(&a);
                     }
+                    nc->fd = fd;
+                    nc->file = -1;
+                    nc->state = CONN_REQUEST;
+                    struct epoll_event cev = { .events = EPOLLIN, .data.ptr = nc };
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev) < 0) { close(fd); free(nc); continue; }
+                    __atomic_add_fetch(&pstats.connections, 1, __ATOMIC_RELAXED);
                 }
+                continue;
             }
-            else if (choice == 5) {
-                for (int i = 0; i < local_count; ++i) { send_deregister_udp(udpsock, &indexServer, peerName, local_names[i]); if (listen_fds[i] >= 0) close(listen_fds[i]); }
-                local_count = 0;
-                send_quit_udp(udpsock, &indexServer, peerName);
-                close(udpsock);
-                printf("Exiting.\n");
-                exit(0);
+
+            int rc;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && c->state != CONN_REQUEST) rc = -1;
+            else if (c->state == CONN_REQUEST) rc = conn_readable(ep, c);
+            else rc = conn_writable(ep, c);
+            if (rc < 0) conn_close(ep, c);
+        }
+    }
+    close(ep);
+    return NULL;
+}
+
+int connect_to(const struct net_addr *addr) {
+    struct sockaddr_storage ss;
+    socklen_t len = addr_to_sockaddr(addr, &ss);
+    int sock = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) { perror("socket"); return -1; }
+    tune_sock_buf(sock, SO_RCVBUF);
+    if (connect(sock, (struct sockaddr*)&ss, len) < 0) { close(sock); return -1; }
+    return sock;
+}
+
+/* A content request for a provider: a version 2 frame if it registered
+   through version 2, else a legacy register_pdu, which only holds names
+   of up to NAME_LEN-1 bytes. Returns the length, 0 if it cannot be sent. */
+size_t build_content_request(char *buf, size_t cap, int v2, char type, const char *name, uint64_t off, uint64_t len) {
+    if (v2) {
+        struct wbuf w;
+        frame_begin(&w, buf, cap, type, 0);
+        put_name(&w, F_CONTENT, name);
+        if (type == DOWNLOAD) {
+            put_uint(&w, F_OFFSET, off);
+            put_uint(&w, F_LENGTH, len);
+            put_uint(&w, F_FRAME, FRAME_MAX);
+            if (accept_codecs) put_uint(&w, F_CODECS, accept_codecs);
+        }
+        return frame_end(&w, buf);
+    }
+    struct register_pdu *req = (struct register_pdu*)buf;
+    if (strlen(name) >= NAME_LEN || cap < sizeof(*req)) return 0;
+    memset(req, 0, sizeof(*req));
+    req->type = type;
+    strcpy(req->contentName, name);
+    put_be64(&req->padding[0], off);
+    put_be64(&req->padding[8], len);
+    return sizeof(*req);
+}
+
+struct manifest {
+    uint64_t size;
+    uint32_t nchunks;
+    uint64_t *hashes;
+};
+
+int fetch_manifest(int sock, int v2, const char *contentName, struct manifest *m) {
+    char req[CONN_REQ_MAX];
+    size_t rlen = build_content_request(req, sizeof(req), v2, HASHES, contentName, 0, 0);
+    if (rlen == 0 || write_all(sock, req, rlen) != (ssize_t)rlen) return -1;
+
+    char hdr[13];
+    if (recv_all(sock, hdr, sizeof(hdr)) <= 0 || hdr[0] != HASHES) return -1;
+    m->size = get_be64(&hdr[1]);
+    uint32_t n; memcpy(&n, &hdr[9], 4); n = ntohl(n);
+    if (n != (m->size + SWARM_CHUNK - 1) / SWARM_CHUNK) return -1;
+
+    char *raw = malloc(8 * (size_t)n + 1);
+    m->hashes = malloc(sizeof(uint64_t) * ((size_t)n + 1));
+    if (!raw || !m->hashes || (n && recv_all(sock, raw, 8 * (size_t)n) <= 0)) { free(raw); free(m->hashes); m->hashes = NULL; return -1; }
+    for (uint32_t i = 0; i < n; ++i) m->hashes[i] = get_be64(&raw[8*i]);
+    free(raw);
+    m->nchunks = n;
+    return 0;
+}
+
+/* Request [off, off+len) of a file over an open connection into buf and
+   check the bytes against expect; nothing reaches the file here. buf is
+   a FRAME_MAX buffer from the pool and len is at most SWARM_CHUNK, so
+   the whole range lands in its lower half. A CONTENT_LZ4 frame is
+   received into the upper half and decoded in place. A frame that would
+   run past len fails the range. */
+int fetch_range(int sock, int v2, char *buf, const char *contentName, off_t off, size_t len, uint64_t expect) {
+    char req[CONN_REQ_MAX];
+    size_t rlen = build_content_request(req, sizeof(req), v2, DOWNLOAD, contentName, off, len);
+    if (len > FRAME_MAX / 2 || rlen == 0 || write_all(sock, req, rlen) != (ssize_t)rlen) return -1;
+
+    char hdr[9];
+    size_t got = 0;
+    while (1) {
+        if (recv_all(sock, hdr, 5) <= 0 || (hdr[0] != CONTENT && hdr[0] != CONTENT_LZ4)) return -1;
+        uint32_t flen; memcpy(&flen, &hdr[1], 4); flen = ntohl(flen);
+        if (hdr[0] == CONTENT_LZ4) {
+            uint32_t raw;
+            if (recv_all(sock, hdr + 5, 4) <= 0) return -1;
+            memcpy(&raw, &hdr[5], 4);
+            raw = ntohl(raw);
+            char *z = buf + FRAME_MAX / 2;
+            if (flen > FRAME_MAX / 2 || raw > len - got || recv_all(sock, z, flen) <= 0) return -1;
+            if (lz4_decompress((unsigned char*)z, flen, (unsigned char*)buf + got, raw) != (long)raw) return -1;
+            got += raw;
+            continue;
+        }
+        if (flen == 0) break;
+        if (flen > len - got || recv_all(sock, buf + got, flen) <= 0) return -1;
+        got += flen;
+    }
+    if (got != len) return -1;
+    struct xxh64 st;
+    xxh64_init(&st);
+    xxh64_update(&st, buf, len);
+    return xxh64_digest(&st) == expect ? 0 : -1;
+}
+
+/* Fetch the manifest of contentName from the first provider that gives one. */
+int provider_manifest(struct provider *provs, int nprov, const char *contentName, struct manifest *m) {
+    for (int i = 0; i < nprov; ++i) {
+        int sock = connect_to(&provs[i].addr);
+        if (sock < 0) continue;
+        int rc = fetch_manifest(sock, provs[i].flags & PROVIDER_V2, provs[i].contentName[0] ? provs[i].contentName : contentName, m);
+        close(sock);
+        if (rc == 0) return 0;
+    }
+    return -1;
+}
+
+/* Open or create the sidecar map of a partial download: a header (magic,
+   version, size, chunk size, chunk count), the chunk hashes, then a bitmap
+   of verified chunks. An existing map is only reused when its header and
+   hashes match the manifest; returns 1 in that case, 0 for a fresh map. */
+int map_open(const char *path, struct manifest *m, unsigned char *bits, int *mapfd) {
+    size_t nbytes = (m->nchunks + 7) / 8;
+    size_t len = MAP_HEADER + 8 * (size_t)m->nchunks + nbytes;
+    char *want = calloc(1, len);
+    char *have = malloc(len);
+    if (!want || !have) { free(want); free(have); return -1; }
+
+    memcpy(want, MAP_MAGIC, 4);
+    uint32_t v = htonl(1), chunk = htonl(SWARM_CHUNK), n = htonl(m->nchunks);
+    memcpy(&want[4], &v, 4);
+    put_be64(&want[8], m->size);
+    memcpy(&want[16], &chunk, 4);
+    memcpy(&want[20], &n, 4);
+    for (uint32_t i = 0; i < m->nchunks; ++i) put_be64(&want[MAP_HEADER + 8*i], m->hashes[i]);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) { free(want); free(have); return -1; }
+    int reuse = pread(fd, have, len, 0) == (ssize_t)len && memcmp(have, want, len - nbytes) == 0;
+    if (reuse) memcpy(bits, have + len - nbytes, nbytes);
+    else {
+        memset(bits, 0, nbytes);
+        if (ftruncate(fd, 0) < 0 || pwrite(fd, want, len, 0) != (ssize_t)len) { close(fd); fd = -1; }
+    }
+    free(want);
+    free(have);
+    *mapfd = fd;
+    return fd < 0 ? -1 : reuse;
+}
+
+enum { CHUNK_TODO, CHUNK_INFLIGHT, CHUNK_DONE };
+
+/* Shared state of one multi-source download. Sources pull the next pending
+   chunk, so fast providers naturally take more of the file. Once nothing is
+   pending an idle source re-fetches a chunk still held by a single slower
+   source, and whichever copy lands first completes it. Every verified chunk
+   is recorded in the sidecar bitmap so an interrupted download resumes. */
+struct swarm {
+    const char *name;
+    int fd;
+    struct manifest m;
+    size_t done;
+    unsigned char *state;
+    unsigned char *fetchers;
+    unsigned char *bits;
+    int mapfd;
+    pthread_mutex_t lock;
+};
+
+struct source {
+    struct swarm *sw;
+    struct provider prov;
+    uint64_t bytes;
+    pthread_t tid;
+};
+
+long swarm_claim(struct swarm *sw) {
+    long pick = -1;
+    pthread_mutex_lock(&sw->lock);
+    for (size_t i = 0; i < sw->m.nchunks && pick == -1; ++i)
+        if (sw->state[i] == CHUNK_TODO) pick = i;
+    for (size_t i = 0; i < sw->m.nchunks && pick == -1; ++i)
+        if (sw->state[i] == CHUNK_INFLIGHT && sw->fetchers[i] == 1) pick = i;
+    if (pick != -1) { sw->state[pick] = CHUNK_INFLIGHT; sw->fetchers[pick]++; }
+    pthread_mutex_unlock(&sw->lock);
+    return pick;
+}
+
+/* Release a claim on chunk. A verified copy in buf is written only if
+   no other source completed the chunk first, under the lock, so a late
+   duplicate never rewrites verified bytes. */
+void swarm_finish(struct swarm *sw, long chunk, int ok, const char *buf, size_t len) {
+    pthread_mutex_lock(&sw->lock);
+    sw->fetchers[chunk]--;
+    if (ok && sw->state[chunk] != CHUNK_DONE && pwrite(sw->fd, buf, len, (off_t)chunk * SWARM_CHUNK) != (ssize_t)len) {
+        perror("pwrite");
+        ok = 0;
+    }
+    if (ok && sw->state[chunk] != CHUNK_DONE) {
+        sw->state[chunk] = CHUNK_DONE;
+        sw->done++;
+        sw->bits[chunk / 8] |= 1 << (chunk % 8);
+        if (pwrite(sw->mapfd, &sw->bits[chunk / 8], 1, MAP_HEADER + 8 * (off_t)sw->m.nchunks + chunk / 8) != 1) perror("pwrite");
+    }
+    else if (!ok && sw->state[chunk] == CHUNK_INFLIGHT && sw->fetchers[chunk] == 0) sw->state[chunk] = CHUNK_TODO;
+    pthread_mutex_unlock(&sw->lock);
+}
+
+void *source_main(void *arg) {
+    struct source *src = arg;
+    struct swarm *sw = src->sw;
+    const char *name = src->prov.contentName[0] ? src->prov.contentName : sw->name;
+    int sock = connect_to(&src->prov.addr);
+    if (sock < 0) return NULL;
+    char *buf = frame_buf_get();
+    if (!buf) { close(sock); return NULL; }
+
+    long chunk;
+    while ((chunk = swarm_claim(sw)) != -1) {
+        off_t off = (off_t)chunk * SWARM_CHUNK;
+        size_t len = sw->m.size - off > SWARM_CHUNK ? SWARM_CHUNK : (size_t)(sw->m.size - off);
+        double t = now_ms();
+        int ok = fetch_range(sock, src->prov.flags & PROVIDER_V2, buf, name, off, len, sw->m.hashes[chunk]) == 0;
+        if (ok) {
+            hist_add(&pstats.fetch_us, (now_ms() - t) * 1000);
+            __atomic_add_fetch(&pstats.bytes_fetched, len, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(ok ? &pstats.chunks_ok : &pstats.chunks_bad, 1, __ATOMIC_RELAXED);
+        swarm_finish(sw, chunk, ok, buf, len);
+        if (!ok) break;
+        src->bytes += len;
+    }
+    frame_buf_put(buf);
+    close(sock);
+    return NULL;
+}
+
+/* Re-hash chunks a previous run marked verified and clear any that no
+   longer match, so a damaged partial file is repaired rather than trusted. */
+size_t swarm_resume(struct swarm *sw) {
+    char *buf = frame_buf_get();
+    if (!buf) return 0;
+    for (size_t i = 0; i < sw->m.nchunks; ++i) {
+        if (!(sw->bits[i / 8] & (1 << (i % 8)))) continue;
+        off_t off = (off_t)i * SWARM_CHUNK;
+        size_t len = sw->m.size - off > SWARM_CHUNK ? SWARM_CHUNK : (size_t)(sw->m.size - off);
+        struct xxh64 st;
+        xxh64_init(&st);
+        if (pread(sw->fd, buf, len, off) == (ssize_t)len) xxh64_update(&st, buf, len);
+        if (xxh64_digest(&st) == sw->m.hashes[i]) { sw->state[i] = CHUNK_DONE; sw->done++; }
+        else sw->bits[i / 8] &= ~(1 << (i % 8));
+    }
+    frame_buf_put(buf);
+    return sw->done;
+}
+
+/* Download contentName from several providers at once, one thread and one
+   persistent connection per provider, into <name>.part. The file is renamed
+   into place only once every chunk has been verified; otherwise the partial
+   file and its map are kept for the next attempt. On success the verified
+   manifest is handed back in *out for re-seeding. Providers may serve
+   the bytes under other names; those that reported a digest other than
+   the manifest's are dropped from provs, as their chunks would fail. */
+int swarm_download(struct provider *provs, int nprov, const char *contentName, struct manifest *out) {
+    struct swarm sw = { .name = contentName, .fd = -1, .mapfd = -1 };
+    int i;
+    if (provider_manifest(provs, nprov, contentName, &sw.m) < 0) return -1;
+
+    uint64_t digest = manifest_digest(sw.m.size, sw.m.hashes, sw.m.nchunks);
+    int keep = 0;
+    for (i = 0; i < nprov; ++i)
+        if (!provs[i].digest || provs[i].digest == digest) provs[keep++] = provs[i];
+    nprov = keep;
+
+    char part[NAME_MAX_LEN + 8], map[NAME_MAX_LEN + 12];
+    snprintf(part, sizeof(part), "%s.part", contentName);
+    snprintf(map, sizeof(map), "%s.part.map", contentName);
+
+    int rc = -1;
+    struct source *srcs = calloc(nprov, sizeof(*srcs));
+    sw.state = calloc(sw.m.nchunks + 1, 1);
+    sw.fetchers = calloc(sw.m.nchunks + 1, 1);
+    sw.bits = calloc(sw.m.nchunks / 8 + 1, 1);
+    if (!srcs || !sw.state || !sw.fetchers || !sw.bits) goto out;
+
+    int reuse = map_open(map, &sw.m, sw.bits, &sw.mapfd);
+    if (reuse < 0) { perror("open"); goto out; }
+    sw.fd = open(part, O_RDWR | O_CREAT | (reuse ? 0 : O_TRUNC), 0644);
+    if (sw.fd < 0) { perror("open"); goto out; }
+    /* Reserve the blocks up front so out-of-order chunk writes do not
+       fragment the file; not every filesystem supports it. */
+    if (ftruncate(sw.fd, sw.m.size) < 0) perror("ftruncate");
+    if (sw.m.size && fallocate(sw.fd, 0, 0, sw.m.size) < 0 && errno != EOPNOTSUPP) perror("fallocate");
+    if (reuse && swarm_resume(&sw)) printf("Resuming %s: %zu of %u chunks already verified\n", contentName, sw.done, sw.m.nchunks);
+
+    pthread_mutex_init(&sw.lock, NULL);
+    int started = 0;
+    for (i = 0; i < nprov; ++i) {
+        srcs[i].sw = &sw;
+        srcs[i].prov = provs[i];
+        if (pthread_create(&srcs[i].tid, NULL, source_main, &srcs[i]) == 0) started++;
+        else srcs[i].tid = 0;
+    }
+    for (i = 0; i < nprov; ++i) if (srcs[i].tid) pthread_join(srcs[i].tid, NULL);
+    pthread_mutex_destroy(&sw.lock);
+
+    char host[INET6_ADDRSTRLEN];
+    for (i = 0; i < nprov; ++i)
+        if (srcs[i].bytes) printf("  %llu bytes from %s (%s:%d)%s%s\n", (unsigned long long)srcs[i].bytes, srcs[i].prov.peerName,
+                                  addr_str(&srcs[i].prov.addr, host, sizeof(host)), ntohs(srcs[i].prov.addr.port),
+                                  srcs[i].prov.contentName[0] ? " as " : "", srcs[i].prov.contentName);
+
+    if (sw.done == sw.m.nchunks && (started || sw.m.nchunks == 0)) {
+        if (fdatasync(sw.fd) == 0 && rename(part, contentName) == 0) {
+            unlink(map);
+            rc = 0;
+        } else perror("rename");
+    } else printf("Incomplete: %zu of %u chunks verified, kept %s for resume\n", sw.done, sw.m.nchunks, part);
+
+out:
+    if (sw.fd >= 0) close(sw.fd);
+    if (sw.mapfd >= 0) close(sw.mapfd);
+    free(srcs);
+    free(sw.state);
+    free(sw.fetchers);
+    free(sw.bits);
+    if (rc == 0) *out = sw.m;
+    else free(sw.m.hashes);
+    return rc;
+}
+
+/* Make a served file a cache entry of the given size. */
+void cache_add(const char *name, uint64_t bytes, int replicas) {
+    pthread_mutex_lock(&local_lock);
+    struct local_file *lf = *local_find(name);
+    if (lf) {
+        if (lf->cached) cache_used -= lf->cache_bytes;
+        lf->cached = 1;
+        lf->cache_bytes = bytes;
+        lf->replicas = replicas;
+        lf->last_used = now_ms();
+        cache_used += bytes;
+    }
+    pthread_mutex_unlock(&local_lock);
+}
+
+struct cache_victim {
+    struct local_file *lf;
+    double key;
+};
+
+int victim_cmp(const void *a, const void *b) {
+    double ka = ((const struct cache_victim*)a)->key, kb = ((const struct cache_victim*)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+/* Batch records to admit a download of the given size: DEREGISTER for
+   each cache entry to evict, least recently used or least demanded per
+   replica first, then REGISTER for name itself, in *n records. Returns
+   NULL if the download alone exceeds the quota. */
+struct batch_record *cache_plan(const char *name, uint64_t bytes, int *n) {
+    if (cache_quota && bytes > cache_quota) return NULL;
+    pthread_mutex_lock(&local_lock);
+    struct cache_victim *v = calloc(local_count + 1, sizeof(*v));
+    struct batch_record *recs = calloc(local_count + 2, sizeof(*recs));
+    int nv = 0, count = 0;
+    double now = now_ms();
+    for (int b = 0; v && b < LOCAL_BUCKETS; ++b)
+        for (struct local_file *lf = local_table[b]; lf; lf = lf->next) {
+            if (!lf->cached || strcmp(lf->name, name) == 0) continue;
+            v[nv].lf = lf;
+            v[nv++].key = cache_by_demand ? local_demand(lf, now) / (1 + lf->replicas) : lf->last_used;
+        }
+    if (v && recs) {
+        qsort(v, nv, sizeof(*v), victim_cmp);
+        struct local_file *self = *local_find(name);
+        uint64_t used = cache_used - (self && self->cached ? self->cache_bytes : 0) + bytes;
+        for (int i = 0; cache_quota && i < nv && used > cache_quota; ++i) {
+            if (!(recs[count].contentName = strdup(v[i].lf->name))) break;
+            recs[count++].op = DEREGISTER;
+            used -= v[i].lf->cache_bytes;
+        }
+        if ((recs[count].contentName = strdup(name))) recs[count++].op = REGISTER;
+    }
+    pthread_mutex_unlock(&local_lock);
+    free(v);
+    if (recs && (count == 0 || recs[count-1].op != REGISTER)) { batch_free(recs, count); return NULL; }
+    *n = count;
+    return recs;
+}
+
+/* Register a verified download and evict cache entries to make room, in
+   one BATCH_UPDATE. Evicted files are dropped whether or not the index
+   acknowledged, since their rows expire with the lease anyway. */
+void cache_admit(const char *name, int replicas, struct net_addr *self, struct manifest *m) {
+    struct stat sb;
+    int n;
+    struct batch_record *recs = stat(name, &sb) == 0 ? cache_plan(name, sb.st_size, &n) : NULL;
+    if (!recs) { printf("%s exceeds the cache quota; kept but not re-seeded\n", name); return; }
+    recs[n-1].digest = manifest_digest(m->size, m->hashes, m->nchunks);
+    char *status = malloc(n);
+    if (!status) { batch_free(recs, n); return; }
+    send_batch_routed(peerName, recs, n, self, status);
+    for (int i = 0; i < n - 1; ++i) {
+        struct stat vb;
+        uint64_t bytes = stat(recs[i].contentName, &vb) == 0 ? (uint64_t)vb.st_size : 0;
+        local_remove(recs[i].contentName);
+        if (unlink(recs[i].contentName) < 0) perror("unlink");
+        printf("Evicted %s (%llu bytes) to stay within the cache quota\n", recs[i].contentName, (unsigned long long)bytes);
+    }
+    if (status[n-1] == 'A' || status[n-1] == 'D' || dht_sock >= 0) {
+        local_add(name);
+        cache_add(name, sb.st_size, replicas);
+        /* The hashes just verified become this peer's manifest. */
+        if (m->hashes) { local_set_manifest(name, &sb, m->hashes, m->nchunks); m->hashes = NULL; }
+        dht_publish(name, recs[n-1].digest);
+        printf("Auto-registered downloaded content %s\n", name);
+    } else printf("Could not register %s\n", name);
+    free(status);
+    batch_free(recs, n);
+}
+
+/* Withdraw every local file in batches, then QUIT. */
+void leave_index(struct net_addr *self) {
+    int n;
+    struct batch_record *recs = local_records(DEREGISTER, &n);
+    char *status = malloc(n + 1);
+    if (recs && status && n) printf("Deregistered %d of %d files\n", send_batch_routed(peerName, recs, n, self, status), n);
+    free(status);
+    batch_free(recs, n);
+    send_quit_udp(peerName);
+}
+
+/* Whether a local file already holds contentName's bytes, so it can be
+   linked rather than downloaded. The digests providers report are only
+   a hint: they must all agree, the manifest fetched from a provider must
+   hash to that digest, and so must the local file as it is now. Returns
+   0 with the file in have and the digest in *digest. */
+int local_same_bytes(struct provider *provs, int nprov, const char *contentName, char *have, uint64_t *digest) {
+    uint64_t claimed = 0;
+    for (int i = 0; i < nprov; ++i)
+        if (provs[i].digest) {
+            if (claimed && provs[i].digest != claimed) return -1;
+            claimed = provs[i].digest;
+        }
+    if (!claimed || !local_by_digest(claimed, contentName, have)) return -1;
+    struct manifest m = {0};
+    if (provider_manifest(provs, nprov, contentName, &m) < 0) return -1;
+    uint64_t d = manifest_digest(m.size, m.hashes, m.nchunks);
+    free(m.hashes);
+    if (d != claimed || file_digest(have) != d) return -1;
+    *digest = d;
+    return 0;
+}
+
+uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': v <<= 10; /* fall through */
+        case 'M': case 'm': v <<= 10; /* fall through */
+        case 'K': case 'k': v <<= 10;
+    }
+    return v;
+}
+
+void printOptions() {
+    printf("[1] Content Listing\n[2] Content Registration\n[3] Content Download\n[4] Content De-Registration\n[5] Quit\n[6] Content Name Search\n[7] Statistics\n[8] Provider Lookup\n");
+}
+
+int main(int argc, char **argv) {
+    char *host = "localhost";
+    int port = 3000;
+    char *seed_dir = NULL, *name = NULL;
+    int interval = 30;
+    int dht_port = -1;
+    char *dht_boot = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "d:k:n:q:e:zu:U:s:J:j:D:")) != -1) {
+        switch (c) {
+            case 'd': seed_dir = optarg; break;
+            case 'k': interval = atoi(optarg); break;
+            case 'n': name = optarg; break;
+            case 'q': cache_quota = parse_size(optarg); break;
+            case 'e': cache_by_demand = strcmp(optarg, "demand") == 0; break;
+            case 'z': accept_codecs = 0; break;
+            case 'u': egress_cap = parse_size(optarg); break;
+            case 'U': peer_cap = parse_size(optarg); break;
+            case 's': upload_slots = atoi(optarg); break;
+            case 'J': dht_port = atoi(optarg); break;
+            case 'j': dht_boot = optarg; break;
+            case 'D':
+                dht_mode = strcmp(optarg, "race") == 0 ? DHT_RACE : strcmp(optarg, "first") == 0 ? DHT_FIRST
+                         : strcmp(optarg, "off") == 0 ? DHT_OFF : DHT_FALLBACK;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-d seed_dir] [-k heartbeat_seconds] [-n peer_name] [-q cache_quota[KMG]] [-e lru|demand] [-z]\n"
+                                "       [-u egress_bytes_per_s[KMG]] [-U per_peer_bytes_per_s[KMG]] [-s upload_slots]\n"
+                                "       [-J dht_port [-j dht_host:port] [-D fallback|race|first|off]] [host [port]]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) host = argv[optind];
+    if (optind + 1 < argc) port = atoi(argv[optind + 1]);
+    if (seed_dir && chdir(seed_dir) < 0) { perror("chdir"); exit(EXIT_FAILURE); }
+    started_ms = now_ms();
+
+    /* With -n the peer runs without the menu, serving until SIGINT or
+       SIGTERM; block both before any thread starts so main takes them. */
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    if (name) pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+    struct hostent *phe;
+    struct sockaddr_in indexServer = {0};
+    indexServer.sin_family = AF_INET;
+    indexServer.sin_port = htons(port);
+    if ((phe = gethostbyname(host))) memcpy(&indexServer.sin_addr, phe->h_addr, phe->h_length);
+    else if ((indexServer.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) { fprintf(stderr,"Can't get host entry\n"); exit(EXIT_FAILURE); }
+
+    struct net_addr index_addr;
+    addr_from_sin(&index_addr, &indexServer);
+    if (!(index_uc = client_for(&index_addr))) exit(EXIT_FAILURE);
+
+    struct sockaddr_in content_addr;
+    int lfd = create_passive_socket(&content_addr);
+    if (lfd < 0) exit(EXIT_FAILURE);
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, server_main, &lfd) != 0) { perror("pthread_create"); exit(EXIT_FAILURE); }
+
+    if (name) snprintf(peerName, sizeof(peerName), "%s", name);
+    else {
+        printf("Enter your peer name: ");
+        if (!fgets(peerName, sizeof(peerName), stdin)) { fprintf(stderr, "No name\n"); exit(1); }
+        peerName[strcspn(peerName, "\n")] = '\0';
+    }
+    printf("Serving content on %s:%d\n", inet_ntoa(content_addr.sin_addr), ntohs(content_addr.sin_port));
+    struct net_addr self;
+    addr_from_sin(&self, &content_addr);
+    serving_addr = self;
+    if (dht_port >= 0) {
+        if (dht_start(dht_port) < 0) exit(EXIT_FAILURE);
+        if (dht_boot) {
+            char bhost[256];
+            int bport = 0;
+            struct sockaddr_in bsin = { .sin_family = AF_INET };
+            struct net_addr boot;
+            if (sscanf(dht_boot, "%255[^:]:%d", bhost, &bport) == 2 && (phe = gethostbyname(bhost))) {
+                memcpy(&bsin.sin_addr, phe->h_addr, phe->h_length);
+                bsin.sin_port = htons(bport);
+                addr_from_sin(&boot, &bsin);
+                dht_join(&boot);
+            } else fprintf(stderr, "Bad DHT contact %s\n", dht_boot);
+        }
+    }
+    cluster_refresh();
+    if (seed_dir) seed_directory(&self);
+    pthread_t dht_thread;
+    if (dht_sock >= 0 && pthread_create(&dht_thread, NULL, dht_maintain_main, NULL) != 0) { perror("pthread_create"); exit(EXIT_FAILURE); }
+
+    struct heartbeat_args hb = { self, interval };
+    pthread_t heartbeat_thread;
+    if (interval > 0 && pthread_create(&heartbeat_thread, NULL, heartbeat_main, &hb) != 0) { perror("pthread_create"); exit(EXIT_FAILURE); }
+
+    if (name) {
+        fflush(stdout);
+        int sig;
+        sigwait(&stop, &sig);
+        leave_index(&self);
+        exit(0);
+    }
+
+    while (1) {
+        printOptions();
+        printf("Enter your option here: ");
+        fflush(stdout);
+        int choice = 0;
+        int rc = scanf("%d", &choice);
+        if (rc == EOF) choice = 5;
+        else {
+            int ch;
+            while ((ch = getchar()) != '\n' && ch != EOF);
+            if (rc != 1) continue;
+        }
+
+        if (choice == 1) send_online_udp();
+        else if (choice == 2) {
+            char fname[NAME_MAX_LEN+2]; printf("Enter file name to register: ");
+            if (!fgets(fname, sizeof(fname), stdin)) continue;
+            fname[strcspn(fname, "\n")] = '\0';
+            if (strlen(fname) == 0 || access(fname, F_OK) != 0) continue;
+
+            /* Added first so the manifest built for the digest is kept. */
+            int had = local_has(fname);
+            local_add(fname);
+            uint64_t digest = file_digest(fname);
+            if (send_register_udp(peerName, fname, &self, digest) == 0)
+                printf("Registered %s, served on %s:%d\n", fname, inet_ntoa(content_addr.sin_addr), ntohs(content_addr.sin_port));
+            else if (!had && dht_sock < 0) local_remove(fname);
+            if (dht_sock >= 0) dht_publish(fname, digest);
+        }
+        else if (choice == 3) {
+            char cname[NAME_MAX_LEN+2]; printf("Enter file to download: ");
+            if (!fgets(cname, sizeof(cname), stdin)) continue;
+            cname[strcspn(cname, "\n")] = '\0';
+            if (strlen(cname) == 0) continue;
+
+            struct provider provs[MAX_PROVIDERS];
+            struct manifest m = {0};
+            int count = 0, n = 0;
+            int found = search_providers(cname, MAX_PROVIDERS, provs, &count);
+            if (found != 0) { if (found == 1) printf("Content not found\n"); continue; }
+            /* The same bytes may already be stored here under another
+               name; a hard link serves them without a second copy. */
+            char have[NAME_MAX_LEN+1];
+            uint64_t digest;
+            if (local_same_bytes(provs, count, cname, have, &digest) == 0) {
+                if (link(have, cname) == 0) {
+                    printf("%s holds the same bytes; linked instead of downloading\n", have);
+                    local_add(cname);
+                    local_set_digest(cname, digest);
+                    if (send_register_udp(peerName, cname, &self, digest) != 0 && dht_sock < 0) local_remove(cname);
+                    if (dht_sock >= 0) dht_publish(cname, digest);
+                    continue;
+                }
+                perror("link");
             }
+            for (int i = 0; i < count; ++i)
+                if (strcmp(provs[i].peerName, peerName) != 0) provs[n++] = provs[i];
+            if (n == 0) { printf("Only this peer provides %s\n", cname); continue; }
+            printf("Downloading %s from %d provider%s\n", cname, n, n == 1 ? "" : "s");
+            int rc = swarm_download(provs, n, cname, &m);
+
+            if (rc == 0) {
+                printf("Downloaded %s successfully\n", cname);
+                cache_admit(cname, n, &self, &m);
+            } else printf("Download failed\n");
+            free(m.hashes);
+        }
+        else if (choice == 4) {
+            char cname[NAME_MAX_LEN+2]; printf("Enter content to deregister: ");
+            if (!fgets(cname, sizeof(cname), stdin)) continue;
+            cname[strcspn(cname, "\n")] = '\0';
+            if (strlen(cname) == 0) continue;
+            if (send_deregister_udp(peerName, cname) == 0) local_remove(cname);
+        }
+        else if (choice == 6) {
+            char pattern[NAME_MAX_LEN+3]; printf("Enter name prefix (ending in *) or substring: ");
+            if (!fgets(pattern, sizeof(pattern), stdin)) continue;
+            pattern[strcspn(pattern, "\n")] = '\0';
+            if (strlen(pattern) == 0) continue;
+            send_name_search_udp(pattern);
+        }
+        else if (choice == 8) {
+            char cname[NAME_MAX_LEN+2]; printf("Enter content to look up: ");
+            if (!fgets(cname, sizeof(cname), stdin)) continue;
+            cname[strcspn(cname, "\n")] = '\0';
+            if (strlen(cname) == 0) continue;
+
+            struct provider provs[MAX_PROVIDERS];
+            int count = 0;
+            int found = search_providers(cname, MAX_PROVIDERS, provs, &count);
+            if (found != 0) { if (found == 1) printf("Content not found\n"); continue; }
+            for (int i = 0; i < count; ++i) {
+                char ip[INET6_ADDRSTRLEN];
+                printf("%s at %s:%d\n", provs[i].peerName, addr_str(&provs[i].addr, ip, sizeof(ip)), ntohs(provs[i].addr.port));
+            }
+        }
+        else if (choice == 7) {
+            char text[2048];
+            stats_text(text, sizeof(text));
+            fputs(text, stdout);
+        }
+        else if (choice == 5) {
+            leave_index(&self);
+            close(lfd);
+            printf("Exiting.\n");
+            exit(0);
         }
     }
 
-    close(udpsock);
     return 0;
 }